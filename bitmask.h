@@ -0,0 +1,226 @@
+#ifndef __SPARROW_BITMASK_H__
+#define __SPARROW_BITMASK_H__
+/* One bit per pixel masks (sparrow_bitmask_t, in gstsparrow.h), used for the
+   screen mask and by find_screen (floodfill.c) to make it.
+
+   Each row starts on a fresh 64 bit word, with pixel x in bit x % 64 of word
+   x / 64. Bits past the width are always left clear, so whole words can be
+   shifted, and-ed and or-ed without looking at the edges.
+*/
+
+#include "sparrow.h"
+#include <string.h>
+
+static inline void
+bitmask_init(sparrow_bitmask_t *m, guint32 width, guint32 height){
+  m->width = width;
+  m->height = height;
+  m->row_words = (width + 63) / 64;
+  m->bits = zalloc_aligned_or_die(m->row_words * height * sizeof(guint64));
+}
+
+static inline void
+bitmask_free(sparrow_bitmask_t *m){
+  free(m->bits);
+  m->bits = NULL;
+}
+
+static inline guint64 *
+bitmask_row(const sparrow_bitmask_t *m, guint32 y){
+  return m->bits + y * m->row_words;
+}
+
+/*the valid bits of the last word of each row */
+static inline guint64
+bitmask_row_end(const sparrow_bitmask_t *m){
+  guint32 r = m->width & 63;
+  return r ? (1ULL << r) - 1 : ~0ULL;
+}
+
+static inline int
+bitmask_test(const sparrow_bitmask_t *m, guint32 x, guint32 y){
+  return (bitmask_row(m, y)[x / 64] >> (x & 63)) & 1;
+}
+
+static inline void
+bitmask_set(sparrow_bitmask_t *m, guint32 x, guint32 y){
+  bitmask_row(m, y)[x / 64] |= 1ULL << (x & 63);
+}
+
+static inline void
+bitmask_set_all(sparrow_bitmask_t *m){
+  guint64 end = bitmask_row_end(m);
+  for (guint32 y = 0; y < m->height; y++){
+    guint64 *row = bitmask_row(m, y);
+    memset(row, 255, m->row_words * sizeof(guint64));
+    row[m->row_words - 1] = end;
+  }
+}
+
+/*bytes are set if non-zero, as in an 8 bit OpenCV mask */
+static inline UNUSED void
+bitmask_from_bytes(sparrow_bitmask_t *m, const guint8 *bytes){
+  for (guint32 y = 0; y < m->height; y++){
+    guint64 *row = bitmask_row(m, y);
+    const guint8 *b = bytes + y * m->width;
+    for (guint32 j = 0; j < m->row_words; j++){
+      guint64 word = 0;
+      guint32 n = MIN(64, m->width - j * 64);
+      for (guint32 k = 0; k < n; k++){
+        word |= (guint64)(b[j * 64 + k] != 0) << k;
+      }
+      row[j] = word;
+    }
+  }
+}
+
+static inline UNUSED void
+bitmask_to_bytes(const sparrow_bitmask_t *m, guint8 *bytes){
+  for (guint32 y = 0; y < m->height; y++){
+    for (guint32 x = 0; x < m->width; x++){
+      bytes[y * m->width + x] = bitmask_test(m, x, y) ? 255 : 0;
+    }
+  }
+}
+
+/*3x3 dilation, as cvDilate with the default kernel: beyond the edges counts
+  as clear. tmp is a mask of the same size. */
+static inline UNUSED void
+bitmask_dilate(sparrow_bitmask_t *m, sparrow_bitmask_t *tmp){
+  guint32 rw = m->row_words;
+  guint64 end = bitmask_row_end(m);
+  for (guint32 y = 0; y < m->height; y++){
+    const guint64 *row = bitmask_row(m, y);
+    guint64 *t = bitmask_row(tmp, y);
+    for (guint32 j = 0; j < rw; j++){
+      guint64 x = row[j];
+      guint64 left = (x << 1) | (j ? row[j - 1] >> 63 : 0);
+      guint64 right = (x >> 1) | (j + 1 < rw ? row[j + 1] << 63 : 0);
+      t[j] = x | left | right;
+    }
+    t[rw - 1] &= end;
+  }
+  for (guint32 y = 0; y < m->height; y++){
+    guint64 *row = bitmask_row(m, y);
+    const guint64 *t = bitmask_row(tmp, y);
+    const guint64 *above = y ? t - rw : NULL;
+    const guint64 *below = (y + 1 < m->height) ? t + rw : NULL;
+    for (guint32 j = 0; j < rw; j++){
+      row[j] = t[j] | (above ? above[j] : 0) | (below ? below[j] : 0);
+    }
+  }
+}
+
+/*spread the set bits of gen through the runs of set bits in pro that they
+  are in, towards higher (fill_up) or lower (fill_down) bits. gen must be
+  inside pro. A Kogge-Stone fill: each step doubles the reach. */
+static inline guint64
+bitmask_fill_up(guint64 gen, guint64 pro){
+  gen |= pro & (gen << 1);
+  pro &= pro << 1;
+  gen |= pro & (gen << 2);
+  pro &= pro << 2;
+  gen |= pro & (gen << 4);
+  pro &= pro << 4;
+  gen |= pro & (gen << 8);
+  pro &= pro << 8;
+  gen |= pro & (gen << 16);
+  pro &= pro << 16;
+  gen |= pro & (gen << 32);
+  return gen;
+}
+
+static inline guint64
+bitmask_fill_down(guint64 gen, guint64 pro){
+  gen |= pro & (gen >> 1);
+  pro &= pro >> 1;
+  gen |= pro & (gen >> 2);
+  pro &= pro >> 2;
+  gen |= pro & (gen >> 4);
+  pro &= pro >> 4;
+  gen |= pro & (gen >> 8);
+  pro &= pro >> 8;
+  gen |= pro & (gen >> 16);
+  pro &= pro >> 16;
+  gen |= pro & (gen >> 32);
+  return gen;
+}
+
+/*grow row y of fill from the row next to it, then along the row, within
+  region. Returns TRUE if anything changed. */
+static inline gboolean
+bitmask_fill_row(sparrow_bitmask_t *fill, const sparrow_bitmask_t *region,
+    guint32 y, const guint64 *next){
+  guint32 rw = fill->row_words;
+  guint64 *f = bitmask_row(fill, y);
+  const guint64 *r = bitmask_row(region, y);
+  guint64 changed = 0;
+  guint64 carry = 0;
+  for (guint32 j = 0; j < rw; j++){
+    guint64 old = f[j];
+    guint64 gen = old | (next ? next[j] & r[j] : 0) | (carry & r[j]);
+    gen = bitmask_fill_up(gen, r[j]);
+    carry = gen >> 63;
+    changed |= gen ^ old;
+    f[j] = gen;
+  }
+  carry = 0;
+  for (guint32 j = rw; j-- > 0;){
+    guint64 gen = f[j] | ((carry << 63) & r[j]);
+    gen = bitmask_fill_down(gen, r[j]);
+    carry = gen & 1;
+    changed |= gen ^ f[j];
+    f[j] = gen;
+  }
+  return changed != 0;
+}
+
+/*Clear from m the pixels 4-connected to (x, y) through pixels that are the
+  same colour as it in im, and still set in m -- the same as
+  floodfill_mono_superfast (floodfill.h) on 8 bit images, including leaving a
+  lonely start pixel alone. region and fill are scratch masks of the same
+  size. Rows are swept down and up until nothing changes; a convex shape
+  takes one sweep each way, and another to see it is done. */
+static inline UNUSED void
+bitmask_floodfill(sparrow_bitmask_t *m, const sparrow_bitmask_t *im,
+    guint32 x, guint32 y, sparrow_bitmask_t *region, sparrow_bitmask_t *fill){
+  guint32 rw = m->row_words;
+  guint32 h = m->height;
+  guint64 end = bitmask_row_end(m);
+  guint64 invert = bitmask_test(im, x, y) ? 0 : ~0ULL;
+  for (guint32 i = 0; i < h; i++){
+    const guint64 *a = bitmask_row(im, i);
+    const guint64 *b = bitmask_row(m, i);
+    guint64 *r = bitmask_row(region, i);
+    for (guint32 j = 0; j < rw; j++){
+      r[j] = (a[j] ^ invert) & b[j];
+    }
+    r[rw - 1] &= end;
+  }
+  if (! ((x > 0 && bitmask_test(region, x - 1, y)) ||
+          (x + 1 < m->width && bitmask_test(region, x + 1, y)) ||
+          (y > 0 && bitmask_test(region, x, y - 1)) ||
+          (y + 1 < h && bitmask_test(region, x, y + 1)))){
+    return;
+  }
+  /*the start is in the fill even if it isn't in m */
+  bitmask_row(region, y)[x / 64] |= 1ULL << (x & 63);
+  memset(fill->bits, 0, rw * h * sizeof(guint64));
+  bitmask_row(fill, y)[x / 64] |= 1ULL << (x & 63);
+  gboolean changed;
+  do {
+    changed = FALSE;
+    for (guint32 i = 0; i < h; i++){
+      changed |= bitmask_fill_row(fill, region, i, i ? bitmask_row(fill, i - 1) : NULL);
+    }
+    for (guint32 i = h; i-- > 0;){
+      changed |= bitmask_fill_row(fill, region, i,
+          (i + 1 < h) ? bitmask_row(fill, i + 1) : NULL);
+    }
+  } while (changed);
+  for (guint32 i = 0; i < rw * h; i++){
+    m->bits[i] &= ~fill->bits[i];
+  }
+}
+
+#endif
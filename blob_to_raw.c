@@ -0,0 +1,149 @@
+/* Copyright (C) <2010> Douglas Bagnall <douglas@halo.gen.nz>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Convert jpeg.blob + jpeg.index into a raw.blob of pre-decoded frames (see
+   sparrow_raw_header_t in gstsparrow.h).
+
+   usage: blob-to-raw jpeg.blob jpeg.index raw.blob [rshift]
+
+   rshift is the output caps' red shift (0, 8, 16, or 24; default 16). The
+   plugin ignores the raw file if it doesn't match its output format.
+*/
+
+#include "gstsparrow.h"
+#include "sparrow.h"
+#include <string.h>
+#include <stdio.h>
+#include "jpeglib.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+static void *
+map_file(const char *name, size_t *size){
+  int fd = open(name, O_RDONLY);
+  if (fd == -1){
+    fprintf(stderr, "can't open %s\n", name);
+    exit(1);
+  }
+  *size = lseek(fd, 0, SEEK_END);
+  void *mem = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    fprintf(stderr, "can't mmap %s\n", name);
+    exit(1);
+  }
+  return mem;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 4){
+    fprintf(stderr, "usage: %s jpeg.blob jpeg.index raw.blob [rshift]\n", argv[0]);
+    return 1;
+  }
+  int rshift = (argc > 4) ? atoi(argv[4]) : 16;
+  size_t blob_size, index_size;
+  guint8 *blob = map_file(argv[1], &blob_size);
+  guint8 *index_mem = map_file(argv[2], &index_size);
+  sparrow_index_header_t *index_header = (sparrow_index_header_t *)index_mem;
+  sparrow_frame_t *index;
+  guint32 image_count;
+  if (index_size >= sizeof(sparrow_index_header_t) &&
+      ! memcmp(index_header->magic, SPARROW_INDEX_MAGIC, sizeof(index_header->magic))){
+    index = (sparrow_frame_t *)(index_mem + index_header->header_size);
+    image_count = index_header->image_count;
+  }
+  else { /*old headerless index */
+    index = (sparrow_frame_t *)index_mem;
+    image_count = index_size / sizeof(sparrow_frame_t);
+  }
+
+  GstSparrow sparrow;
+  memset(&sparrow, 0, sizeof(sparrow));
+  sparrow_format *out = &sparrow.out;
+  /*other shifts follow from the jpeg colourspace chosen in init_jpeg_src */
+  switch (rshift){
+  case 0:  out->gshift = 8;  out->bshift = 16; break;
+  case 8:  out->gshift = 16; out->bshift = 24; break;
+  case 16: out->gshift = 8;  out->bshift = 0;  break;
+  case 24: out->gshift = 16; out->bshift = 8;  break;
+  default:
+    fprintf(stderr, "rshift should be 0, 8, 16, or 24, not %d\n", rshift);
+    return 1;
+  }
+  out->rshift = rshift;
+
+  /*all frames are the same size; the first one says what it is */
+  int width, height;
+  {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, blob + index[0].offset, index[0].jpeg_size);
+    jpeg_read_header(&cinfo, TRUE);
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+  }
+  out->width = width;
+  out->height = height;
+  out->size = width * height * PIXSIZE;
+  init_jpeg_src(&sparrow);
+
+  FILE *f = fopen(argv[3], "w");
+  if (f == NULL){
+    fprintf(stderr, "can't open %s for writing\n", argv[3]);
+    return 1;
+  }
+  guint8 *header_block = calloc(SPARROW_RAW_HEADER_SIZE, 1);
+  sparrow_raw_header_t *header = (sparrow_raw_header_t *)header_block;
+  memcpy(header->magic, SPARROW_RAW_MAGIC, sizeof(header->magic));
+  header->width = width;
+  header->height = height;
+  header->rshift = out->rshift;
+  header->gshift = out->gshift;
+  header->bshift = out->bshift;
+  header->image_count = image_count;
+  fwrite(header_block, SPARROW_RAW_HEADER_SIZE, 1, f);
+
+  guint8 *frame = malloc_aligned_or_die(out->size);
+  for (guint32 i = 0; i < image_count; i++){
+    if (! begin_reading_jpeg(&sparrow, blob + index[i].offset, index[i].jpeg_size)){
+      fprintf(stderr, "image %u is not %dx%d\n", i, width, height);
+      return 1;
+    }
+    read_lines(&sparrow, frame, height);
+    finish_reading_jpeg(&sparrow);
+    if (fwrite(frame, out->size, 1, f) != 1){
+      fprintf(stderr, "write failed at image %u\n", i);
+      return 1;
+    }
+    if ((i & 255) == 255){
+      fprintf(stderr, "%u/%u\n", i + 1, image_count);
+    }
+  }
+  fclose(f);
+  finalise_jpeg_src(&sparrow);
+  printf("wrote %u %dx%d images to %s (%zu MB)\n", image_count, width, height,
+      argv[3], ((size_t)out->size * image_count + SPARROW_RAW_HEADER_SIZE) >> 20);
+  return 0;
+}
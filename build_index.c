@@ -0,0 +1,394 @@
+/* Copyright (C) <2010> Douglas Bagnall <douglas@halo.gen.nz>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Build jpeg.blob and jpeg.index from a directory of jpegs, as
+   prepare_images.py and link_images.py do, but quicker.
+
+   usage: build-index jpeg_dir [content_dir [threads]]
+
+   Files are named SSS-NNNNN.jpg, where SSS is the sequence (shot) and NNNNN
+   the frame number within it. Frames within a sequence are linked by
+   successors[0]; the last frame of each sequence gets the 7 sequence heads
+   whose summaries are nearest its own as successors[1-7].
+
+   Summaries are made as prepare_images.py makes them (using djpeg): a
+   greyscale decode at 1/8 scale, which libjpeg does from the DCT
+   coefficients without a full decode, sampled down to 8x6 by nearest
+   neighbour.
+
+   The threads share out the files. Each reads its jpeg, writes it into the
+   blob at its precomputed offset, and summarises it. Then they share out
+   the sequence tails to link, LINK_BLOCK at a time; each tail's links only
+   depend on the summaries, so the index comes out the same however many
+   threads there are.
+*/
+
+#include "gstsparrow.h"
+#include "sparrow.h"
+#include <string.h>
+#include <stdio.h>
+#include "jpeglib.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define SUMMARY_W 8
+#define SUMMARY_H 6
+#define N_LINKS 7
+#define LINK_BLOCK 64
+
+typedef struct build_s {
+  const char *dir;
+  char **names;
+  sparrow_frame_t *frames;
+  guint32 n_frames;
+  int blob_fd;
+  guint32 next;   /*next file to work on, under mutex */
+  GMutex *mutex;
+  guint32 width;  /*of the first jpeg; the rest must match */
+  guint32 height;
+  gboolean failed; /*under mutex */
+  guint32 *heads;  /*first and last frame of each sequence */
+  guint32 *tails;
+  guint32 n_seqs;
+  guint32 next_seq; /*next tail to link, under mutex */
+} build_t;
+
+static gboolean
+is_frame_name(const char *s){
+  /*SSS-NNNNN.jpg */
+  if (strlen(s) != 13 || s[3] != '-' || strcmp(s + 9, ".jpg")){
+    return FALSE;
+  }
+  for (int i = 0; i < 9; i++){
+    if (i != 3 && (s[i] < '0' || s[i] > '9')){
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static int
+compare_names(const void *a, const void *b){
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+static void
+summarise_jpeg(struct jpeg_decompress_struct *cinfo, guint8 *jpeg, size_t size,
+    guint8 *summary, guint32 *width, guint32 *height){
+  jpeg_mem_src(cinfo, jpeg, size);
+  jpeg_read_header(cinfo, TRUE);
+  *width = cinfo->image_width;
+  *height = cinfo->image_height;
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = 8;
+  cinfo->out_color_space = JCS_GRAYSCALE;
+  jpeg_start_decompress(cinfo);
+  int w = cinfo->output_width;
+  int h = cinfo->output_height;
+  guint8 *small = malloc_or_die(w * h);
+  while (cinfo->output_scanline < cinfo->output_height){
+    JSAMPROW row = small + cinfo->output_scanline * w;
+    jpeg_read_scanlines(cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(cinfo);
+  for (int y = 0; y < SUMMARY_H; y++){
+    int sy = (2 * y + 1) * h / (2 * SUMMARY_H);
+    for (int x = 0; x < SUMMARY_W; x++){
+      int sx = (2 * x + 1) * w / (2 * SUMMARY_W);
+      summary[y * SUMMARY_W + x] = small[sy * w + sx];
+    }
+  }
+  free(small);
+}
+
+static void
+build_failed(build_t *b){
+  g_mutex_lock(b->mutex);
+  b->failed = TRUE;
+  g_mutex_unlock(b->mutex);
+}
+
+static gpointer
+build_worker(gpointer p){
+  build_t *b = (build_t *)p;
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  guint8 *buffer = NULL;
+  size_t buffer_size = 0;
+  while (1){
+    g_mutex_lock(b->mutex);
+    guint32 i = b->next++;
+    g_mutex_unlock(b->mutex);
+    if (i >= b->n_frames){
+      break;
+    }
+    sparrow_frame_t *frame = &b->frames[i];
+    char *name = g_build_filename(b->dir, b->names[i], NULL);
+    FILE *f = fopen(name, "r");
+    if (buffer_size < frame->jpeg_size){
+      buffer_size = frame->jpeg_size;
+      buffer = realloc(buffer, buffer_size);
+    }
+    if (f == NULL || fread(buffer, 1, frame->jpeg_size, f) != frame->jpeg_size ||
+        pwrite(b->blob_fd, buffer, frame->jpeg_size, frame->offset) != frame->jpeg_size){
+      fprintf(stderr, "failed to copy %s into the blob\n", name);
+      build_failed(b);
+    }
+    else {
+      guint32 width, height;
+      summarise_jpeg(&cinfo, buffer, frame->jpeg_size, frame->summary, &width, &height);
+      if (width != b->width || height != b->height){
+        fprintf(stderr, "%s is %ux%u, not %ux%u like the first one\n",
+            name, width, height, b->width, b->height);
+        build_failed(b);
+      }
+    }
+    if (f){
+      fclose(f);
+    }
+    g_free(name);
+    if ((i & 1023) == 1023){
+      fprintf(stderr, "%u/%u\n", i + 1, b->n_frames);
+    }
+  }
+  jpeg_destroy_decompress(&cinfo);
+  free(buffer);
+  return NULL;
+}
+
+static guint
+summary_l2(const guint8 *a, const guint8 *b){
+  guint sum = 0;
+  for (int i = 0; i < SUMMARY_W * SUMMARY_H; i++){
+    int d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+/*The last frame of each sequence (tail) gets the N_LINKS nearest sequence
+  starts (heads), not counting its own. Ties go to the earlier head, as with
+  python's heapq.nsmallest. This does tails [start, end). */
+static void
+link_frames(sparrow_frame_t *frames, guint32 *heads, guint32 *tails, guint32 n_seqs,
+    guint32 start, guint32 end){
+  for (guint32 t = start; t < end; t++){
+    sparrow_frame_t *tail = &frames[tails[t]];
+    guint dist[N_LINKS];
+    guint32 best[N_LINKS];
+    int n = 0;
+    for (guint32 h = 0; h < n_seqs; h++){
+      if (h == t){
+        continue;
+      }
+      guint d = summary_l2(tail->summary, frames[heads[h]].summary);
+      if (n == N_LINKS && d >= dist[N_LINKS - 1]){
+        continue;
+      }
+      int j = (n < N_LINKS) ? n++ : N_LINKS - 1;
+      for (; j > 0 && dist[j - 1] > d; j--){
+        dist[j] = dist[j - 1];
+        best[j] = best[j - 1];
+      }
+      dist[j] = d;
+      best[j] = heads[h];
+    }
+    tail->successors[0] = 0;
+    for (int j = 0; j < N_LINKS; j++){
+      /*with too few sequences, fill in with the nearest */
+      tail->successors[j + 1] = (j < n) ? best[j] : ((n) ? best[0] : 0);
+    }
+  }
+}
+
+static gpointer
+link_worker(gpointer p){
+  build_t *b = (build_t *)p;
+  while (1){
+    g_mutex_lock(b->mutex);
+    guint32 start = b->next_seq;
+    guint32 end = MIN(start + LINK_BLOCK, b->n_seqs);
+    b->next_seq = end;
+    g_mutex_unlock(b->mutex);
+    if (start >= end){
+      break;
+    }
+    link_frames(b->frames, b->heads, b->tails, b->n_seqs, start, end);
+  }
+  return NULL;
+}
+
+static void
+run_workers(GThreadFunc worker, build_t *b, int n_threads){
+  GThread *threads[SPARROW_MAX_THREADS];
+  for (int i = 0; i < n_threads; i++){
+    threads[i] = g_thread_create(worker, b, TRUE, NULL);
+  }
+  for (int i = 0; i < n_threads; i++){
+    g_thread_join(threads[i]);
+  }
+}
+
+static void
+write_index(const char *filename, sparrow_frame_t *frames, guint32 n_frames,
+    guint32 width, guint32 height, guint32 blob_size){
+  sparrow_index_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SPARROW_INDEX_MAGIC, sizeof(header.magic));
+  header.version = SPARROW_INDEX_VERSION;
+  header.header_size = sizeof(header);
+  header.frame_size = sizeof(sparrow_frame_t);
+  header.image_count = n_frames;
+  header.width = width;
+  header.height = height;
+  header.blob_size = blob_size;
+  header.checksum = sparrow_adler32((guint8 *)frames, n_frames * sizeof(sparrow_frame_t));
+  FILE *f = fopen(filename, "w");
+  if (f == NULL ||
+      fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(frames, sizeof(sparrow_frame_t), n_frames, f) != n_frames){
+    fprintf(stderr, "could not write %s\n", filename);
+    exit(1);
+  }
+  fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2){
+    fprintf(stderr, "usage: %s jpeg_dir [content_dir [threads]]\n", argv[0]);
+    return 1;
+  }
+  if (! g_thread_supported()){
+    g_thread_init(NULL);
+  }
+  build_t b;
+  memset(&b, 0, sizeof(b));
+  b.dir = argv[1];
+  const char *content = (argc > 2) ? argv[2] : DEFAULT_PROP_CONTENT;
+  int n_threads = (argc > 3) ? atoi(argv[3]) : sparrow_cpu_count();
+  n_threads = CLAMP(n_threads, 1, SPARROW_MAX_THREADS);
+
+  DIR *dir = opendir(b.dir);
+  if (dir == NULL){
+    fprintf(stderr, "can't open directory %s\n", b.dir);
+    return 1;
+  }
+  guint32 allocated = 1024;
+  b.names = malloc_or_die(allocated * sizeof(char *));
+  struct dirent *entry;
+  while ((entry = readdir(dir))){
+    if (is_frame_name(entry->d_name)){
+      if (b.n_frames == allocated){
+        allocated *= 2;
+        b.names = realloc(b.names, allocated * sizeof(char *));
+      }
+      b.names[b.n_frames++] = g_strdup(entry->d_name);
+    }
+  }
+  closedir(dir);
+  if (b.n_frames == 0){
+    fprintf(stderr, "no SSS-NNNNN.jpg files in %s\n", b.dir);
+    return 1;
+  }
+  qsort(b.names, b.n_frames, sizeof(char *), compare_names);
+
+  /*sizes give offsets, so the blob can be written in any order */
+  b.frames = calloc(b.n_frames, sizeof(sparrow_frame_t));
+  guint32 *heads = malloc_or_die(b.n_frames * sizeof(guint32));
+  guint32 *tails = malloc_or_die(b.n_frames * sizeof(guint32));
+  guint32 n_seqs = 0;
+  size_t offset = 0;
+  for (guint32 i = 0; i < b.n_frames; i++){
+    struct stat st;
+    char *name = g_build_filename(b.dir, b.names[i], NULL);
+    if (stat(name, &st)){
+      fprintf(stderr, "can't stat %s\n", name);
+      return 1;
+    }
+    g_free(name);
+    b.frames[i].offset = offset;
+    b.frames[i].jpeg_size = st.st_size;
+    offset += st.st_size;
+    if (i == 0 || strncmp(b.names[i], b.names[i - 1], 3)){
+      /*new sequence */
+      if (i){
+        tails[n_seqs - 1] = i - 1;
+      }
+      heads[n_seqs] = i;
+      n_seqs++;
+    }
+    else {
+      b.frames[i - 1].successors[0] = i;
+    }
+  }
+  tails[n_seqs - 1] = b.n_frames - 1;
+  if (offset > G_MAXINT32){
+    fprintf(stderr, "blob would be %zu bytes; offsets only go to 2GB\n", offset);
+    return 1;
+  }
+
+  /*the first jpeg sets the geometry */
+  {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    char *name = g_build_filename(b.dir, b.names[0], NULL);
+    FILE *f = fopen(name, "r");
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+    b.width = cinfo.image_width;
+    b.height = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
+    g_free(name);
+  }
+
+  g_mkdir_with_parents(content, 0755);
+  char *blob_name = g_build_filename(content, "jpeg.blob", NULL);
+  char *index_name = g_build_filename(content, "jpeg.index", NULL);
+  b.blob_fd = open(blob_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (b.blob_fd == -1){
+    fprintf(stderr, "can't open %s for writing\n", blob_name);
+    return 1;
+  }
+  b.mutex = g_mutex_new();
+  fprintf(stderr, "%u frames in %u sequences, %ux%u, %zu MB; using %d threads\n",
+      b.n_frames, n_seqs, b.width, b.height, offset >> 20, n_threads);
+
+  run_workers(build_worker, &b, n_threads);
+  close(b.blob_fd);
+  if (b.failed){
+    return 1;
+  }
+
+  b.heads = heads;
+  b.tails = tails;
+  b.n_seqs = n_seqs;
+  run_workers(link_worker, &b, n_threads);
+  write_index(index_name, b.frames, b.n_frames, b.width, b.height, offset);
+  printf("wrote %s and %s\n", blob_name, index_name);
+  return 0;
+}
@@ -19,6 +19,7 @@
 #include "sparrow.h"
 #include "gstsparrow.h"
 #include "calibrate.h"
+#include "find_lag.h"
 
 #include <string.h>
 #include <math.h>
@@ -100,21 +101,65 @@ static void add_random_signal(GstSparrow *sparrow, guint8 *out){
 }
 #endif
 
+/*an m-sequence from a Fibonacci LFSR, as the low CALIBRATE_CODE_LENGTH bits */
+static guint64
+lfsr_sequence(guint32 taps){
+  guint32 state = 1;
+  guint64 seq = 0;
+  int i;
+  for (i = 0; i < CALIBRATE_CODE_LENGTH; i++){
+    seq |= (guint64)(state & 1) << i;
+    guint32 feedback = popcount32(state & taps) & 1;
+    state = (state >> 1) | (feedback << (CALIBRATE_CODE_BITS - 1));
+  }
+  return seq;
+}
+
+/*Gold code number code (1 to SPARROW_N_CODES): the two m-sequences, or one
+  xored with a rotation of the other */
+static guint64
+gold_code(guint32 code){
+  guint64 a = lfsr_sequence(CALIBRATE_CODE_TAPS_A);
+  guint64 b = lfsr_sequence(CALIBRATE_CODE_TAPS_B);
+  guint32 k = code - 1;
+  if (k == CALIBRATE_CODE_LENGTH){
+    return a;
+  }
+  if (k > CALIBRATE_CODE_LENGTH){
+    return b;
+  }
+  guint64 all = (1ULL << CALIBRATE_CODE_LENGTH) - 1;
+  guint64 rotated = ((b >> k) | (b << (CALIBRATE_CODE_LENGTH - k))) & all;
+  return a ^ rotated;
+}
+
 static gboolean cycle_pattern(GstSparrow *sparrow){
   sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
   gboolean on = calibrate->on;
-  if (calibrate->wait == 0){
-    on = !on;
-    if (on){
-      calibrate->wait = RANDINT(sparrow, CALIBRATE_ON_MIN_T, CALIBRATE_ON_MAX_T);
+  if (calibrate->code_bits){
+    /*code_pos counts frames */
+    on = (calibrate->code_bits >> (calibrate->code_pos / CALIBRATE_CODE_CHIP_T)) & 1;
+    calibrate->code_pos = (calibrate->code_pos + 1) %
+      (CALIBRATE_CODE_LENGTH * CALIBRATE_CODE_CHIP_T);
+    if (on != calibrate->on){
+      calibrate->on = on;
+      calibrate->transitions++;
     }
-    else{
-      calibrate->wait = RANDINT(sparrow, CALIBRATE_OFF_MIN_T, CALIBRATE_OFF_MAX_T);
+  }
+  else {
+    if (calibrate->wait == 0){
+      on = !on;
+      if (on){
+        calibrate->wait = RANDINT(sparrow, CALIBRATE_ON_MIN_T, CALIBRATE_ON_MAX_T);
+      }
+      else{
+        calibrate->wait = RANDINT(sparrow, CALIBRATE_OFF_MIN_T, CALIBRATE_OFF_MAX_T);
+      }
+      calibrate->on = on;
+      calibrate->transitions++;
     }
-    calibrate->on = on;
-    calibrate->transitions++;
+    calibrate->wait--;
   }
-  calibrate->wait--;
   calibrate->lag_record = (calibrate->lag_record << 1) | on;
   //GST_DEBUG("lag record %llx, on %i\n", sparrow->lag_record, on);
   return on;
@@ -155,6 +200,83 @@ int64_to_binary_string(char *s, guint64 n){
 }
 
 
+typedef struct lag_job_s {
+  guint64 targets[MAX_CALIBRATION_LAG];
+  const guint64 *ages[LAG_PLANES]; /*the planes, latest first */
+  const guint32 *words; /*the ROI, or NULL for every word */
+  guint32 n_words;
+} lag_job_t;
+
+static inline guint32
+job_word(lag_job_t *job, guint32 e){
+  return job->words ? job->words[e] : e;
+}
+
+/*transpose the words of entries [e, e + n) into per-pixel records */
+static inline void
+gather_records(lag_job_t *job, lag_times_t *records, guint32 e, guint32 n){
+  guint32 k, t;
+  for (k = 0; k < n; k++){
+    guint64 *rows = &records[k * 64].record;
+    guint32 w = job_word(job, e + k);
+    for (t = 0; t < LAG_PLANES; t++){
+      rows[t] = job->ages[t][w];
+    }
+    transpose_lag_rows(rows);
+  }
+}
+
+/*search chunks [start, end) -- called from the worker bands. Chunks are
+  whole plane words. */
+static void
+find_lag_band(GstSparrow *sparrow, void *data, int start, int end){
+  sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
+  lag_job_t *job = (lag_job_t *)data;
+  guint32 *frame = (guint32 *)sparrow->debug_frame;
+  lag_times_t records[LAG_BLOCK];
+  guint8 lags[LAG_BLOCK];
+  guint8 errors[LAG_BLOCK];
+  guint32 words = job->n_words;
+  int c;
+  for (c = start; c < end; c++){
+    lag_chunk_t *chunk = &calibrate->lag_chunks[c];
+    guint32 first = (guint32)(((guint64)words * c) / LAG_CHUNKS);
+    guint32 last = (guint32)(((guint64)words * (c + 1)) / LAG_CHUNKS);
+    memset(chunk, 0, sizeof(lag_chunk_t));
+    chunk->best = (guint32)-1;
+    guint32 e, j;
+    for (e = first; e < last; e += LAG_BLOCK / 64){
+      guint32 n_words = MIN(LAG_BLOCK / 64, last - e);
+      guint32 n = n_words * 64;
+      gather_records(job, records, e, n_words);
+      calibrate->lag_search(records, n, job->targets, lags, errors);
+      for (j = 0; j < n; j++){
+        guint64 record = records[j].record;
+        if (record == 0 || ~record == 0){
+          /*ignore this one! it'll never usefully match. (This includes
+            the padding past the end of the frame.) */
+          continue;
+        }
+        guint32 i = job_word(job, e + j / 64) * 64 + (j & 63);
+        guint32 best = errors[j];
+        guint32 lag = lags[j];
+        if (sparrow->debug){
+          colour_coded_pixel(&frame[i], lag, best);
+        }
+        if (best <= CALIBRATE_MAX_VOTE_ERROR){
+          chunk->votes[lag] += 1 << (CALIBRATE_MAX_VOTE_ERROR - best);
+        }
+        if (best < chunk->best){
+          chunk->best = best;
+          chunk->lag = lag;
+          chunk->pixel = i;
+          chunk->record = record;
+        }
+      }
+    }
+  }
+}
+
 /*return 1 if a reasonably likely lag has been found */
 
 static inline int
@@ -162,9 +284,8 @@ find_lag(GstSparrow *sparrow){
   sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
   int res = 0;
   guint i, j;
-  guint32 *frame = (guint32 *)sparrow->debug_frame;
   if (sparrow->debug){
-    memset(frame, 0, sparrow->in.size);
+    memset(sparrow->debug_frame, 0, sparrow->in.size);
   }
   guint64 target_pattern = calibrate->lag_record;
   guint32 overall_best = (guint32)-1;
@@ -175,50 +296,32 @@ find_lag(GstSparrow *sparrow){
   GST_DEBUG("pattern: %s %llx\n", int64_to_binary_string(pattern_debug, target_pattern),
       target_pattern);
 
-  for (i = 0; i < sparrow->in.pixcount; i++){
-    guint64 record = calibrate->lag_table[i].record;
-    if (record == 0 || ~record == 0){
-      /*ignore this one! it'll never usefully match. */
-      //frame[i] = 0xffffffff;
-      continue;
-    }
-
-    guint64 mask = ((guint64)-1) >> MAX_CALIBRATION_LAG;
-    guint32 best = hamming_distance64(record, target_pattern, mask);
-    guint32 lag = 0;
-
-    for (j = 1; j < MAX_CALIBRATION_LAG; j++){
-      /*latest frame is least significant bit
-        >> pushes into future,
-        << pushes into past
-        record is presumed to be a few frames past
-        relative to main record, so we push it back.
-      */
-      record <<= 1;
-      mask <<= 1;
-      guint32 d = hamming_distance64(record, target_pattern, mask);
-      if (d < best){
-        best = d;
-        lag = j;
-      }
-    }
-    if (sparrow->debug){
-      colour_coded_pixel(&frame[i], lag, best);
-    }
-
-    if (best <= CALIBRATE_MAX_VOTE_ERROR){
-      votes[lag] += 1 >> (CALIBRATE_MAX_VOTE_ERROR - best);
+  lag_job_t job;
+  init_lag_targets(job.targets, target_pattern);
+  for (i = 0; i < LAG_PLANES; i++){
+    guint32 plane = (calibrate->plane_head - i) & (LAG_PLANES - 1);
+    job.ages[i] = calibrate->planes + plane * calibrate->plane_words;
+  }
+  job.words = calibrate->roi_words;
+  job.n_words = (job.words) ? calibrate->roi_count : calibrate->plane_words;
+  sparrow_run_bands(sparrow, find_lag_band, &job, LAG_CHUNKS);
+
+  /*merge the chunks in order, so the first best pixel wins, as it would
+    serially */
+  for (i = 0; i < LAG_CHUNKS; i++){
+    lag_chunk_t *chunk = &calibrate->lag_chunks[i];
+    for (j = 0; j < MAX_CALIBRATION_LAG; j++){
+      votes[j] += chunk->votes[j];
     }
-
-    if (best < overall_best){
-      overall_best = best;
-      overall_lag = lag;
+    if (chunk->best < overall_best){
+      overall_best = chunk->best;
+      overall_lag = chunk->lag;
       char pattern_debug2[65];
-      guint64 r = calibrate->lag_table[i].record;
+      guint64 r = chunk->record;
       GST_DEBUG("Best now: lag  %u! error %u pixel %u\n"
           "record:  %s %llx\n"
           "pattern: %s %llx\n",
-          overall_lag, overall_best, i,
+          overall_lag, overall_best, chunk->pixel,
           int64_to_binary_string(pattern_debug, r), r,
           int64_to_binary_string(pattern_debug2, target_pattern), target_pattern
       );
@@ -250,12 +353,92 @@ find_lag(GstSparrow *sparrow){
   return res;
 }
 
+/*threshold the frame into the next plane, overwriting the oldest. Outside
+  the ROI (if there is one) the planes are left stale. */
 static inline void
-record_calibration(GstSparrow *sparrow, gint32 offset, int signal){
-  //signal = (signal != 0);
+record_calibration(GstSparrow *sparrow, guint32 *frame){
   sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
-  calibrate->lag_table[offset].record <<= 1;
-  calibrate->lag_table[offset].record |= signal;
+  guint32 words = calibrate->plane_words;
+  guint64 *prev = calibrate->planes + calibrate->plane_head * words;
+  calibrate->plane_head = (calibrate->plane_head + 1) & (LAG_PLANES - 1);
+  guint64 *plane = calibrate->planes + calibrate->plane_head * words;
+  guint32 i;
+  if (calibrate->roi_words){
+    for (i = 0; i < calibrate->roi_count; i++){
+      guint32 w = calibrate->roi_words[i];
+      plane[w] = threshold_word(frame, sparrow->in.pixcount, w, sparrow->in.gshift,
+          CALIBRATE_SIGNAL_THRESHOLD);
+    }
+    return;
+  }
+  threshold_plane(plane, frame, sparrow->in.pixcount, sparrow->in.gshift,
+      CALIBRATE_SIGNAL_THRESHOLD);
+  if (calibrate->activity){
+    for (i = 0; i < words; i++){
+      guint32 a = calibrate->activity[i] + popcount64(plane[i] ^ prev[i]);
+      calibrate->activity[i] = MIN(a, 255);
+    }
+  }
+}
+
+/*Mark the words that changed about as often as the pattern did, and their
+  neighbours (a word either side, and a row up and down). The planes don't
+  pad the rows, so the pixels above and below a word can be in either of two
+  words; rounding the row up and taking a word either side covers both. */
+static void
+choose_roi(GstSparrow *sparrow){
+  sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
+  gint32 words = calibrate->plane_words;
+  gint32 row_words = (sparrow->in.width + 63) / 64;
+  guint32 min_activity = CLAMP(calibrate->transitions / 2, 2, 255);
+  guint8 *mark = zalloc_or_die(words);
+  gint32 w, dy, dx;
+  guint32 n = 0;
+  for (w = 0; w < words; w++){
+    if (calibrate->activity[w] >= min_activity){
+      for (dy = -row_words; dy <= row_words; dy += row_words){
+        for (dx = -1; dx <= 1; dx++){
+          gint32 x = w + dy + dx;
+          if (x >= 0 && x < words){
+            mark[x] = 1;
+          }
+        }
+      }
+    }
+  }
+  for (w = 0; w < words; w++){
+    n += mark[w];
+  }
+  if (n == 0 || n > (guint32)words / ROI_MAX_FRACTION){
+    GST_DEBUG("not using ROI: %u of %u words are active\n", n, words);
+    free(mark);
+    return;
+  }
+  calibrate->roi_words = malloc_or_die(n * sizeof(guint32));
+  calibrate->roi_count = 0;
+  for (w = 0; w < words; w++){
+    if (mark[w]){
+      calibrate->roi_words[calibrate->roi_count++] = w;
+    }
+  }
+  GST_DEBUG("ROI is %u of %u words\n", n, words);
+  free(mark);
+  free(calibrate->activity);
+  calibrate->activity = NULL;
+  calibrate->roi_retries = 0;
+}
+
+/*go back to the whole frame, and choose again once the planes outside the
+  ROI have been refilled */
+static void
+drop_roi(GstSparrow *sparrow){
+  sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
+  GST_DEBUG("no lag in the ROI after %u tries; dropping it\n", calibrate->roi_retries);
+  free(calibrate->roi_words);
+  calibrate->roi_words = NULL;
+  calibrate->roi_count = 0;
+  calibrate->activity = zalloc_or_die(calibrate->plane_words);
+  sparrow->countdown = CALIBRATE_INITIAL_WAIT;
 }
 
 
@@ -264,15 +447,14 @@ mode_find_self(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
   guint8 *in = GST_BUFFER_DATA(inbuf);
   guint8 *out = GST_BUFFER_DATA(outbuf);
 
+  sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
   int ret = SPARROW_STATUS_QUO;
-  guint32 i;
-  guint32 *frame = (guint32 *)in;
   /* record the current signal */
-  for (i = 0; i < sparrow->in.pixcount; i++){
-    int signal = (((frame[i] >> sparrow->in.gshift) & 255) > CALIBRATE_SIGNAL_THRESHOLD);
-    record_calibration(sparrow, i, signal);
-  }
+  record_calibration(sparrow, (guint32 *)in);
   if (sparrow->countdown == 0){
+    if (calibrate->activity){
+      choose_roi(sparrow);
+    }
     /* analyse the signal */
     int r = find_lag(sparrow);
     if (r){
@@ -281,6 +463,9 @@ mode_find_self(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
     }
     else {
       sparrow->countdown = CALIBRATE_RETRY_WAIT;
+      if (calibrate->roi_words && ++calibrate->roi_retries == ROI_MAX_RETRIES){
+        drop_roi(sparrow);
+      }
     }
   }
   memset(out, 0, sparrow->out.size);
@@ -306,7 +491,9 @@ INVISIBLE void
 finalise_find_self(GstSparrow *sparrow)
 {
   sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
-  free(calibrate->lag_table);
+  free(calibrate->planes);
+  free(calibrate->activity);
+  free(calibrate->roi_words);
   free(calibrate);
 }
 
@@ -315,8 +502,17 @@ INVISIBLE void
 init_find_self(GstSparrow *sparrow){
   sparrow_calibrate_t *calibrate = zalloc_aligned_or_die(sizeof(sparrow_calibrate_t));
   sparrow->helper_struct = (void *)calibrate;
-  GST_DEBUG("allocating %u * %u for lag_table\n", sparrow->in.pixcount, sizeof(lag_times_t));
-  calibrate->lag_table = zalloc_aligned_or_die(sparrow->in.pixcount * sizeof(lag_times_t));
+  calibrate->plane_words = (sparrow->in.pixcount + 63) / 64;
+  GST_DEBUG("allocating %u * %u words for lag planes\n", LAG_PLANES, calibrate->plane_words);
+  calibrate->planes = zalloc_aligned_or_die(LAG_PLANES * calibrate->plane_words * sizeof(guint64));
+  if (CALIBRATE_USE_ROI){
+    calibrate->activity = zalloc_or_die(calibrate->plane_words);
+  }
+  calibrate->lag_search = choose_lag_search();
+  if (sparrow->code){
+    calibrate->code_bits = gold_code(sparrow->code);
+    GST_DEBUG("using calibration code %u: %llx\n", sparrow->code, calibrate->code_bits);
+  }
 
   calibrate->incolour = sparrow->in.colours[SPARROW_WHITE];
   calibrate->outcolour = sparrow->out.colours[SPARROW_WHITE];
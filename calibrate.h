@@ -16,11 +16,60 @@
 #define WAIT_COUNTDOWN (MAX(CALIBRATE_OFF_MAX_T, CALIBRATE_ON_MAX_T) + 3)
 
 #define MAX_CALIBRATION_LAG 12
+
+/*With the code property set, the squares flash a Gold code rather than a
+  random pattern, repeating every 63 chips. Any two codes of the set differ
+  at every shift (their cross-correlation is at most 17 of 63), so
+  projectors sharing a camera can find their lags at once. The codes are
+  made from this preferred pair of 6 bit LFSRs (x^6+x+1, x^6+x^5+x^2+x+1, as
+  tap masks). Each chip lasts as long as the shortest random flash, so a
+  camera exposure that straddles two frames still sees it whole once. */
+#define CALIBRATE_CODE_CHIP_T MAX(CALIBRATE_ON_MIN_T, CALIBRATE_OFF_MIN_T)
+#define CALIBRATE_CODE_LENGTH 63
+#define CALIBRATE_CODE_BITS 6
+#define CALIBRATE_CODE_TAPS_A 0x21
+#define CALIBRATE_CODE_TAPS_B 0x33
+/*the signal is kept as one bit per pixel per frame, for this many frames */
+#define LAG_PLANES 64
+
 typedef struct lag_times_s {
   //guint32 hits;
   guint64 record;
 } lag_times_t;
 
+/*find_lag.h has the kernels */
+typedef void (*lag_search_func)(const lag_times_t *records, int n,
+    const guint64 *targets, guint8 *lags, guint8 *errors);
+
+/*Once there are enough frames, find_self looks for the plane words (runs of
+  64 pixels) where the signal has been changing, and from then on records and
+  searches only those and their neighbours. If too much of the frame is
+  changing (or nothing is), it carries on with the whole frame. If the lag
+  isn't found in the ROI after ROI_MAX_RETRIES tries, what was changing may
+  not have been the pattern, so it goes back to the whole frame and chooses
+  again. */
+#ifndef CALIBRATE_USE_ROI
+#define CALIBRATE_USE_ROI 1
+#endif
+#define ROI_MAX_FRACTION 4
+#define ROI_MAX_RETRIES 4
+
+/*find_lag splits the frame into this many chunks, spread over the worker
+  bands. Each chunk collects its own votes and best pixel, and they are
+  merged in order, so the result doesn't depend on the number of threads. */
+#define LAG_CHUNKS 64
+/*pixels searched per kernel call (a multiple of 64: they are transposed
+  out of the planes a word at a time) */
+#define LAG_BLOCK 256
+
+typedef struct lag_chunk_s {
+  guint32 best;
+  guint32 lag;
+  guint32 pixel;
+  guint64 record;
+  int votes[MAX_CALIBRATION_LAG];
+} lag_chunk_t;
+
 enum calibration_shape {
   NO_SHAPE = 0,
   RECTANGLE,
@@ -47,8 +96,21 @@ typedef struct sparrow_calibrate_s {
   int n_shapes;
 
   IplImage *in_ipl[SPARROW_N_IPL_IN];
-  lag_times_t *lag_table;
+  /*LAG_PLANES planes of plane_words words; plane_head is the latest */
+  guint64 *planes;
+  guint32 plane_words;
+  guint32 plane_head;
+  /*transitions seen in each word (saturating), until the ROI is chosen */
+  guint8 *activity;
+  /*the words in the ROI, or NULL for the whole frame */
+  guint32 *roi_words;
+  guint32 roi_count;
+  guint32 roi_retries;
   guint64 lag_record;
+  guint64 code_bits;  /*0 for a random pattern */
+  guint32 code_pos;
+  lag_search_func lag_search;
+  lag_chunk_t lag_chunks[LAG_CHUNKS];
 
 } sparrow_calibrate_t;
 
@@ -0,0 +1,457 @@
+#ifndef __SPARROW_COMPLETE_MAP_H__
+#define __SPARROW_COMPLETE_MAP_H__
+/* Filling in and correcting the corner mesh, for complete_map (edges.c), also
+   used by test-complete-map.c.
+
+   Each corner that isn't settled is estimated from lines of 3 other corners
+   leading up to it (the estimators), and the median of the estimates is
+   taken. The mesh is updated in place, so a corner sees the changes already
+   made to corners before it in the same pass.
+
+   complete_map_passes is the original way: pass over every corner that isn't
+   settled, until a pass changes no corner's status (positions can go on
+   shuffling about forever). complete_map_worklist gets the same result by
+   only estimating corners that something they depend on has changed under:
+   a corner that moves queues the corners that use it, in this pass if they
+   come after it, otherwise in the next.
+*/
+
+#include "sparrow.h"
+#include "gstsparrow.h"
+#include "edges.h"
+#include "bitmask.h"
+#include "median.h"
+#include <math.h>
+
+/*give up on a mesh that hasn't settled after this many passes */
+#define COMPLETE_MAP_MAX_PASSES 100
+
+static sparrow_point_t
+median_centre(sparrow_voter_t *estimates, int n){
+  /*X and Y arevcalculated independently, which is really not right.
+    on the other hand, it probably works. */
+  int i;
+  sparrow_point_t result;
+  coord_t vals[n];
+  for (i = 0; i < n; i++){
+    vals[i] = estimates[i].x;
+  }
+  result.x = coord_median(vals, n);
+
+  for (i = 0; i < n; i++){
+    vals[i] = estimates[i].y;
+  }
+  result.y = coord_median(vals, n);
+  return result;
+}
+
+/*x1, y1,  x2, y2,  x3, y3 */
+static const int base_estimators[][6] = {
+  { 0, 1,     0, 2,    0, 3},
+  { 0, 2,     0, 4,    0, 6},
+  { 1, 0,     2, 0,    3, 0},
+  { 1, 1,     2, 2,    3, 3},
+  { 1, 2,     2, 4,    3, 6},
+  { 1, 3,     2, 6,    3, 9},
+  { 2, 0,     4, 0,    6, 0},
+  { 2, 1,     4, 2,    6, 3},
+  { 2, 2,     4, 4,    6, 6},
+  { 2, 3,     4, 6,    6, 9},
+  { 3, 1,     6, 2,    9, 3},
+  { 3, 2,     6, 4,    9, 6},
+};
+
+#define BASE_ESTIMATORS (sizeof(base_estimators) / sizeof(base_estimators[0]))
+#define ESTIMATORS  (BASE_ESTIMATORS * 4)
+
+/*all the reflections of the base estimators, with their corners as offsets
+  into a mesh of the given width */
+static inline guint
+calculate_estimator_tables(sparrow_estimator_t *estimators, int width){
+  guint i, j;
+  sparrow_estimator_t *e = estimators;
+  for (i = 0; i < BASE_ESTIMATORS; i++){
+    for (j = 0; j < 4; j++){
+      const int *b = base_estimators[i];
+      *e = (sparrow_estimator_t){b[0], b[1], b[2], b[3], b[4], b[5], 0, 0, 0};
+      if (j & 1){
+        if (! e->x1){
+          continue;
+        }
+        e->x1 = -e->x1;
+        e->x2 = -e->x2;
+        e->x3 = -e->x3;
+      }
+      if (j & 2){
+        if (! e->y1){
+          continue;
+        }
+        e->y1 = -e->y1;
+        e->y2 = -e->y2;
+        e->y3 = -e->y3;
+      }
+      e->d1 = e->y1 * width + e->x1;
+      e->d2 = e->y2 * width + e->x2;
+      e->d3 = e->y3 * width + e->x3;
+      GST_DEBUG("estimator: %-d,%-d  %-d,%-d  %-d,%-d",
+          e->x1, e->y1, e->x2, e->y2, e->x3, e->y3);
+      e++;
+    }
+  }
+  return e - estimators;
+}
+
+/*the distinct corners (relative to the one being estimated) that estimators
+  use. Returns how many there are. */
+static inline guint
+calculate_estimator_offsets(const sparrow_estimator_t *estimators, guint est_count,
+    sparrow_offset_t *offsets){
+  guint n = 0;
+  for (guint i = 0; i < est_count; i++){
+    const sparrow_estimator_t *e = &estimators[i];
+    sparrow_offset_t candidates[3] = {{e->x1, e->y1}, {e->x2, e->y2}, {e->x3, e->y3}};
+    for (int j = 0; j < 3; j++){
+      guint k;
+      for (k = 0; k < n; k++){
+        if (offsets[k].x == candidates[j].x && offsets[k].y == candidates[j].y){
+          break;
+        }
+      }
+      if (k == n){
+        offsets[n] = candidates[j];
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+/*what estimate_corner did to a corner. Other corners only care whether it
+  is used and where it is; whether it is exact, projected or settled only
+  matters to its own next estimate. */
+typedef enum {
+  CORNER_SAME = 0,
+  CORNER_NEW_STATUS = 1,
+  CORNER_MOVED = 2,
+} corner_change_t;
+
+/*estimate corner x, y from the others, which may change its position and
+  status. */
+static int
+estimate_corner(GstSparrow *sparrow, sparrow_corner_t *mesh, int width, int height,
+    int x, int y, const sparrow_estimator_t *estimators, guint est_count, guint32 *debug){
+  sparrow_voter_t estimates[ESTIMATORS + 1]; /* 1 extra for trick simplifying median */
+  int screen_width = sparrow->in.width;
+  int screen_height = sparrow->in.height;
+  int i = y * width + x;
+  sparrow_corner_t *corner = &mesh[i];
+  sparrow_corner_t old = *corner;
+  int k = 0;
+  for (guint j = 0; j < est_count; j++){
+    const sparrow_estimator_t *e = &estimators[j];
+    int x3, y3, x2, y2, x1, y1;
+    y3 = y + e->y3;
+    x3 = x + e->x3;
+    /*the other two corners are between this one and the third, so if it is
+      in the mesh, they are */
+    if (!(y3 >= 0 && y3 < height &&
+            x3 >= 0 && x3 < width &&
+            mesh[i + e->d3].status != CORNER_UNUSED
+        )){
+      GST_DEBUG("not using estimator %d because corners aren't used, or are off screen\n"
+          "x3 %d, y3 %d", j, x3, y3);
+      continue;
+    }
+    y2 = y + e->y2;
+    x2 = x + e->x2;
+    y1 = y + e->y1;
+    x1 = x + e->x1;
+    if (mesh[i + e->d2].status == CORNER_UNUSED ||
+        mesh[i + e->d1].status == CORNER_UNUSED){
+      GST_DEBUG("not using estimator %d because corners aren't used", j);
+      continue;
+    }
+    /*there are 3 points, and the unknown one.
+      They should all be in a line.
+      The ratio of the p3-p2:p2-p1 sould be the same as
+      p2-p1:p1:p0.
+
+      This really has to be done in floating point.
+
+      collinearity, no division, but no useful error metric
+      x[0] * (y[1]-y[2]) + x[1] * (y[2]-y[0]) + x[2] * (y[0]-y[1])  == 0
+      (at least not without further division)
+
+      This way:
+
+      cos angle = dot product / product of euclidean lengths
+
+      (dx12 * dx23 + dy12 * dy23) /
+      (sqrt(dx12 * dx12 + dy12 * dy12) * sqrt(dx23 * dx23 + dy23 * dy23))
+
+      is costly up front (sqrt), but those distances need to be
+      calculated anyway (or at least they are handy).  Not much gained by
+      short-circuiting on bad collinearity, though.
+
+      It also handlily catches all the division by zeros in one meaningful
+      go.
+    */
+    sparrow_corner_t *c1 = &mesh[i + e->d1];
+    sparrow_corner_t *c2 = &mesh[i + e->d2];
+    sparrow_corner_t *c3 = &mesh[i + e->d3];
+
+    double dx12 = c1->x - c2->x;
+    double dy12 = c1->y - c2->y;
+    double dx23 = c2->x - c3->x;
+    double dy23 = c2->y - c3->y;
+    double distance12 = sqrt(dx12 * dx12 + dy12 * dy12);
+    double distance23 = sqrt(dx23 * dx23 + dy23 * dy23);
+
+    double dp = dx12 * dx23 + dy12 * dy23;
+
+    double distances = distance12 * distance23;
+
+    GST_LOG("mesh points: %d,%d, %d,%d, %d,%d\n"
+        "map points: %d,%d, %d,%d,  %d,%d\n"
+        "diffs: 12: %0.3f,%0.3f,  23: %0.3f,%0.3f, \n"
+        "distances: 12: %0.3f,   32: %0.3f\n",
+        x1, y1, x2, y2, x3, y3,
+        C2I(c1->x), C2I(c1->y), C2I(c2->x), C2I(c2->y), C2I(c3->x), C2I(c3->y),
+        dx12, dy12, dx23, dy23, distance12, distance23
+    );
+
+    if (distances == 0.0){
+      GST_INFO("at least two points out of %d,%d, %d,%d, %d,%d are the same!",
+          x1, y1, x2, y2, x3, y3);
+      continue;
+    }
+    double line_error = 1.0 - dp / distances;
+    if (line_error > MAX_NONCOLLINEARITY){
+      GST_DEBUG("Points %d,%d, %d,%d, %d,%d are not in a line: non-collinearity: %3f",
+          x1, y1, x2, y2, x3, y3, line_error);
+      continue;
+    }
+    GST_LOG("GOOD collinearity: %3f", line_error);
+
+
+    double ratio = distance12 / distance23;
+    /*so here's the estimate!*/
+    coord_t dx = dx12 * ratio;
+    coord_t dy = dy12 * ratio;
+    coord_t ex = c1->x + dx;
+    coord_t ey = c1->y + dy;
+
+    GST_LOG("dx, dy: %d,%d, ex, ey: %d,%d\n"
+        "dx raw:  %0.3f,%0.3f,  x1, x2: %0.3f,%0.3f,\n"
+        "distances: 12: %0.3f,   32: %0.3f\n"
+        "ratio: %0.3f\n",
+        C2I(dx), C2I(dy), C2I(ex), C2I(ey),
+        dx, dy, ex, ey, ratio
+    );
+
+    if (! coord_in_range(ey, screen_height) ||
+        ! coord_in_range(ex, screen_width)){
+      GST_DEBUG("rejecting estimate for %d, %d, due to ex, ey being %d, %d",
+          x, y, C2I(ex), C2I(ey));
+      continue;
+    }
+
+    GST_LOG("estimator %d,%d SUCCESSFULLY estimated that %d, %d will be %d, %d",
+        x1, x2, x, y, C2I(ex), C2I(ey));
+
+    estimates[k].x = ex;
+    estimates[k].y = ey;
+    if (debug){
+      debug[coords_to_index(ex, ey, screen_width, screen_height)] = 0x00aa7700;
+    }
+    k++;
+  }
+  /*now there is an array of estimates.
+    The *_discard_cluster_outliers functions should fit here */
+  GST_INFO("got %d estimates for %d,%d", k, x, y);
+  if(! k){
+    return CORNER_SAME;
+  }
+  coord_t guess_x;
+  coord_t guess_y;
+
+  /*now find median values.  If the number is even, add a copy of either
+    the original value, or a random element. Either way, estimating again
+    from the same corners gives the same answer. */
+  if (! (k & 1)){
+    if (corner->status != CORNER_UNUSED){
+      estimates[k].x = corner->x;
+      estimates[k].y = corner->y;
+    }
+    else {
+      int r = RANDINT(sparrow, 0, k);
+      estimates[k].x = estimates[r].x;
+      estimates[k].y = estimates[r].y;
+    }
+    k++;
+  }
+  sparrow_point_t centre = median_centre(estimates, k);
+  guess_x = centre.x;
+  guess_y = centre.y;
+
+  GST_INFO("estimating %d,%d", C2I(guess_x), C2I(guess_y));
+
+  if (corner->status == CORNER_EXACT){
+    if (debug){
+      debug[coords_to_index(corner->x, corner->y,
+            screen_width, screen_height)] = 0xffff3300;
+    }
+    if ((guess_x - corner->x) * (guess_x - corner->x) +
+        (guess_y - corner->y) * (guess_y - corner->y)
+        < CORNER_EXACT_THRESHOLD){
+      guess_x = corner->x;
+      guess_y = corner->y;
+      corner->status = CORNER_SETTLED;
+      GST_INFO("using exact reading %0.3f, %0.3f", C2F(corner->x), C2F(corner->y));
+    }
+    else{
+      GST_INFO("REJECTING exact reading %0.3f,%0.3f: too far from median %0.3f,%0.3f",
+          C2F(corner->x), C2F(corner->y), C2F(guess_x), C2F(guess_y));
+      corner->status = CORNER_PROJECTED;
+    }
+  }
+  else if (k < MIN_CORNER_ESTIMATES){
+    GST_INFO("weak evidence (%d estimates) for corner %d,%d, marking it PROJECTED",
+        k, x, y);
+    corner->status = CORNER_PROJECTED;
+    if (debug){
+      debug[coords_to_index(guess_x, guess_y,
+            screen_width, screen_height)] = 0xff0000ff;
+    }
+  }
+  else{
+    GST_DEBUG("corner %d, %d is SETTLED", x, y);
+    corner->status = CORNER_SETTLED;
+    if (debug){
+      debug[coords_to_index(guess_x, guess_y,
+            screen_width, screen_height)] = 0xffffffff;
+    }
+  }
+  corner->x = guess_x;
+  corner->y = guess_y;
+  int change = CORNER_SAME;
+  if (corner->x != old.x || corner->y != old.y ||
+      old.status == CORNER_UNUSED){
+    change |= CORNER_MOVED;
+  }
+  if (corner->status != old.status){
+    change |= CORNER_NEW_STATUS;
+  }
+  return change;
+}
+
+static UNUSED void
+complete_map_passes(GstSparrow *sparrow, sparrow_corner_t *mesh, int width, int height,
+    guint32 *debug){
+  sparrow_estimator_t estimators[ESTIMATORS];
+  guint est_count = calculate_estimator_tables(estimators, width);
+  GST_DEBUG("made %d estimators", est_count);
+  int x, y;
+  for (int pass = 0; pass < COMPLETE_MAP_MAX_PASSES; pass++){
+    int changed = 0;
+    int new_status = 0;
+    for (y = 0; y < height; y++){
+      for (x = 0; x < width; x++){
+        if (mesh[y * width + x].status == CORNER_SETTLED){
+          GST_DEBUG("ignoring settled corner %d, %d", x, y);
+          continue;
+        }
+        int change = estimate_corner(sparrow, mesh, width, height, x, y,
+            estimators, est_count, debug);
+        changed += !! change;
+        new_status += !! (change & CORNER_NEW_STATUS);
+      }
+    }
+    GST_INFO("pass %d changed %d corners, %d of them in status", pass, changed, new_status);
+    if (! new_status){
+      break;
+    }
+  }
+}
+
+static UNUSED void
+complete_map_worklist(GstSparrow *sparrow, sparrow_corner_t *mesh, int width, int height,
+    guint32 *debug){
+  sparrow_estimator_t estimators[ESTIMATORS];
+  sparrow_offset_t offsets[ESTIMATORS * 3];
+  guint est_count = calculate_estimator_tables(estimators, width);
+  guint n_offsets = calculate_estimator_offsets(estimators, est_count, offsets);
+  GST_DEBUG("made %d estimators, using %d neighbours", est_count, n_offsets);
+  sparrow_bitmask_t todo;
+  sparrow_bitmask_t next;
+  bitmask_init(&todo, width, height);
+  bitmask_init(&next, width, height);
+  int x, y;
+  gboolean more = FALSE;
+  for (y = 0; y < height; y++){
+    for (x = 0; x < width; x++){
+      if (mesh[y * width + x].status != CORNER_SETTLED){
+        bitmask_set(&todo, x, y);
+        more = TRUE;
+      }
+    }
+  }
+  for (int pass = 0; pass < COMPLETE_MAP_MAX_PASSES && more; pass++){
+    int changed = 0;
+    int new_status = 0;
+    int estimated = 0;
+    more = FALSE;
+    for (y = 0; y < height; y++){
+      guint64 *row = bitmask_row(&todo, y);
+      for (guint32 j = 0; j < todo.row_words; j++){
+        /*corners later in this word can be queued while it is being done */
+        while (row[j]){
+          x = j * 64 + __builtin_ctzll(row[j]);
+          row[j] &= row[j] - 1;
+          int i = y * width + x;
+          if (mesh[i].status == CORNER_SETTLED){
+            continue;
+          }
+          estimated++;
+          int change = estimate_corner(sparrow, mesh, width, height, x, y,
+              estimators, est_count, debug);
+          changed += !! change;
+          new_status += !! (change & CORNER_NEW_STATUS);
+          if ((change & CORNER_NEW_STATUS) && mesh[i].status != CORNER_SETTLED){
+            bitmask_set(&next, x, y);
+            more = TRUE;
+          }
+          if (! (change & CORNER_MOVED)){
+            continue;
+          }
+          for (guint k = 0; k < n_offsets; k++){
+            int x2 = x - offsets[k].x;
+            int y2 = y - offsets[k].y;
+            if (x2 < 0 || x2 >= width || y2 < 0 || y2 >= height){
+              continue;
+            }
+            if (y2 * width + x2 > i){
+              bitmask_set(&todo, x2, y2);
+            }
+            else {
+              bitmask_set(&next, x2, y2);
+              more = TRUE;
+            }
+          }
+        }
+      }
+    }
+    GST_INFO("pass %d estimated %d corners, changing %d, %d of them in status",
+        pass, estimated, changed, new_status);
+    if (! new_status){
+      break;
+    }
+    sparrow_bitmask_t tmp = todo;
+    todo = next;
+    next = tmp;
+  }
+  bitmask_free(&todo);
+  bitmask_free(&next);
+}
+
+#endif
@@ -20,41 +20,195 @@
 #include "sparrow.h"
 #include "gstsparrow.h"
 #include "edges.h"
+#include "bitmask.h"
 
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "cv.h"
-#include "median.h"
+#include "complete_map.h"
+#include "full_lut.h"
 
 static GStaticMutex serial_mutex = G_STATIC_MUTEX_INIT;
 
 static int global_number_of_edge_finders = 0;
 
-static void dump_edges_info(GstSparrow *sparrow, sparrow_find_lines_t *fl, const char *filename){
+static inline guint32
+calibration_align(guint32 offset){
+  return (offset + SPARROW_CALIBRATION_ALIGN - 1) & ~(SPARROW_CALIBRATION_ALIGN - 1);
+}
+
+/*where the sections go, and how big the file is */
+static void
+calibration_layout(GstSparrow *sparrow, sparrow_calibration_header_t *h,
+    gint32 n_vlines, gint32 n_hlines){
+  guint32 n_corners = n_vlines * n_hlines;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, SPARROW_CALIBRATION_MAGIC, sizeof(h->magic));
+  h->version = SPARROW_CALIBRATION_VERSION;
+  h->header_size = sizeof(sparrow_calibration_header_t);
+  h->in_width = sparrow->in.width;
+  h->in_height = sparrow->in.height;
+  h->out_width = sparrow->out.width;
+  h->out_height = sparrow->out.height;
+  h->lag = sparrow->lag;
+  h->n_vlines = n_vlines;
+  h->n_hlines = n_hlines;
+  h->map_offset = calibration_align(h->header_size);
+  h->clusters_offset = calibration_align(h->map_offset +
+      sizeof(sparrow_intersect_t) * sparrow->in.pixcount);
+  h->mesh_offset = calibration_align(h->clusters_offset +
+      sizeof(sparrow_cluster_t) * n_corners);
+  h->mask_offset = calibration_align(h->mesh_offset +
+      sizeof(sparrow_corner_t) * n_corners);
+  h->lut_offset = calibration_align(h->mask_offset + sizeof(guint64) *
+      sparrow->screenmask.row_words * sparrow->screenmask.height);
+  h->file_size = h->lut_offset + sizeof(guint32) * sparrow->out.pixcount;
+}
+
+static void
+write_section(FILE *f, guint32 offset, const void *data, size_t size){
+  fseek(f, offset, SEEK_SET);
+  fwrite(data, 1, size, f);
+}
+
+/*write the calibration, including the lut, so a reload needn't find any
+  edges */
+static void
+save_calibration(GstSparrow *sparrow, sparrow_find_lines_t *fl, const char *filename){
   GST_DEBUG("about to save to %s\n", filename);
   FILE *f = fopen(filename, "w");
-  sparrow_fl_condensed_t condensed;
-  condensed.n_vlines = fl->n_vlines;
-  condensed.n_hlines = fl->n_hlines;
-
-  /* simply write fl, map, clusters and mesh in sequence */
-  GST_DEBUG("fl is %p, file is %p\n", fl, f);
-  GST_DEBUG("fl: %d x %d\n", sizeof(sparrow_find_lines_t), 1);
-  fwrite(&condensed, sizeof(sparrow_fl_condensed_t), 1, f);
-  GST_DEBUG("fl->map %d x %d\n", sizeof(sparrow_intersect_t), sparrow->in.pixcount);
-  fwrite(fl->map, sizeof(sparrow_intersect_t), sparrow->in.pixcount, f);
-  GST_DEBUG("fl->clusters  %d x %d\n", sizeof(sparrow_cluster_t), fl->n_hlines * fl->n_vlines);
-  fwrite(fl->clusters, sizeof(sparrow_cluster_t), fl->n_hlines * fl->n_vlines, f);
-  GST_DEBUG("fl->mesh  %d x %d\n", sizeof(sparrow_corner_t), fl->n_hlines * fl->n_vlines);
-  fwrite(fl->mesh, sizeof(sparrow_corner_t), fl->n_hlines * fl->n_vlines, f);
-  /*and write the mask too */
-  GST_DEBUG("sparrow->screenmask\n");
-  fwrite(sparrow->screenmask, 1, sparrow->in.pixcount, f);
+  if (f == NULL){
+    GST_WARNING("could not open %s to save the calibration\n", filename);
+    return;
+  }
+  sparrow_calibration_header_t h;
+  guint32 n_corners = fl->n_hlines * fl->n_vlines;
+  calibration_layout(sparrow, &h, fl->n_vlines, fl->n_hlines);
+  write_section(f, 0, &h, sizeof(h));
+  write_section(f, h.map_offset, fl->map, sizeof(sparrow_intersect_t) * sparrow->in.pixcount);
+  write_section(f, h.clusters_offset, fl->clusters, sizeof(sparrow_cluster_t) * n_corners);
+  write_section(f, h.mesh_offset, fl->mesh, sizeof(sparrow_corner_t) * n_corners);
+  write_section(f, h.mask_offset, sparrow->screenmask.bits, sizeof(guint64) *
+      sparrow->screenmask.row_words * sparrow->screenmask.height);
+  write_section(f, h.lut_offset, sparrow->map_lut, sizeof(guint32) * sparrow->out.pixcount);
+  if (ferror(f)){
+    GST_WARNING("error writing calibration to %s\n", filename);
+  }
   fclose(f);
 }
 
+/*each lut entry is a camera pixel (0 for none) */
+static gboolean
+lut_in_range(GstSparrow *sparrow, const guint32 *lut){
+  for (guint32 i = 0; i < sparrow->out.pixcount; i++){
+    if (lut[i] >= sparrow->in.pixcount){
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/*Map a calibration file saved by save_calibration, and if it suits this
+  camera and projector, use its lut where it lies (or a copy, if it won't
+  map). Old headerless files (and unreadable ones) are left for find_edges,
+  which reads them with read_edges_info and recalculates the lut from the
+  clusters. Files made for a different setup, or with a lut that points
+  outside the camera frame, are no use, so the calibration starts from
+  scratch.
+
+  Either way the next state is find_edges (or find_self, from scratch): with
+  a loaded lut, find_edges only waits with any other sparrows that are still
+  finding edges, so this one doesn't draw over their lines. */
+INVISIBLE sparrow_state
+reload_calibration(GstSparrow *sparrow, const char *filename){
+  sparrow->reloaded = SPARROW_RELOAD_EDGES;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1){
+    return SPARROW_FIND_EDGES;
+  }
+  off_t len = lseek(fd, 0, SEEK_END);
+  sparrow_calibration_header_t h;
+  if (len < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+      memcmp(h.magic, SPARROW_CALIBRATION_MAGIC, sizeof(h.magic))){
+    GST_INFO("%s is an old style calibration file\n", filename);
+    close(fd);
+    return SPARROW_FIND_EDGES;
+  }
+  /*everything but the lag has to match what this setup would write */
+  sparrow_calibration_header_t expected;
+  calibration_layout(sparrow, &expected, h.n_vlines, h.n_hlines);
+  expected.lag = h.lag;
+  if (h.n_vlines != (sparrow->out.width + LINE_PERIOD - 1) / LINE_PERIOD ||
+      h.n_hlines != (sparrow->out.height + LINE_PERIOD - 1) / LINE_PERIOD ||
+      memcmp(&h, &expected, sizeof(h)) || len != (off_t)h.file_size){
+    GST_WARNING("%s (version %u, camera %ux%u, projector %ux%u, %u bytes) "
+        "doesn't suit this camera (%dx%d) and projector (%dx%d). Recalibrating\n",
+        filename, h.version, h.in_width, h.in_height, h.out_width, h.out_height,
+        (guint)len, sparrow->in.width, sparrow->in.height,
+        sparrow->out.width, sparrow->out.height);
+    close(fd);
+    sparrow->reloaded = SPARROW_RELOAD_NONE;
+    return SPARROW_NEXT_STATE;
+  }
+  size_t mask_size = sizeof(guint64) * sparrow->screenmask.row_words *
+    sparrow->screenmask.height;
+  size_t lut_size = sizeof(guint32) * sparrow->out.pixcount;
+  /*private and writable, so a stray write only touches a copy of the page.
+    The lut is all read every frame, so it may as well be read in now. */
+  guint8 *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  guint32 *lut = NULL;
+  if (mem != MAP_FAILED){
+    lut = (guint32 *)(mem + h.lut_offset);
+  }
+  else {
+    GST_WARNING("could not mmap %s (%u bytes), reading it instead\n",
+        filename, (guint)len);
+    if (pread(fd, sparrow->map_lut, lut_size, h.lut_offset) == (ssize_t)lut_size &&
+        pread(fd, sparrow->screenmask.bits, mask_size, h.mask_offset) == (ssize_t)mask_size){
+      lut = sparrow->map_lut;
+    }
+    else {
+      GST_WARNING("could not read %s either\n", filename);
+    }
+  }
+  close(fd);
+  /*play reads the camera frame wherever the lut says, so a damaged file
+    could send it anywhere */
+  if (lut && ! lut_in_range(sparrow, lut)){
+    GST_WARNING("%s has a lut that points outside the camera frame\n", filename);
+    lut = NULL;
+  }
+  if (lut == NULL){
+    GST_WARNING("Recalibrating\n");
+    if (mem != MAP_FAILED){
+      munmap(mem, len);
+    }
+    else {
+      memset(sparrow->map_lut, 0, lut_size);
+    }
+    sparrow->reloaded = SPARROW_RELOAD_NONE;
+    return SPARROW_NEXT_STATE;
+  }
+  if (mem != MAP_FAILED){
+    memcpy(sparrow->screenmask.bits, mem + h.mask_offset, mask_size);
+    free(sparrow->map_lut);
+    sparrow->map_lut = lut;
+    sparrow->calibration_map = mem;
+    sparrow->calibration_size = len;
+  }
+  sparrow->lag = h.lag;
+  sparrow->reloaded = SPARROW_RELOAD_LUT;
+  GST_INFO("reloaded calibration from %s, lag %u\n", filename, h.lag);
+  return SPARROW_FIND_EDGES;
+}
+
+/*old calibration files, with no header: the condensed fl, then the map,
+  clusters, mesh, and a byte per pixel mask */
 static void read_edges_info(GstSparrow *sparrow, sparrow_find_lines_t *fl, const char *filename){
   FILE *f = fopen(filename, "r");
   sparrow_fl_condensed_t condensed;
@@ -66,7 +220,10 @@ static void read_edges_info(GstSparrow *sparrow, sparrow_find_lines_t *fl, const
   read += fread(fl->map, sizeof(sparrow_intersect_t), sparrow->in.pixcount, f);
   read += fread(fl->clusters, sizeof(sparrow_cluster_t), n_corners, f);
   read += fread(fl->mesh, sizeof(sparrow_corner_t), n_corners, f);
-  read += fread(sparrow->screenmask, 1, sparrow->in.pixcount, f);
+  guint8 *mask = malloc_or_die(sparrow->in.pixcount);
+  read += fread(mask, 1, sparrow->in.pixcount, f);
+  bitmask_from_bytes(&sparrow->screenmask, mask);
+  free(mask);
   fclose(f);
 }
 
@@ -78,108 +235,36 @@ debug_map_lut(GstSparrow *sparrow, sparrow_find_lines_t *fl){
   }
 }
 
-#if USE_FLOAT_COORDS
 
-#define COORD_TO_INT(x)((int)((x) + 0.5))
-#define COORD_TO_FLOAT(x)((double)(x))
-#define INT_TO_COORD(x)((coord_t)(x))
-
-static inline int
-coord_to_int_clamp(coord_t x, const int max_plus_one){
-  if (x < 0)
-    return 0;
-  if (x >= max_plus_one - 1.5)
-    return max_plus_one - 1;
-  return (int)(x + 0.5);
-}
-
-static inline int
-coord_to_int_clamp_dither(sparrow_find_lines_t *fl, coord_t x,
-    const int max_plus_one, const int i){
-  if (x < 0)
-    return 0;
-  x += fl->dither[i];
-  if (x >= max_plus_one)
-    return max_plus_one - 1;
-  return (int)x;
-}
+/********************************************/
 
+typedef struct lut_job_s {
+  sparrow_find_lines_t *fl;
+  guint32 *map_lut;
+} lut_job_t;
 
-static inline int
-coord_in_range(coord_t x, const int max_plus_one){
-  return x >= 0 && (x + 0.5 < max_plus_one);
-}
-
+static void
+lut_band(GstSparrow *sparrow, void *data, int start, int end){
+  lut_job_t *job = (lut_job_t *)data;
+  sparrow_find_lines_t *fl = job->fl;
+  for (int mcy = start; mcy < end; mcy++){
+#if USE_FIXED_POINT_LUT
+    lut_row_fixed(sparrow, fl->mesh, fl->n_vlines, fl->dither_tile, job->map_lut, mcy);
 #else
-
-#define COORD_TO_INT(x)((x) / (1 << SPARROW_FIXED_POINT))
-#define COORD_TO_FLOAT(x)(((double)(x)) / (1 << SPARROW_FIXED_POINT))
-#define INT_TO_COORD(x)((x) * (1 << SPARROW_FIXED_POINT))
-
-static inline int
-coord_to_int_clamp(coord_t x, const int max_plus_one){
-  if (x < 0)
-    return 0;
-  x >>= SPARROW_FIXED_POINT;
-  if (x >= max_plus_one)
-    return max_plus_one - 1;
-  return x;
-}
-
-static inline int
-coord_in_range(coord_t x, const int max_plus_one){
-  return x >= 0 && (x < max_plus_one << SPARROW_FIXED_POINT);
-}
-
+    lut_row_float(sparrow, fl->mesh, fl->n_vlines, fl->dither, job->map_lut, mcy);
 #endif
-
-//these ones are common
-static inline int
-coords_to_index(coord_t x, coord_t y, int w, int h){
-  int iy = coord_to_int_clamp(y, h);
-  int ix = coord_to_int_clamp(x, w);
-  return iy * w + ix;
+  }
 }
 
-#define C2I COORD_TO_INT
-#define C2F COORD_TO_FLOAT
-
-/********************************************/
-
+/*each row of mesh squares fills its own rows of the lut, so they can be
+  done in bands */
 static void
 corners_to_full_lut(GstSparrow *sparrow, sparrow_find_lines_t *fl){
   DEBUG_FIND_LINES(fl);
-  sparrow_corner_t *mesh = fl->mesh;   /*maps regular points in ->out to points in ->in */
-  guint32 *map_lut = sparrow->map_lut;
-  int mesh_w = fl->n_vlines;
-  int mesh_h = fl->n_hlines;
-  int mcy, mmy, mcx, mmx; /*Mesh Corner|Modulus X|Y*/
-  int y = H_LINE_OFFSET;
-  sparrow_corner_t *mesh_row = mesh;
-
-  for(mcy = 0; mcy < mesh_h - 1; mcy++){
-    for (mmy = 0; mmy < LINE_PERIOD; mmy++, y++){
-      sparrow_corner_t *mesh_square = mesh_row;
-      int i = y * sparrow->out.width + V_LINE_OFFSET;
-      for(mcx = 0; mcx < mesh_w - 1; mcx++){
-        coord_t iy = mesh_square->y + mmy * mesh_square->dyd;
-        coord_t ix = mesh_square->x + mmy * mesh_square->dxd;
-        for (mmx = 0; mmx < LINE_PERIOD; mmx++, i++){
-          int ixx = coord_to_int_clamp_dither(fl, ix, sparrow->in.width, i);
-          int iyy = coord_to_int_clamp_dither(fl, iy, sparrow->in.height, i);
-          guint32 inpos = iyy * sparrow->in.width + ixx;
-          if(sparrow->screenmask[inpos]){
-            map_lut[i] = inpos;
-          }
-          ix += mesh_square->dxr;
-          iy += mesh_square->dyr;
-        }
-        mesh_square++;
-      }
-    }
-    mesh_row += mesh_w;
-  }
-  sparrow->map_lut = map_lut;
+  lut_job_t job;
+  job.fl = fl;
+  job.map_lut = sparrow->map_lut;
+  sparrow_run_bands(sparrow, lut_band, &job, fl->n_hlines - 1);
   debug_map_lut(sparrow, fl);
 }
 
@@ -244,77 +329,141 @@ debug_clusters(GstSparrow *sparrow, sparrow_find_lines_t *fl){
 #define CLUSTER_SIZE 8
 
 
-/*find map points with common intersection data, and collect them into clusters */
+/*add a voter to a cluster. A full cluster keeps the CLUSTER_SIZE strongest,
+  bubbling the weakest out. Returns the dropped signal, or 0 if none. */
+static inline guint
+add_cluster_voter(sparrow_cluster_t *cluster, coord_t x, coord_t y, guint signal){
+  sparrow_voter_t *voters = cluster->voters;
+  int n = cluster->n;
+  if (n < CLUSTER_SIZE){
+    voters[n].x = x;
+    voters[n].y = y;
+    voters[n].signal = signal;
+    cluster->n++;
+    return 0;
+  }
+  /*duplicate x, y, signal, so they aren't mucked up */
+  guint ts = signal;
+  coord_t tx = x;
+  coord_t ty = y;
+  for (int j = 0; j < CLUSTER_SIZE; j++){
+    if (voters[j].signal < ts){
+      /*replaced one ends up here */
+      guint ts2 = voters[j].signal;
+      coord_t tx2 = voters[j].x;
+      coord_t ty2 = voters[j].y;
+      voters[j].signal = ts;
+      voters[j].x = tx;
+      voters[j].y = ty;
+      ts = ts2;
+      tx = tx2;
+      ty = ty2;
+    }
+  }
+  return ts;
+}
+
+static inline void
+push_cluster_vote(cluster_chunk_t *chunk, guint32 index, int x, int y, guint signal){
+  if (chunk->n == chunk->size){
+    guint32 size = MAX(chunk->size * 2, 256);
+    cluster_vote_t *votes = malloc_or_die(size * sizeof(cluster_vote_t));
+    if (chunk->votes){
+      memcpy(votes, chunk->votes, chunk->n * sizeof(cluster_vote_t));
+      free(chunk->votes);
+    }
+    chunk->votes = votes;
+    chunk->size = size;
+  }
+  cluster_vote_t *v = &chunk->votes[chunk->n];
+  v->cluster = index;
+  v->voter.x = INT_TO_COORD(x);
+  v->voter.y = INT_TO_COORD(y);
+  v->voter.signal = signal;
+  chunk->n++;
+}
+
+typedef struct cluster_job_s {
+  sparrow_find_lines_t *fl;
+  cluster_chunk_t chunks[CLUSTER_CHUNKS];
+} cluster_job_t;
+
+/*collect the votes in a band of chunks of camera rows, in row order */
+static void
+cluster_band(GstSparrow *sparrow, void *data, int start, int end){
+  cluster_job_t *job = (cluster_job_t *)data;
+  sparrow_find_lines_t *fl = job->fl;
+  int width = sparrow->in.width;
+  int height = sparrow->in.height;
+  for (int c = start; c < end; c++){
+    cluster_chunk_t *chunk = &job->chunks[c];
+    int y_start = (height * c) / CLUSTER_CHUNKS;
+    int y_end = (height * (c + 1)) / CLUSTER_CHUNKS;
+    for (int y = y_start; y < y_end; y++){
+      sparrow_intersect_t *row = &fl->map[y * width];
+      for (int x = 0; x < width; x++){
+        sparrow_intersect_t *p = &row[x];
+        guint vsig = p->signal[SPARROW_VERTICAL];
+        guint hsig = p->signal[SPARROW_HORIZONTAL];
+        /*remembering that 0 is valid as a line number, but not as a signal */
+        if (! (vsig && hsig)){
+          continue;
+        }
+        /*This one is lobbying for the position of a corner.*/
+        int vline = p->lines[SPARROW_VERTICAL];
+        int hline = p->lines[SPARROW_HORIZONTAL];
+        if (vline == BAD_PIXEL || hline == BAD_PIXEL){
+          chunk->bad_pixels++;
+          continue;
+        }
+        push_cluster_vote(chunk, hline * fl->n_vlines + vline, x, y,
+            (vsig * hsig) / SIGNAL_QUANT);
+      }
+    }
+  }
+}
+
+/*find map points with common intersection data, and collect them into
+  clusters. The map is read in bands of rows on the worker threads, then the
+  votes are added to the clusters in row order, so the clusters come out as
+  if it was done in one pass. */
 static void
 make_clusters(GstSparrow *sparrow, sparrow_find_lines_t *fl){
   sparrow_cluster_t *clusters = fl->clusters;
-  int x, y;
   /*special case: spurious values collect up at 0,0 */
   fl->map[0].signal[SPARROW_VERTICAL] = 0;
   fl->map[0].signal[SPARROW_HORIZONTAL] = 0;
   /*each point in fl->map is in a vertical line, a horizontal line, both, or
     neither.  Only the "both" case matters. */
-  for (y = 0; y < sparrow->in.height; y++){
-    for (x = 0; x < sparrow->in.width; x++){
-      sparrow_intersect_t *p = &fl->map[y * sparrow->in.width + x];
-      guint vsig = p->signal[SPARROW_VERTICAL];
-      guint hsig = p->signal[SPARROW_HORIZONTAL];
-      /*remembering that 0 is valid as a line number, but not as a signal */
-      if (! (vsig && hsig)){
-        continue;
+  cluster_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.fl = fl;
+  sparrow_run_bands(sparrow, cluster_band, &job, CLUSTER_CHUNKS);
+
+  guint32 n_votes = 0;
+  guint32 n_bad = 0;
+  guint32 n_dropped = 0;
+  guint32 n_zero = 0;
+  for (int c = 0; c < CLUSTER_CHUNKS; c++){
+    cluster_chunk_t *chunk = &job.chunks[c];
+    for (guint32 i = 0; i < chunk->n; i++){
+      cluster_vote_t *v = &chunk->votes[i];
+      if (v->voter.signal == 0){
+        n_zero++;
       }
-      /*This one is lobbying for the position of a corner.*/
-      int vline = p->lines[SPARROW_VERTICAL];
-      int hline = p->lines[SPARROW_HORIZONTAL];
-      if (vline == BAD_PIXEL || hline == BAD_PIXEL){
-        GST_DEBUG("ignoring bad pixel %d, %d\n", x, y);
-        continue;
-      }
-      sparrow_cluster_t *cluster = &clusters[hline * fl->n_vlines + vline];
-      sparrow_voter_t *voters = cluster->voters;
-      int n = cluster->n;
-      guint signal = (vsig * hsig) / SIGNAL_QUANT;
-      GST_DEBUG("signal at %p (%d, %d): %dv %dh, product %u, lines: %dv %dh\n"
-          "cluster is %p, n is %d\n", p, x, y,
-          vsig, hsig, signal, vline, hline, cluster, n);
-      if (signal == 0){
-        GST_WARNING("signal at %p (%d, %d) is %d following quantisation!\n",
-            p, x, y, signal);
-      }
-
-      if (n < CLUSTER_SIZE){
-        voters[n].x = INT_TO_COORD(x);
-        voters[n].y = INT_TO_COORD(y);
-        voters[n].signal = signal;
-        cluster->n++;
-      }
-      else {
-        /*duplicate x, y, signal, so they aren't mucked up */
-        guint ts = signal;
-        coord_t tx = x;
-        coord_t ty = y;
-        /*replaced one ends up here */
-        guint ts2;
-        coord_t tx2;
-        coord_t ty2;
-        for (int j = 0; j < CLUSTER_SIZE; j++){
-          if (voters[j].signal < ts){
-            ts2 = voters[j].signal;
-            tx2 = voters[j].x;
-            ty2 = voters[j].y;
-            voters[j].signal = ts;
-            voters[j].x = tx;
-            voters[j].y = ty;
-            ts = ts2;
-            tx = tx2;
-            ty = ty2;
-          }
-        }
-        GST_DEBUG("more than %d pixels at cluster for corner %d, %d."
-            "Dropped %u for %u\n",
-            CLUSTER_SIZE, vline, hline, ts2, signal);
+      if (add_cluster_voter(&clusters[v->cluster], v->voter.x, v->voter.y,
+              v->voter.signal)){
+        n_dropped++;
       }
     }
+    n_votes += chunk->n;
+    n_bad += chunk->bad_pixels;
+    free(chunk->votes);
+  }
+  GST_DEBUG("%u votes for %d corners; ignored %u bad pixels, dropped %u votes "
+      "from full clusters\n", n_votes, fl->n_hlines * fl->n_vlines, n_bad, n_dropped);
+  if (n_zero){
+    GST_WARNING("%u signals were 0 following quantisation!\n", n_zero);
   }
   if (sparrow->debug){
     debug_clusters(sparrow, fl);
@@ -498,331 +647,20 @@ make_corners(GstSparrow *sparrow, sparrow_find_lines_t *fl){
   }
 }
 
-static sparrow_point_t
-median_centre(sparrow_voter_t *estimates, int n){
-  /*X and Y arevcalculated independently, which is really not right.
-    on the other hand, it probably works. */
-  int i;
-  sparrow_point_t result;
-  coord_t vals[n];
-  for (i = 0; i < n; i++){
-    vals[i] = estimates[i].x;
-  }
-  result.x = coord_median(vals, n);
-
-  for (i = 0; i < n; i++){
-    vals[i] = estimates[i].y;
-  }
-  result.y = coord_median(vals, n);
-  return result;
-}
-
-static const sparrow_estimator_t base_estimators[] = {
-  { 0, 1,     0, 2,    0, 3},
-  { 0, 2,     0, 4,    0, 6},
-  { 1, 0,     2, 0,    3, 0},
-  { 1, 1,     2, 2,    3, 3},
-  { 1, 2,     2, 4,    3, 6},
-  { 1, 3,     2, 6,    3, 9},
-  { 2, 0,     4, 0,    6, 0},
-  { 2, 1,     4, 2,    6, 3},
-  { 2, 2,     4, 4,    6, 6},
-  { 2, 3,     4, 6,    6, 9},
-  { 3, 1,     6, 2,    9, 3},
-  { 3, 2,     6, 4,    9, 6},
-};
-
-#define BASE_ESTIMATORS (sizeof(base_estimators) / sizeof(sparrow_estimator_t))
-#define ESTIMATORS  (BASE_ESTIMATORS * 4)
-
-static inline guint
-calculate_estimator_tables(sparrow_estimator_t *estimators){
-  guint i, j;
-  sparrow_estimator_t *e = estimators;
-  for (i = 0; i < BASE_ESTIMATORS; i++){
-    for (j = 0; j < 4; j++){
-      *e = base_estimators[i];
-      if (j & 1){
-        if (! e->x1){
-          continue;
-        }
-        e->x1 = -e->x1;
-        e->x2 = -e->x2;
-        e->x3 = -e->x3;
-      }
-      if (j & 2){
-        if (! e->y1){
-          continue;
-        }
-        e->y1 = -e->y1;
-        e->y2 = -e->y2;
-        e->y3 = -e->y3;
-      }
-      GST_DEBUG("estimator: %-d,%-d  %-d,%-d  %-d,%-d",
-          e->x1, e->y1, e->x2, e->y2, e->x3, e->y3);
-      e++;
-    }
-  }
-  return e - estimators;
-}
-
-
 /*the map made above is likely to be full of errors. Fix them, and add in
   missing points */
 static void
 complete_map(GstSparrow *sparrow, sparrow_find_lines_t *fl){
-  sparrow_voter_t estimates[ESTIMATORS + 1]; /* 1 extra for trick simplifying median */
-  sparrow_estimator_t estimators[ESTIMATORS];
-  guint est_count = calculate_estimator_tables(estimators);
-  GST_DEBUG("made %d estimators", est_count);
   guint32 *debug = NULL;
   if (sparrow->debug){
     debug = (guint32*)fl->debug->imageData;
     memset(debug, 0, sparrow->in.size);
   }
-
-  int x, y;
-  int width = fl->n_vlines;
-  int height = fl->n_hlines;
-  int screen_width = sparrow->in.width;
-  int screen_height = sparrow->in.height;
-  sparrow_corner_t *mesh = fl->mesh;
-  sparrow_corner_t *mesh_next = fl->mesh_next;
-
-  memset(estimates, 0, sizeof(estimates)); /*just for clarity in debugging */
-  int prev_settled = 0;
-  while (1){
-    memcpy(mesh_next, mesh, width * height * sizeof(sparrow_corner_t));
-    int settled = 0;
-    for (y = 0; y < height; y++){
-      for (x = 0; x < width; x++){
-        sparrow_corner_t *corner = &mesh[y * width + x];
-        if (corner->status == CORNER_SETTLED){
-          settled ++;
-          GST_DEBUG("ignoring settled corner %d, %d", x, y);
-          continue;
-        }
-        int k = 0;
-        for (guint j = 0; j < est_count; j++){
-          sparrow_estimator_t *e = &estimators[j];
-          int x3, y3, x2, y2, x1, y1;
-          y3 = y + e->y3;
-          x3 = x + e->x3;
-          if (!(y3 >= 0 && y3 < height &&
-                  x3 >= 0 && x3 < width &&
-                  mesh[y3 * width + x3].status != CORNER_UNUSED
-              )){
-            GST_DEBUG("not using estimator %d because corners aren't used, or are off screen\n"
-                "x3 %d, y3 %d", j, x3, y3);
-            continue;
-          }
-          y2 = y + e->y2;
-          x2 = x + e->x2;
-          y1 = y + e->y1;
-          x1 = x + e->x1;
-          if (mesh[y2 * width + x2].status == CORNER_UNUSED ||
-              mesh[y1 * width + x1].status == CORNER_UNUSED){
-            GST_DEBUG("not using estimator %d because corners aren't used", j);
-            continue;
-          }
-          /*there are 3 points, and the unknown one.
-            They should all be in a line.
-            The ratio of the p3-p2:p2-p1 sould be the same as
-            p2-p1:p1:p0.
-
-            This really has to be done in floating point.
-
-            collinearity, no division, but no useful error metric
-            x[0] * (y[1]-y[2]) + x[1] * (y[2]-y[0]) + x[2] * (y[0]-y[1])  == 0
-            (at least not without further division)
-
-            This way:
-
-            cos angle = dot product / product of euclidean lengths
-
-            (dx12 * dx23 + dy12 * dy23) /
-            (sqrt(dx12 * dx12 + dy12 * dy12) * sqrt(dx23 * dx23 + dy23 * dy23))
-
-            is costly up front (sqrt), but those distances need to be
-            calculated anyway (or at least they are handy).  Not much gained by
-            short-circuiting on bad collinearity, though.
-
-            It also handlily catches all the division by zeros in one meaningful
-            go.
-          */
-          sparrow_corner_t *c1 = &mesh[y1 * width + x1];
-          sparrow_corner_t *c2 = &mesh[y2 * width + x2];
-          sparrow_corner_t *c3 = &mesh[y3 * width + x3];
-
-          double dx12 = c1->x - c2->x;
-          double dy12 = c1->y - c2->y;
-          double dx23 = c2->x - c3->x;
-          double dy23 = c2->y - c3->y;
-          double distance12 = sqrt(dx12 * dx12 + dy12 * dy12);
-          double distance23 = sqrt(dx23 * dx23 + dy23 * dy23);
-
-          double dp = dx12 * dx23 + dy12 * dy23;
-
-          double distances = distance12 * distance23;
-
-          GST_LOG("mesh points: %d,%d, %d,%d, %d,%d\n"
-              "map points: %d,%d, %d,%d,  %d,%d\n"
-              "diffs: 12: %0.3f,%0.3f,  23: %0.3f,%0.3f, \n"
-              "distances: 12: %0.3f,   32: %0.3f\n",
-              x1, y1, x2, y2, x3, y3,
-              C2I(c1->x), C2I(c1->y), C2I(c2->x), C2I(c2->y), C2I(c3->x), C2I(c3->y),
-              dx12, dy12, dx23, dy23, distance12, distance23
-          );
-
-          if (distances == 0.0){
-            GST_INFO("at least two points out of %d,%d, %d,%d, %d,%d are the same!",
-                x1, y1, x2, y2, x3, y3);
-            continue;
-          }
-          double line_error = 1.0 - dp / distances;
-          if (line_error > MAX_NONCOLLINEARITY){
-            GST_DEBUG("Points %d,%d, %d,%d, %d,%d are not in a line: non-collinearity: %3f",
-                x1, y1, x2, y2, x3, y3, line_error);
-            continue;
-          }
-          GST_LOG("GOOD collinearity: %3f", line_error);
-
-
-          double ratio = distance12 / distance23;
-          /*so here's the estimate!*/
-          coord_t dx = dx12 * ratio;
-          coord_t dy = dy12 * ratio;
-          coord_t ex = c1->x + dx;
-          coord_t ey = c1->y + dy;
-
-          GST_LOG("dx, dy: %d,%d, ex, ey: %d,%d\n"
-              "dx raw:  %0.3f,%0.3f,  x1, x2: %0.3f,%0.3f,\n"
-              "distances: 12: %0.3f,   32: %0.3f\n"
-              "ratio: %0.3f\n",
-              C2I(dx), C2I(dy), C2I(ex), C2I(ey),
-              dx, dy, ex, ey, ratio
-          );
-
-          if (! coord_in_range(ey, screen_height) ||
-              ! coord_in_range(ex, screen_width)){
-            GST_DEBUG("rejecting estimate for %d, %d, due to ex, ey being %d, %d",
-                x, y, C2I(ex), C2I(ey));
-            continue;
-          }
-
-          GST_LOG("estimator %d,%d SUCCESSFULLY estimated that %d, %d will be %d, %d",
-              x1, x2, x, y, C2I(ex), C2I(ey));
-
-          estimates[k].x = ex;
-          estimates[k].y = ey;
-          if (sparrow->debug){
-            debug[coords_to_index(ex, ey, sparrow->in.width, sparrow->in.height)] = 0x00aa7700;
-          }
-          k++;
-        }
-        /*now there is an array of estimates.
-          The *_discard_cluster_outliers functions should fit here */
-        GST_INFO("got %d estimates for %d,%d", k, x, y);
-        if(! k){
-          continue;
-        }
-        coord_t guess_x;
-        coord_t guess_y;
-
-#if 1
-        /*now find median values.  If the number is even, add a copy of either
-          the original value, or a random element. */
-        if (! k & 1){
-          if (corner->status != CORNER_UNUSED){
-            estimates[k].x = corner->x;
-            estimates[k].y = corner->y;
-          }
-          else {
-            int r = RANDINT(sparrow, 0, r);
-            estimates[k].x = estimates[r].x;
-            estimates[k].y = estimates[r].y;
-          }
-          k++;
-        }
-        sparrow_point_t centre = median_centre(estimates, k);
-        guess_x = centre.x;
-        guess_y = centre.y;
-
+#if USE_WORKLIST_SOLVER
+  complete_map_worklist(sparrow, fl->mesh, fl->n_vlines, fl->n_hlines, debug);
 #else
-        k = euclidean_discard_cluster_outliers(estimates, k);
-        if (sparrow->debug){
-          for (int j = 0; j < k; j++){
-            debug[coords_to_index(estimates[j].x, estimates[j].y,
-                  sparrow->in.width, sparrow->in.height)] = 0x00ffff00;
-          }
-        }
-        GST_INFO("After discard, left with %d estimates", k);
-        /*now what? the mean? yes.*/
-        coord_t sumx = 0;
-        coord_t sumy = 0;
-        for (int j = 0; j < k; j++){
-          sumx += estimates[j].x;
-          sumy += estimates[j].y;
-        }
-        guess_x = sumx / k;
-        guess_y = sumy / k;
+  complete_map_passes(sparrow, fl->mesh, fl->n_vlines, fl->n_hlines, debug);
 #endif
-
-        GST_INFO("estimating %d,%d", C2I(guess_x), C2I(guess_y));
-
-        if (corner->status == CORNER_EXACT){
-          if (sparrow->debug){
-            debug[coords_to_index(corner->x, corner->y,
-                  sparrow->in.width, sparrow->in.height)] = 0xffff3300;
-          }
-          if ((guess_x - corner->x) * (guess_x - corner->x) +
-              (guess_y - corner->y) * (guess_y - corner->y)
-              < CORNER_EXACT_THRESHOLD){
-            guess_x = corner->x;
-            guess_y = corner->y;
-            corner->status = CORNER_SETTLED;
-            GST_INFO("using exact reading %0.3f, %0.3f", C2F(corner->x), C2F(corner->y));
-          }
-          else{
-            GST_INFO("REJECTING exact reading %0.3f,%0.3f: too far from median %0.3f,%0.3f",
-                C2F(corner->x), C2F(corner->y), C2F(corner->x), C2F(corner->y));
-            corner->status = CORNER_PROJECTED;
-          }
-        }
-        else if (k < MIN_CORNER_ESTIMATES){
-          GST_INFO("weak evidence (%d estimates) for corner %d,%d, marking it PROJECTED",
-              k, x, y);
-          corner->status = CORNER_PROJECTED;
-          if (sparrow->debug){
-            debug[coords_to_index(guess_x, guess_y,
-                  sparrow->in.width, sparrow->in.height)] = 0xff0000ff;
-          }
-        }
-        else{
-          GST_DEBUG("corner %d, %d is SETTLED", x, y);
-          corner->status = CORNER_SETTLED;
-          settled ++;
-          if (sparrow->debug){
-            debug[coords_to_index(guess_x, guess_y,
-                  sparrow->in.width, sparrow->in.height)] = 0xffffffff;
-          }
-        }
-        corner->x = guess_x;
-        corner->y = guess_y;
-      }
-    }
-    GST_INFO("settled %d in that round. %d left to go",
-        settled - prev_settled, width * height - settled);
-    if (settled == width * height || settled == prev_settled){
-      break;
-    }
-    prev_settled = settled;
-    sparrow_corner_t *tmp = mesh_next;
-    mesh_next = mesh;
-    mesh = tmp;
-  }
-  fl->mesh = mesh;
-  fl->mesh_next = mesh_next;
   MAYBE_DEBUG_IPL(fl->debug);
 }
 
@@ -867,49 +705,163 @@ calculate_deltas(GstSparrow *sparrow, sparrow_find_lines_t *fl){
 }
 
 
-static void
-look_for_line(GstSparrow *sparrow, guint8 *in, sparrow_find_lines_t *fl,
-    sparrow_line_t *line){
-  guint i;
-  guint32 colour;
+/*the line colour's share of a pixel */
+static inline int
+line_signal(sparrow_find_lines_t *fl, guint32 cmask, guint32 pixel){
+  guint32 colour = pixel & cmask;
+  return (((colour >> fl->shift1) & COLOUR_MASK) +
+      ((colour >> fl->shift2) & COLOUR_MASK));
+}
+
+/*subtract background noise from the rect, and record any line pixels in
+  it. Returns the number of pixels with any signal. */
+static guint32
+scan_for_line(GstSparrow *sparrow, sparrow_find_lines_t *fl,
+    sparrow_line_t *line, CvRect rect){
+  int x, y;
   guint32 cmask = sparrow->out.colours[sparrow->colour];
   int signal;
+  guint32 n_signals = 0;
 
-  /* subtract background noise */
-  fl->input->imageData = (char *)in;
+  cvSetImageROI(fl->input, rect);
+  cvSetImageROI(fl->threshold, rect);
+  cvSetImageROI(fl->working, rect);
   cvSub(fl->input, fl->threshold, fl->working, NULL);
+  cvResetImageROI(fl->input);
+  cvResetImageROI(fl->threshold);
+  cvResetImageROI(fl->working);
   guint32 *in32 = (guint32 *)fl->working->imageData;
 
-  for (i = 0; i < sparrow->in.pixcount; i++){
-    colour = in32[i] & cmask;
-    signal = (((colour >> fl->shift1) & COLOUR_MASK) +
-        ((colour >> fl->shift2) & COLOUR_MASK));
-
-    if (signal){
-      if (fl->map[i].lines[line->dir] &&
-          signal < 2 * fl->map[i].signal[line->dir]){
-        if (fl->map[i].lines[line->dir] != BAD_PIXEL &&
-            signal * 2 < fl->map[i].signal[line->dir]){
-          /*assume the pixel is on for everyone and will just confuse
-            matters. ignore it.
-          */
-          /*
-            GST_DEBUG("HEY, expected point %d to be in line %d (dir %d) "
-            "and thus empty, but it is also in line %d\n"
-            "old signal %d, new signal %d, marking as BAD\n",
-            i, line->index, line->dir, fl->map[i].lines[line->dir],
-            fl->map[i].signal[line->dir], signal);
-          */
-          fl->map[i].lines[line->dir] = BAD_PIXEL;
-          fl->map[i].signal[line->dir] = 0;
+  for (y = rect.y; y < rect.y + rect.height; y++){
+    for (x = rect.x; x < rect.x + rect.width; x++){
+      guint i = y * sparrow->in.width + x;
+      signal = line_signal(fl, cmask, in32[i]);
+
+      if (signal){
+        n_signals++;
+        if (fl->map[i].lines[line->dir] &&
+            signal < 2 * fl->map[i].signal[line->dir]){
+          if (fl->map[i].lines[line->dir] != BAD_PIXEL &&
+              signal * 2 < fl->map[i].signal[line->dir]){
+            /*assume the pixel is on for everyone and will just confuse
+              matters. ignore it.
+            */
+            /*
+              GST_DEBUG("HEY, expected point %d to be in line %d (dir %d) "
+              "and thus empty, but it is also in line %d\n"
+              "old signal %d, new signal %d, marking as BAD\n",
+              i, line->index, line->dir, fl->map[i].lines[line->dir],
+              fl->map[i].signal[line->dir], signal);
+            */
+            fl->map[i].lines[line->dir] = BAD_PIXEL;
+            fl->map[i].signal[line->dir] = 0;
+          }
+        }
+        else{
+          fl->map[i].lines[line->dir] = line->index;
+          fl->map[i].signal[line->dir] = signal;
+          if (! line->seen){
+            line->seen = TRUE;
+            line->x0 = line->x1 = x;
+            line->y0 = line->y1 = y;
+          }
+          line->x0 = MIN(line->x0, x);
+          line->x1 = MAX(line->x1, x);
+          line->y0 = MIN(line->y0, y);
+          line->y1 = MAX(line->y1, y);
         }
       }
-      else{
-        fl->map[i].lines[line->dir] = line->index;
-        fl->map[i].signal[line->dir] = signal;
-      }
     }
   }
+  return n_signals;
+}
+
+static inline int
+lines_in_direction(sparrow_find_lines_t *fl, sparrow_axis_t dir){
+  int n_h = fl->v_lines - fl->h_lines;
+  return (dir == SPARROW_HORIZONTAL) ? n_h : fl->n_lines - n_h;
+}
+
+/*A line should land between the nearest lines either side of it (in the
+  same direction) that have been seen. If there are both, return the box
+  around them, with a margin. */
+static gboolean
+predict_line_rect(GstSparrow *sparrow, sparrow_find_lines_t *fl,
+    sparrow_line_t *line, CvRect *rect){
+  sparrow_line_t *lines = (line->dir == SPARROW_HORIZONTAL) ? fl->h_lines : fl->v_lines;
+  int n = lines_in_direction(fl, line->dir);
+  sparrow_line_t *lo = NULL;
+  sparrow_line_t *hi = NULL;
+  int j;
+  for (j = line->index - 1; j >= 0 && ! lo; j--){
+    lo = lines[j].seen ? &lines[j] : NULL;
+  }
+  for (j = line->index + 1; j < n && ! hi; j++){
+    hi = lines[j].seen ? &lines[j] : NULL;
+  }
+  if (! lo || ! hi){
+    return FALSE;
+  }
+  int x0 = MAX(MIN(lo->x0, hi->x0) - LINE_ROI_MARGIN, 0);
+  int y0 = MAX(MIN(lo->y0, hi->y0) - LINE_ROI_MARGIN, 0);
+  int x1 = MIN(MAX(lo->x1, hi->x1) + LINE_ROI_MARGIN, sparrow->in.width - 1);
+  int y1 = MIN(MAX(lo->y1, hi->y1) + LINE_ROI_MARGIN, sparrow->in.height - 1);
+  *rect = cvRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+  return TRUE;
+}
+
+/*scan the rest of the frame: the strips above, below and either side of
+  rect, which has been scanned already */
+static guint32
+scan_around_rect(GstSparrow *sparrow, sparrow_find_lines_t *fl,
+    sparrow_line_t *line, CvRect rect){
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  int x1 = rect.x + rect.width;
+  int y1 = rect.y + rect.height;
+  guint32 n = 0;
+  if (rect.y > 0){
+    n += scan_for_line(sparrow, fl, line, cvRect(0, 0, w, rect.y));
+  }
+  if (y1 < h){
+    n += scan_for_line(sparrow, fl, line, cvRect(0, y1, w, h - y1));
+  }
+  if (rect.x > 0){
+    n += scan_for_line(sparrow, fl, line, cvRect(0, rect.y, rect.x, rect.height));
+  }
+  if (x1 < w){
+    n += scan_for_line(sparrow, fl, line, cvRect(x1, rect.y, w - x1, rect.height));
+  }
+  return n;
+}
+
+/*Scan the predicted box if there is one, or the whole frame. If the box
+  turns out nearly empty the line is probably somewhere else, and the rest of
+  the frame is scanned too. (Not the box again: a second look would undo any
+  BAD_PIXEL marking.)
+
+  Pixels outside the box aren't looked at, so stray light there (a pixel that
+  is lit for more than one line) can't be marked BAD_PIXEL or moved to a
+  brighter line, as a whole frame scan would. Such pixels keep the first line
+  they were given -- usually in a whole frame scan, as the first lines in
+  each direction have no box -- and make_corners throws them out as outliers
+  from their clusters. */
+static void
+look_for_line(GstSparrow *sparrow, guint8 *in, sparrow_find_lines_t *fl,
+    sparrow_line_t *line){
+  CvRect rect;
+  fl->input->imageData = (char *)in;
+  if (LINE_USE_ROI && predict_line_rect(sparrow, fl, line, &rect)){
+    guint32 n = scan_for_line(sparrow, fl, line, rect);
+    if (n >= LINE_ROI_MIN_PIXELS){
+      return;
+    }
+    GST_DEBUG("line %d (dir %d) has only %u pixels in %dx%d+%d+%d; looking everywhere",
+        line->index, line->dir, n, rect.width, rect.height, rect.x, rect.y);
+    scan_around_rect(sparrow, fl, line, rect);
+    return;
+  }
+  scan_for_line(sparrow, fl, line, cvRect(0, 0, sparrow->in.width, sparrow->in.height));
 }
 
 static void
@@ -975,6 +927,14 @@ jump_state(GstSparrow *sparrow, sparrow_find_lines_t *fl, edges_state_t state){
   }
 }
 
+static inline void
+finish_lines(GstSparrow *sparrow, sparrow_find_lines_t *fl){
+  if (sparrow->serial){
+    g_static_mutex_unlock(&serial_mutex);
+  }
+  jump_state(sparrow, fl, EDGES_NEXT_STATE);
+}
+
 /* show each line for 2 frames, then wait sparrow->lag frames, leaving line on
    until last one.
  */
@@ -995,10 +955,312 @@ draw_lines(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in, guint8 *ou
     }
     fl->current++;
     if (fl->current == fl->n_lines){
-      if (sparrow->serial){
-        g_static_mutex_unlock(&serial_mutex);
+      finish_lines(sparrow, fl);
+    }
+    else{
+      sparrow->countdown = MAX(sparrow->lag, 1) + SAFETY_LAG;
+    }
+  }
+}
+
+/* Adaptive line timing. Rather than waiting out the countdown, every frame is
+   checked for the line in its predicted band, and the line is taken as soon
+   as the camera clearly sees it and has stopped seeing the line before. The
+   next line is drawn straight away, so each line costs about lag + 1 frames
+   instead of lag + SAFETY_LAG + 1. The countdown is left as a timeout, after
+   which the line is looked for just as draw_lines does. */
+
+static inline guint32
+subtract_pixel(guint32 a, guint32 b){
+  guint32 d = 0;
+  for (int s = 0; s < 32; s += 8){
+    int x = (int)((a >> s) & 255) - (int)((b >> s) & 255);
+    d |= (guint32)MAX(x, 0) << s;
+  }
+  return d;
+}
+
+/*how many pixels in rect are over the threshold, as counted by scan_for_line */
+static guint32
+count_line_signal(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in,
+    CvRect rect){
+  guint32 *in32 = (guint32 *)in;
+  guint32 *thresh32 = (guint32 *)fl->threshold->imageData;
+  guint32 cmask = sparrow->out.colours[sparrow->colour];
+  guint32 n = 0;
+  for (int y = rect.y; y < rect.y + rect.height; y++){
+    for (int x = rect.x; x < rect.x + rect.width; x++){
+      guint i = y * sparrow->in.width + x;
+      n += line_signal(fl, cmask, subtract_pixel(in32[i], thresh32[i])) != 0;
+    }
+  }
+  return n;
+}
+
+/*whether the camera has stopped seeing the pixels that were put in line */
+static gboolean
+line_has_gone(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in,
+    sparrow_line_t *line){
+  if (line == NULL || ! line->seen){
+    return TRUE;
+  }
+  guint32 *in32 = (guint32 *)in;
+  guint32 *thresh32 = (guint32 *)fl->threshold->imageData;
+  guint32 cmask = sparrow->out.colours[sparrow->colour];
+  guint32 total = 0;
+  guint32 lit = 0;
+  for (int y = line->y0; y <= line->y1; y++){
+    for (int x = line->x0; x <= line->x1; x++){
+      guint i = y * sparrow->in.width + x;
+      sparrow_intersect_t *p = &fl->map[i];
+      if (p->lines[line->dir] == line->index && p->signal[line->dir]){
+        total++;
+        lit += line_signal(fl, cmask, subtract_pixel(in32[i], thresh32[i])) != 0;
       }
-      jump_state(sparrow, fl, EDGES_NEXT_STATE);
+    }
+  }
+  return lit * LINE_GONE < total || total == 0;
+}
+
+static inline void
+draw_lines_adaptive(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in, guint8 *out)
+{
+  sparrow_line_t *line = fl->shuffled_lines[fl->current];
+  CvRect rect;
+  sparrow->countdown--;
+  if (! (LINE_USE_ROI && predict_line_rect(sparrow, fl, line, &rect))){
+    rect = cvRect(0, 0, sparrow->in.width, sparrow->in.height);
+  }
+  guint32 count = count_line_signal(sparrow, fl, in, rect);
+  /*while the last line is still there, some of the count may be its pixels,
+    so only counts made since it went are compared */
+  gboolean gone = line_has_gone(sparrow, fl, in, fl->last_line);
+  gboolean settled = (gone && fl->line_count >= LINE_MIN_PIXELS &&
+      count >= LINE_MIN_PIXELS &&
+      count <= fl->line_count + fl->line_count / LINE_SETTLED);
+  fl->line_count = gone ? count : 0;
+  if (sparrow->countdown == 0 || settled){
+    GST_DEBUG("line %d (dir %d): %d pixels after %d frames%s\n", line->index, line->dir,
+        count, MAX(sparrow->lag, 1) + SAFETY_LAG - sparrow->countdown,
+        sparrow->countdown ? "" : " (timed out)");
+    look_for_line(sparrow, in, fl, line);
+    if (sparrow->debug){
+      debug_map_image(sparrow, fl);
+    }
+    fl->last_line = line;
+    fl->line_count = 0;
+    fl->current++;
+    if (fl->current == fl->n_lines){
+      memset(out, 0, sparrow->out.size);
+      finish_lines(sparrow, fl);
+      return;
+    }
+    sparrow->countdown = MAX(sparrow->lag, 1) + SAFETY_LAG;
+    line = fl->shuffled_lines[fl->current];
+  }
+  memset(out, 0, sparrow->out.size);
+  draw_line(sparrow, line, out);
+}
+
+/* Gray code mode: rather than one line at a time, show stripes that number
+   the gaps between the lines. Gap c runs from line c - 1 up to line c, with
+   gap 0 before the first line, so line k is wherever the camera sees gap k
+   meet gap k + 1. Each pattern lights the gaps whose Gray coded number has
+   that pattern's bit set. Neighbouring gaps differ by one bit, so a pixel
+   straddling two of them is misread by at most one gap. The line's own row
+   is lit at half strength in the pattern with that bit, so the camera sees
+   the gaps meet in the middle of the line, as it would see the line itself,
+   rather than at its edge. */
+
+#define GRAY_INVALID 0xffff
+/*set on codes with a bit that was too near half way to trust */
+#define GRAY_UNSURE 0x8000
+
+static inline guint
+gray_gap(int pos, int offset){
+  return (pos < offset) ? 0 : (pos - offset) / LINE_PERIOD + 1;
+}
+
+static inline guint
+gray_bit(guint g, int bit){
+  return ((g ^ (g >> 1)) >> bit) & 1;
+}
+
+static inline guint32
+gray_colour(GstSparrow *sparrow, int pos, int offset, int bit){
+  guint32 colour = sparrow->out.colours[sparrow->colour];
+  guint g = gray_gap(pos, offset);
+  guint lit = gray_bit(g, bit);
+  if (pos >= offset && (pos - offset) % LINE_PERIOD == 0 &&
+      lit != gray_bit(g - 1, bit)){
+    return (colour >> 1) & 0x7f7f7f7f;
+  }
+  return lit ? colour : 0;
+}
+
+static void
+draw_gray_pattern(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *out){
+  guint32 *p = (guint32 *)out;
+  int w = sparrow->out.width;
+  int h = sparrow->out.height;
+  int bit = fl->gray_pattern - 2;
+  int x, y;
+  if (bit < 0){
+    guint32 colour = (bit == -2) ? sparrow->out.colours[sparrow->colour] : 0;
+    for (x = 0; x < w * h; x++){
+      p[x] = colour;
+    }
+  }
+  else if (bit < fl->gray_bits[SPARROW_HORIZONTAL]){
+    for (y = 0; y < h; y++){
+      guint32 colour = gray_colour(sparrow, y, H_LINE_OFFSET, bit);
+      for (x = 0; x < w; x++){
+        p[y * w + x] = colour;
+      }
+    }
+  }
+  else {
+    bit -= fl->gray_bits[SPARROW_HORIZONTAL];
+    for (x = 0; x < w; x++){
+      p[x] = gray_colour(sparrow, x, V_LINE_OFFSET, bit);
+    }
+    for (y = 1; y < h; y++){
+      memcpy(p + y * w, p, w * PIXSIZE);
+    }
+  }
+}
+
+static void
+read_gray_pattern(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in){
+  guint32 *in32 = (guint32 *)in;
+  guint32 cmask = sparrow->out.colours[sparrow->colour];
+  int bit = fl->gray_pattern - 2;
+  guint i;
+  if (bit < 0){
+    guint8 *level = (bit == -2) ? fl->gray_on : fl->gray_off;
+    for (i = 0; i < sparrow->in.pixcount; i++){
+      level[i] = line_signal(fl, cmask, in32[i]);
+    }
+    return;
+  }
+  sparrow_axis_t dir = SPARROW_HORIZONTAL;
+  if (bit >= fl->gray_bits[dir]){
+    bit -= fl->gray_bits[dir];
+    dir = SPARROW_VERTICAL;
+  }
+  guint16 *codes = fl->gray_codes[dir];
+  for (i = 0; i < sparrow->in.pixcount; i++){
+    int s = line_signal(fl, cmask, in32[i]);
+    int centred = 2 * s - fl->gray_on[i] - fl->gray_off[i];
+    if (centred > 0){
+      codes[i] |= 1 << bit;
+    }
+    if (2 * abs(centred) < fl->gray_on[i] - fl->gray_off[i]){
+      codes[i] |= GRAY_UNSURE;
+    }
+  }
+}
+
+/*put a pixel in a line, unless it is already in another, which is bad */
+static inline void
+mark_gray_line(sparrow_intersect_t *p, sparrow_axis_t dir, int line, int signal){
+  if (p->lines[dir] == BAD_PIXEL){
+    return;
+  }
+  if (p->signal[dir] == 0){
+    p->lines[dir] = line;
+    p->signal[dir] = signal;
+  }
+  else if (p->lines[dir] != line){
+    p->lines[dir] = BAD_PIXEL;
+    p->signal[dir] = 0;
+  }
+}
+
+/*turn each pixel's code into a gap number, and put the pixels on either side
+  of each change of gap into the line between them. A pixel that couldn't
+  tell, where the camera sees the half lit line, is in the line too if the
+  pixels either side of it are in neighbouring gaps. */
+static void
+decode_gray_codes(GstSparrow *sparrow, sparrow_find_lines_t *fl){
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  guint8 *on = fl->gray_on;
+  guint8 *off = fl->gray_off;
+  int x, y;
+  guint i;
+  for (int dir = 0; dir < 2; dir++){
+    guint16 *codes = fl->gray_codes[dir];
+    guint n_lines = lines_in_direction(fl, dir);
+    for (i = 0; i < sparrow->in.pixcount; i++){
+      guint g = codes[i];
+      if (on[i] < off[i] + GRAY_MIN_CONTRAST){
+        codes[i] = GRAY_INVALID;
+        continue;
+      }
+      if (g & GRAY_UNSURE){
+        codes[i] = GRAY_UNSURE;
+        continue;
+      }
+      g ^= g >> 1;
+      g ^= g >> 2;
+      g ^= g >> 4;
+      g ^= g >> 8;
+      codes[i] = g;
+    }
+    for (y = 0; y < h; y++){
+      for (x = 0; x < w; x++){
+        i = y * w + x;
+        guint c = codes[i];
+        if (c >= GRAY_UNSURE){
+          continue;
+        }
+        guint steps[2] = {1, w};
+        int room[2] = {w - 1 - x, h - 1 - y};
+        for (int k = 0; k < 2; k++){
+          if (room[k] < 1){
+            continue;
+          }
+          guint mid = i + steps[k];
+          guint j = mid;
+          if (codes[mid] == GRAY_UNSURE && room[k] >= 2){
+            j += steps[k];
+          }
+          guint cj = codes[j];
+          if (cj >= GRAY_UNSURE || (cj != c + 1 && c != cj + 1)){
+            continue;
+          }
+          guint line = MIN(c, cj);
+          if (line < n_lines){
+            int signal = MAX(MIN(on[i] - off[i], on[j] - off[j]), 1);
+            mark_gray_line(&fl->map[i], dir, line, signal);
+            if (mid != j){
+              mark_gray_line(&fl->map[mid], dir, line, signal);
+            }
+            mark_gray_line(&fl->map[j], dir, line, signal);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* show each pattern for lag + SAFETY_LAG frames, reading it on the last */
+static inline void
+draw_gray_codes(GstSparrow *sparrow, sparrow_find_lines_t *fl, guint8 *in, guint8 *out)
+{
+  sparrow->countdown--;
+  draw_gray_pattern(sparrow, fl, out);
+  if (sparrow->countdown == 0){
+    read_gray_pattern(sparrow, fl, in);
+    fl->gray_pattern++;
+    if (fl->gray_pattern == 2 + fl->gray_bits[SPARROW_HORIZONTAL] +
+        fl->gray_bits[SPARROW_VERTICAL]){
+      decode_gray_codes(sparrow, fl);
+      if (sparrow->debug){
+        debug_map_image(sparrow, fl);
+      }
+      finish_lines(sparrow, fl);
     }
     else{
       sparrow->countdown = MAX(sparrow->lag, 1) + SAFETY_LAG;
@@ -1089,7 +1351,15 @@ mode_find_edges(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
     wait_for_lines_lock(sparrow, fl, out);
     break;
   case EDGES_FIND_LINES:
-    draw_lines(sparrow, fl, in, out);
+    if (sparrow->gray_code){
+      draw_gray_codes(sparrow, fl, in, out);
+    }
+    else if (sparrow->adaptive_lines){
+      draw_lines_adaptive(sparrow, fl, in, out);
+    }
+    else {
+      draw_lines(sparrow, fl, in, out);
+    }
     break;
   case EDGES_FIND_CORNERS:
     memset(out, 0, sparrow->out.size);
@@ -1112,9 +1382,10 @@ INVISIBLE void
 finalise_find_edges(GstSparrow *sparrow){
   sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
   //DEBUG_FIND_LINES(fl);
-  if (sparrow->save && *(sparrow->save)){
+  /*a reloaded lut came without the map and mesh it was made from */
+  if (sparrow->save && *(sparrow->save) && sparrow->reloaded != SPARROW_RELOAD_LUT){
     GST_DEBUG("about to save to %s\n", sparrow->save);
-    dump_edges_info(sparrow, fl, sparrow->save);
+    save_calibration(sparrow, fl, sparrow->save);
   }
   if (sparrow->debug){
     cvReleaseImage(&fl->debug);
@@ -1125,6 +1396,11 @@ finalise_find_edges(GstSparrow *sparrow){
   free(fl->mesh_mem);
   free(fl->clusters);
   free(fl->dither);
+  free(fl->dither_tile);
+  free(fl->gray_on);
+  free(fl->gray_off);
+  free(fl->gray_codes[SPARROW_HORIZONTAL]);
+  free(fl->gray_codes[SPARROW_VERTICAL]);
   cvReleaseImage(&fl->threshold);
   cvReleaseImage(&fl->working);
   cvReleaseImageHeader(&fl->input);
@@ -1164,8 +1440,13 @@ init_find_edges(GstSparrow *sparrow){
   gint n_corners = (h_lines * v_lines);
 
   /*set up dither here, rather than in the busy time */
+#if USE_FIXED_POINT_LUT
+  fl->dither_tile = malloc_aligned_or_die(DITHER_TILE_PIXELS);
+  make_blue_noise_tile(sparrow, fl->dither_tile);
+#else
   fl->dither = malloc_aligned_or_die(sparrow->out.pixcount * sizeof(double));
   dsfmt_fill_array_close_open(sparrow->dsfmt, fl->dither, sparrow->out.pixcount);
+#endif
 
   fl->n_hlines = h_lines;
   fl->n_vlines = v_lines;
@@ -1177,9 +1458,8 @@ init_find_edges(GstSparrow *sparrow){
   GST_DEBUG("map is going to be %d * %d \n", sizeof(sparrow_intersect_t), sparrow->in.pixcount);
   fl->map = zalloc_aligned_or_die(sizeof(sparrow_intersect_t) * sparrow->in.pixcount);
   fl->clusters = zalloc_or_die(n_corners * sizeof(sparrow_cluster_t));
-  fl->mesh_mem = zalloc_aligned_or_die(n_corners * sizeof(sparrow_corner_t) * 2);
+  fl->mesh_mem = zalloc_aligned_or_die(n_corners * sizeof(sparrow_corner_t));
   fl->mesh = fl->mesh_mem;
-  fl->mesh_next = fl->mesh + n_corners;
 
   sparrow_line_t *line = fl->h_lines;
   sparrow_line_t **sline = fl->shuffled_lines;
@@ -1190,6 +1470,7 @@ init_find_edges(GstSparrow *sparrow){
     line->offset = offset;
     line->dir = SPARROW_HORIZONTAL;
     line->index = i;
+    line->seen = FALSE;
     *sline = line;
     line++;
     sline++;
@@ -1203,6 +1484,7 @@ init_find_edges(GstSparrow *sparrow){
     line->offset = offset;
     line->dir = SPARROW_VERTICAL;
     line->index = i;
+    line->seen = FALSE;
     *sline = line;
     line++;
     sline++;
@@ -1222,6 +1504,21 @@ init_find_edges(GstSparrow *sparrow){
 
   setup_colour_shifts(sparrow, fl);
 
+  if (sparrow->gray_code){
+    /*enough bits to number the gaps, of which there is one more than lines */
+    for (int dir = 0; dir < 2; dir++){
+      int n = lines_in_direction(fl, dir);
+      while ((1 << fl->gray_bits[dir]) <= n){
+        fl->gray_bits[dir]++;
+      }
+      fl->gray_codes[dir] = zalloc_aligned_or_die(sparrow->in.pixcount * sizeof(guint16));
+    }
+    fl->gray_on = malloc_aligned_or_die(sparrow->in.pixcount);
+    fl->gray_off = malloc_aligned_or_die(sparrow->in.pixcount);
+    GST_DEBUG("gray code: %d + %d bits\n", fl->gray_bits[SPARROW_HORIZONTAL],
+        fl->gray_bits[SPARROW_VERTICAL]);
+  }
+
   /* opencv images for threshold finding */
   CvSize size = {sparrow->in.width, sparrow->in.height};
   fl->working = cvCreateImage(size, IPL_DEPTH_8U, PIXSIZE);
@@ -1234,7 +1531,10 @@ init_find_edges(GstSparrow *sparrow){
     fl->debug = cvCreateImage(size, IPL_DEPTH_8U, PIXSIZE);
   }
 
-  if (sparrow->reload){
+  global_number_of_edge_finders++;
+
+  switch (sparrow->reloaded){
+  case SPARROW_RELOAD_EDGES:
     if (access(sparrow->reload, R_OK)){
       GST_DEBUG("sparrow->reload is '%s' and it is UNREADABLE\n", sparrow->reload);
       exit(1);
@@ -1244,11 +1544,13 @@ init_find_edges(GstSparrow *sparrow){
     //memset(fl->clusters, 0, n_corners * sizeof(sparrow_cluster_t));
     memset(fl->mesh, 0, n_corners * sizeof(sparrow_corner_t));
     jump_state(sparrow, fl, EDGES_FIND_CORNERS);
-  }
-  else {
+    break;
+  case SPARROW_RELOAD_LUT:
+    /*nothing to find, but wait for the others */
+    jump_state(sparrow, fl, EDGES_WAIT_FOR_PLAY);
+    break;
+  default:
     jump_state(sparrow, fl, EDGES_FIND_NOISE);
   }
-
-  global_number_of_edge_finders++;
 }
 
@@ -12,6 +12,25 @@
 
 #define BAD_PIXEL 0xffff
 
+/*look for each line only between the nearest lines either side of it that
+  have already been seen (plus LINE_ROI_MARGIN pixels), rather than in the
+  whole frame, unless fewer than LINE_ROI_MIN_PIXELS turn up there. */
+#define LINE_USE_ROI 1
+#define LINE_ROI_MARGIN 8
+#define LINE_ROI_MIN_PIXELS 16
+
+/*in gray-code mode, pixels that differ by less than this between the all on
+  and all off patterns are ignored */
+#define GRAY_MIN_CONTRAST 32
+
+/*in adaptive-lines mode, a line has gone when fewer than 1/LINE_GONE of its
+  pixels still see it, and the next line has appeared when, in two frames
+  since then, at least this many pixels see it and the count has stopped
+  growing by more than 1/LINE_SETTLED */
+#define LINE_MIN_PIXELS 32
+#define LINE_SETTLED 8
+#define LINE_GONE 4
+
 #define FL_DUMPFILE "/tmp/edges.dump"
 
 #define COLOUR_QUANT  1
@@ -32,6 +51,15 @@
 */
 #define MAX_NONCOLLINEARITY 0.02
 
+/*complete_map only re-estimates corners whose estimators have changed,
+  rather than passing over the whole mesh each time (complete_map.h) */
+#define USE_WORKLIST_SOLVER 1
+
+/*corners_to_full_lut interpolates in fixed point and dithers with a small
+  blue noise tile, rather than in floats with a double for every output
+  pixel (full_lut.h). Fixed point coords need this. */
+#define USE_FIXED_POINT_LUT 1
+
 typedef enum corner_status {
   CORNER_UNUSED,
   CORNER_PROJECTED,
@@ -73,9 +101,18 @@ typedef struct sparrow_estimator_s {
   int y2;
   int x3;
   int y3;
+  /*the same corners, as offsets into the mesh */
+  int d1;
+  int d2;
+  int d3;
   //int mul; /* estimate: x1,y1 + mul * diff */
 } sparrow_estimator_t;
 
+typedef struct sparrow_offset_s {
+  int x;
+  int y;
+} sparrow_offset_t;
+
 typedef struct sparrow_corner_s {
   coord_t x;
   coord_t y;
@@ -105,6 +142,24 @@ typedef struct sparrow_cluster_s {
 } sparrow_cluster_t;
 
 
+/*make_clusters reads the map in this many chunks of camera rows, spread over
+  the worker bands. Each chunk lists its votes, and they are added to the
+  clusters chunk by chunk, so the clusters don't depend on the number of
+  threads. */
+#define CLUSTER_CHUNKS 64
+
+typedef struct cluster_vote_s {
+  guint32 cluster;
+  sparrow_voter_t voter;
+} cluster_vote_t;
+
+typedef struct cluster_chunk_s {
+  cluster_vote_t *votes;
+  guint32 n;
+  guint32 size;
+  guint32 bad_pixels;
+} cluster_chunk_t;
+
 typedef union sparrow_signal_s {
   guint16 v_signal;
   guint16 h_signal;
@@ -120,6 +175,12 @@ typedef struct sparrow_line_s {
   gint offset;
   sparrow_axis_t dir;
   gint index;
+  /*where the camera saw it: the bounding box of its pixels, if seen */
+  gboolean seen;
+  gint x0;
+  gint y0;
+  gint x1;
+  gint y1;
 } sparrow_line_t;
 
 /*condensed version of <struct sparrow_find_lines_s> for saving: contains no
@@ -143,14 +204,25 @@ typedef struct sparrow_find_lines_s {
   sparrow_intersect_t *map;
   sparrow_corner_t *mesh_mem;
   sparrow_corner_t *mesh;
-  sparrow_corner_t *mesh_next;
   sparrow_cluster_t *clusters;
   double *dither;
+  guint8 *dither_tile;
   IplImage *debug;
   IplImage *threshold;
   IplImage *working;
   IplImage *input;
   edges_state_t state;
+  /*gray-code mode: pattern 0 is all on, 1 all off, then the bits of the
+    horizontal, then the vertical, line codes */
+  int gray_pattern;
+  int gray_bits[2];
+  guint8 *gray_on;
+  guint8 *gray_off;
+  guint16 *gray_codes[2];
+  /*adaptive-lines mode: the last frame's count for the current line (0 until
+    the line before it has gone), and that line before */
+  guint32 line_count;
+  sparrow_line_t *last_line;
 } sparrow_find_lines_t;
 
 
@@ -194,6 +266,73 @@ typedef struct sparrow_find_lines_s {
   (fl)->input,                                    \
   (fl)->state                                     \
 )
+/*coordinate conversions, for edges.c and complete_map.h */
+#if USE_FLOAT_COORDS
+
+#define COORD_TO_INT(x)((int)((x) + 0.5))
+#define COORD_TO_FLOAT(x)((double)(x))
+#define INT_TO_COORD(x)((coord_t)(x))
+
+static inline int
+coord_to_int_clamp(coord_t x, const int max_plus_one){
+  if (x < 0)
+    return 0;
+  if (x >= max_plus_one - 1.5)
+    return max_plus_one - 1;
+  return (int)(x + 0.5);
+}
+
+static inline int
+coord_to_int_clamp_dither(const double *dither, coord_t x,
+    const int max_plus_one, const int i){
+  if (x < 0)
+    return 0;
+  x += dither[i];
+  if (x >= max_plus_one)
+    return max_plus_one - 1;
+  return (int)x;
+}
+
+
+static inline int
+coord_in_range(coord_t x, const int max_plus_one){
+  return x >= 0 && (x + 0.5 < max_plus_one);
+}
+
+#else
+
+#define COORD_TO_INT(x)((x) / (1 << SPARROW_FIXED_POINT))
+#define COORD_TO_FLOAT(x)(((double)(x)) / (1 << SPARROW_FIXED_POINT))
+#define INT_TO_COORD(x)((x) * (1 << SPARROW_FIXED_POINT))
+
+static inline int
+coord_to_int_clamp(coord_t x, const int max_plus_one){
+  if (x < 0)
+    return 0;
+  x >>= SPARROW_FIXED_POINT;
+  if (x >= max_plus_one)
+    return max_plus_one - 1;
+  return x;
+}
+
+static inline int
+coord_in_range(coord_t x, const int max_plus_one){
+  return x >= 0 && (x < max_plus_one << SPARROW_FIXED_POINT);
+}
+
+#endif
+
+//these ones are common
+static inline int
+coords_to_index(coord_t x, coord_t y, int w, int h){
+  int iy = coord_to_int_clamp(y, h);
+  int ix = coord_to_int_clamp(x, w);
+  return iy * w + ix;
+}
+
+#define C2I COORD_TO_INT
+#define C2F COORD_TO_FLOAT
+
 //#undef debug_find_lines
 //#define debug_find_lines(x) /* */
 
@@ -0,0 +1,242 @@
+#ifndef __SPARROW_FIND_LAG_H__
+#define __SPARROW_FIND_LAG_H__
+/* Lag search kernels for find_lag (calibrate.c), also used by test-find-lag.c.
+
+   Each kernel finds, for n records, the shift (0 to MAX_CALIBRATION_LAG - 1)
+   with the fewest differences from the target pattern, and that number of
+   differences. Ties go to the smaller shift.
+
+   Shifting the record left by j under a mask shifted left by j counts the
+   same bits as comparing the unshifted record with the target shifted right
+   by j, under the unshifted mask, so the vector kernels take an array of
+   pre-shifted targets and use a constant mask.  The scalar one is the
+   original loop.
+*/
+
+#include "sparrow.h"
+#include "calibrate.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FIND_LAG_HAVE_X86 1
+#include <immintrin.h>
+#else
+#define FIND_LAG_HAVE_X86 0
+#endif
+
+#if defined(HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#define LAG_MASK (((guint64)-1) >> MAX_CALIBRATION_LAG)
+
+static inline void
+init_lag_targets(guint64 *targets, guint64 pattern){
+  for (int j = 0; j < MAX_CALIBRATION_LAG; j++){
+    targets[j] = pattern >> j;
+  }
+}
+
+static UNUSED void
+lag_search_scalar(const lag_times_t *records, int n,
+    const guint64 *targets, guint8 *lags, guint8 *errors){
+  guint64 target_pattern = targets[0];
+  for (int i = 0; i < n; i++){
+    guint64 record = records[i].record;
+    guint64 mask = LAG_MASK;
+    guint32 best = hamming_distance64(record, target_pattern, mask);
+    guint32 lag = 0;
+    for (int j = 1; j < MAX_CALIBRATION_LAG; j++){
+      /*latest frame is least significant bit
+        >> pushes into future,
+        << pushes into past
+        record is presumed to be a few frames past
+        relative to main record, so we push it back.
+      */
+      record <<= 1;
+      mask <<= 1;
+      guint32 d = hamming_distance64(record, target_pattern, mask);
+      if (d < best){
+        best = d;
+        lag = j;
+      }
+    }
+    lags[i] = lag;
+    errors[i] = best;
+  }
+}
+
+#if FIND_LAG_HAVE_X86
+static UNUSED void __attribute__((target("popcnt")))
+lag_search_popcnt(const lag_times_t *records, int n,
+    const guint64 *targets, guint8 *lags, guint8 *errors){
+  for (int i = 0; i < n; i++){
+    guint64 record = records[i].record;
+    guint32 best = __builtin_popcountll((record ^ targets[0]) & LAG_MASK);
+    guint32 lag = 0;
+    for (int j = 1; j < MAX_CALIBRATION_LAG; j++){
+      guint32 d = __builtin_popcountll((record ^ targets[j]) & LAG_MASK);
+      if (d < best){
+        best = d;
+        lag = j;
+      }
+    }
+    lags[i] = lag;
+    errors[i] = best;
+  }
+}
+
+/*8 records at a time. Bytes are counted with a nibble lookup (pshufb), then
+  psadbw adds up the 8 bytes of each record. The two sets of 4 counts are
+  interleaved into 32 bit lanes as (count << 4 | shift), so a single unsigned
+  min keeps the best count and its shift, preferring the smaller shift. */
+/*the shift has to fit in the low nibble (this fails to compile otherwise) */
+typedef char lag_shift_fits_in_a_nibble[(MAX_CALIBRATION_LAG <= 16) ? 1 : -1];
+
+static inline __m256i __attribute__((target("avx2")))
+lag_popcount_avx2(__m256i x){
+  const __m256i nibble_counts = _mm256_setr_epi8(
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(x, low_nibbles);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibbles);
+  __m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, lo),
+      _mm256_shuffle_epi8(nibble_counts, hi));
+  return _mm256_sad_epu8(c, _mm256_setzero_si256());
+}
+
+static UNUSED void __attribute__((target("avx2")))
+lag_search_avx2(const lag_times_t *records, int n,
+    const guint64 *targets, guint8 *lags, guint8 *errors){
+  const __m256i mask = _mm256_set1_epi64x(LAG_MASK);
+  __m256i t[MAX_CALIBRATION_LAG];
+  for (int j = 0; j < MAX_CALIBRATION_LAG; j++){
+    t[j] = _mm256_set1_epi64x(targets[j]);
+  }
+  int i;
+  for (i = 0; i + 8 <= n; i += 8){
+    __m256i r1 = _mm256_loadu_si256((const __m256i *)(records + i));
+    __m256i r2 = _mm256_loadu_si256((const __m256i *)(records + i + 4));
+    __m256i best = _mm256_set1_epi32(-1);
+    for (int j = 0; j < MAX_CALIBRATION_LAG; j++){
+      __m256i d1 = lag_popcount_avx2(_mm256_and_si256(_mm256_xor_si256(r1, t[j]), mask));
+      __m256i d2 = lag_popcount_avx2(_mm256_and_si256(_mm256_xor_si256(r2, t[j]), mask));
+      __m256i d = _mm256_or_si256(d1, _mm256_slli_epi64(d2, 32));
+      d = _mm256_or_si256(_mm256_slli_epi32(d, 4), _mm256_set1_epi32(j));
+      best = _mm256_min_epu32(best, d);
+    }
+    guint32 b[8];
+    _mm256_storeu_si256((__m256i *)b, best);
+    for (int k = 0; k < 4; k++){
+      lags[i + k] = b[2 * k] & 15;
+      errors[i + k] = b[2 * k] >> 4;
+      lags[i + 4 + k] = b[2 * k + 1] & 15;
+      errors[i + 4 + k] = b[2 * k + 1] >> 4;
+    }
+  }
+  if (i < n){
+    lag_search_popcnt(records + i, n - i, targets, lags + i, errors + i);
+  }
+}
+#endif
+
+/*The signal is recorded in LAG_PLANES bit-planes, one per frame, with bit k
+  of word w being pixel 64 * w + k. rows[t] is a word from the plane t frames
+  ago. In place, this turns them into the 64 pixels' records, with bit t of
+  rows[k] being pixel k, t frames ago -- the layout the kernels want. */
+static inline void
+transpose_lag_rows(guint64 *rows){
+  /*swap the off-diagonal j x j blocks, for j = 32, 16, ... 1 */
+  guint64 m = 0x00000000ffffffffULL;
+  for (int j = 32; j; j >>= 1, m ^= m << j){
+    for (int k = 0; k < 64; k = ((k | j) + 1) & ~j){
+      guint64 t = ((rows[k] >> j) ^ rows[k | j]) & m;
+      rows[k] ^= t << j;
+      rows[k | j] ^= t;
+    }
+  }
+}
+
+/*bit k of the result is set if pixel k's channel at shift is over threshold */
+static inline guint64
+threshold_word_scalar(const guint32 *pixels, int n, guint32 shift, guint32 threshold){
+  guint64 word = 0;
+  for (int k = 0; k < n; k++){
+    word |= (guint64)(((pixels[k] >> shift) & 255) > threshold) << k;
+  }
+  return word;
+}
+
+#if defined(HAVE_SSE2)
+/*64 pixels: the channel bytes of 16 pixels are packed into one register and
+  compared (unsigned, via max) with threshold + 1, then movemask makes 16 bits */
+static inline guint64
+threshold_word_sse2(const guint32 *pixels, guint32 shift, guint32 threshold){
+  const __m128i lowbyte = _mm_set1_epi32(0xff);
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  const __m128i limit = _mm_set1_epi8((char)(threshold + 1));
+  const __m128i *p = (const __m128i *)pixels;
+  guint64 word = 0;
+  for (int k = 0; k < 4; k++){
+    __m128i a = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p), count), lowbyte);
+    __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 1), count), lowbyte);
+    __m128i c = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 2), count), lowbyte);
+    __m128i d = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 3), count), lowbyte);
+    __m128i x = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    __m128i over = _mm_cmpeq_epi8(_mm_max_epu8(x, limit), x);
+    word |= (guint64)(guint16)_mm_movemask_epi8(over) << (k * 16);
+    p += 4;
+  }
+  return word;
+}
+#endif
+
+/*threshold word w of a frame of n pixels */
+static inline guint64
+threshold_word(const guint32 *pixels, guint32 n, guint32 w,
+    guint32 shift, guint32 threshold){
+  guint32 i = w * 64;
+  if (i + 64 > n){
+    return threshold_word_scalar(pixels + i, n - i, shift, threshold);
+  }
+#if defined(HAVE_SSE2)
+  return threshold_word_sse2(pixels + i, shift, threshold);
+#else
+  return threshold_word_scalar(pixels + i, 64, shift, threshold);
+#endif
+}
+
+/*threshold a frame into a plane of (n + 63) / 64 words */
+static inline UNUSED void
+threshold_plane(guint64 *plane, const guint32 *pixels, guint32 n,
+    guint32 shift, guint32 threshold){
+  guint32 w;
+  guint32 words = (n + 63) / 64;
+  for (w = 0; w < words; w++){
+    plane[w] = threshold_word(pixels, n, w, shift, threshold);
+  }
+}
+
+/*the quickest kernel this CPU can run */
+static inline UNUSED lag_search_func
+choose_lag_search(void){
+#if FIND_LAG_HAVE_X86
+  __builtin_cpu_init();
+#if defined(__AVX512BW__)
+  /*built for AVX-512 (-march=native), gcc vectorises the popcnt loop itself,
+    and that beats the AVX2 kernel */
+  if (__builtin_cpu_supports("popcnt")){
+    return lag_search_popcnt;
+  }
+#endif
+  if (__builtin_cpu_supports("avx2")){
+    return lag_search_avx2;
+  }
+  if (__builtin_cpu_supports("popcnt")){
+    return lag_search_popcnt;
+  }
+#endif
+  return lag_search_scalar;
+}
+
+#endif
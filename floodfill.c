@@ -18,130 +18,164 @@
 
 #include "sparrow.h"
 #include "gstsparrow.h"
+#include "bitmask.h"
 
 #include <string.h>
 #include <math.h>
 
-#define STUPID_DEBUG_TRICK 0
+#if defined(HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 #define WAIT_TIME CALIBRATE_MAX_T + 5
 
 typedef struct sparrow_find_screen_s {
-  IplImage *green;
-  IplImage *working;
-  IplImage *mask;
-  IplImage *im;
+  sparrow_bitmask_t edges;
+  sparrow_bitmask_t working;
+  sparrow_bitmask_t region;
+  sparrow_bitmask_t fill;
+  guint8 *debug;
   gboolean waiting;
-  IplImage *signal;
+  guint8 *signal_planes[2];
+  int signal_plane;
+  guint32 signal_width;
+  guint32 signal_height;
+  guint32 signal_valid_rows;
 } sparrow_find_screen_t;
 
 
-/* Floodfill for find screen */
-static inline void
-expand_one_mono(int x, int y, int c,
-    CvPoint *nexts, int *n_nexts, guint8 *im, guint8 *mask, int w, int h){
-  guint8 p = im[y * w + x];
-  guint8 *m = &mask[y * w + x];
-  if (*m && (p == c)){
-    *m = 0;
-    nexts[*n_nexts].x = x;
-    nexts[*n_nexts].y = y;
-    (*n_nexts)++;
-  }
-}
+/*Edges for find_screen: pixels where the green channel's 3x3 Sobel gradient
+  (|dx| + |dy|, as cvCanny measures it) is over SCREEN_EDGE_THRESHOLD. This
+  replaces cvCanny(green, mask, 100, 170, 3), without the thinning and
+  hysteresis, which the dilation that follows would mostly undo anyway. */
+#define SCREEN_EDGE_THRESHOLD 100
 
-/*
-  im: the image to be analysed
-  mim: the mask image to be written
-  start: a point of the right colour.
-*/
-
-static IplImage*
-floodfill_mono_superfast(IplImage *im, IplImage *mim, CvPoint start)
-{
-  guint8 * data = (guint8 *)im->imageData;
-  guint8 * mdata = (guint8 *)mim->imageData;
-  int w = im->width;
-  int h = im->height;
-  int n_starts;
-  int n_nexts = 0;
-  CvPoint *starts;
-  CvPoint *nexts;
-
-  //malloc 2 lists of points. These *could* be as large as the image (but never should be)
-  void * mem = malloc_or_die(w * h * 2 * sizeof(CvPoint));
-  starts = mem;
-  nexts = starts + w * h;
-  n_starts = 1;
-  starts[0] = start;
-
-  while(n_starts){
-    n_nexts = 0;
-    int i;
-    for (i = 0; i < n_starts; i++){
-      int x = starts[i].x;
-      int y = starts[i].y;
-      int c = data[y * w + x];
-      if (x > 0){
-        expand_one_mono(x - 1, y, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (x < w - 1){
-        expand_one_mono(x + 1, y, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (y > 0){
-        expand_one_mono(x, y - 1, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (y < h - 1){
-        expand_one_mono(x, y + 1, c, nexts, &n_nexts, data, mdata, w, h);
+#define GREEN(p, x) ((int)(((p)[x] >> gshift) & 255))
+
+static void
+find_screen_edges(GstSparrow *sparrow, sparrow_bitmask_t *edges, guint8 *in){
+  guint32 *in32 = (guint32 *)in;
+  guint32 gshift = sparrow->in.gshift;
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  memset(edges->bits, 0, edges->row_words * h * sizeof(guint64));
+  for (int y = 1; y < h - 1; y++){
+    const guint32 *a = in32 + (y - 1) * w;
+    const guint32 *b = a + w;
+    const guint32 *c = b + w;
+    guint64 *row = bitmask_row(edges, y);
+    for (int x = 1; x < w - 1; x++){
+      int dx = (GREEN(a, x + 1) + 2 * GREEN(b, x + 1) + GREEN(c, x + 1) -
+          GREEN(a, x - 1) - 2 * GREEN(b, x - 1) - GREEN(c, x - 1));
+      int dy = (GREEN(c, x - 1) + 2 * GREEN(c, x) + GREEN(c, x + 1) -
+          GREEN(a, x - 1) - 2 * GREEN(a, x) - GREEN(a, x + 1));
+      if (abs(dx) + abs(dy) > SCREEN_EDGE_THRESHOLD){
+        row[x / 64] |= 1ULL << (x & 63);
       }
     }
-    CvPoint *tmp = starts;
-    starts = nexts;
-    nexts = tmp;
-    n_starts = n_nexts;
   }
-  free(mem);
-  return im;
 }
 
-static inline IplImage *
-extract_green_channel(GstSparrow *sparrow, sparrow_find_screen_t *finder, guint8 *in)
-{
-  IplImage *im = finder->im;
-  IplImage *green = finder->green;
-  im->imageData = (char*)in;
-  guint32 gshift = sparrow->in.gshift;
-  GST_DEBUG("gshift is %d, green is %p, data is %p, im data is %p",
-      gshift, green, green->imageData, im->imageData);
-  cvSplit(im,
-      (gshift == 24) ? green : NULL,
-      (gshift == 16) ? green : NULL,
-      (gshift ==  8) ? green : NULL,
-      (gshift ==  0) ? green : NULL);
-  GST_DEBUG("returning green %p, data %p",
-      green, green->imageData);
-  return green;
+#undef GREEN
+
+static void
+debug_bitmask(GstSparrow *sparrow, sparrow_find_screen_t *finder, sparrow_bitmask_t *m){
+  if (sparrow->debug){
+    bitmask_to_bytes(m, finder->debug);
+    debug_frame(sparrow, finder->debug, m->width, m->height, 1);
+  }
 }
 
 
 #define SIGNAL_THRESHOLD 100
-/*see whether there seems to be activity:  */
+/*check_for_signal looks at every SIGNAL_SUBSAMPLE'th pixel of every
+  SIGNAL_SUBSAMPLE'th row. 1, 2, or 4. */
+#define SIGNAL_SUBSAMPLE 2
+
+#if defined(HAVE_SSE2)
+/*4 pixels, SIGNAL_SUBSAMPLE apart */
+static inline __m128i
+signal_load4(const guint32 *p){
+#if SIGNAL_SUBSAMPLE == 1
+  return _mm_loadu_si128((const __m128i *)p);
+#elif SIGNAL_SUBSAMPLE == 2
+  __m128 a = _mm_loadu_ps((const float *)p);
+  __m128 b = _mm_loadu_ps((const float *)(p + 4));
+  return _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+#else
+  return _mm_setr_epi32(p[0], p[SIGNAL_SUBSAMPLE], p[2 * SIGNAL_SUBSAMPLE],
+      p[3 * SIGNAL_SUBSAMPLE]);
+#endif
+}
+#endif
+
+/*extract n green bytes from a row into next. If there is a prev, return TRUE
+  if any of them differ from it by more than SIGNAL_THRESHOLD. */
+static inline gboolean
+signal_row(const guint32 *in, guint8 *next, const guint8 *prev, guint32 n,
+    guint32 gshift){
+  gboolean changed = FALSE;
+  guint32 x = 0;
+#if defined(HAVE_SSE2)
+  const __m128i lowbyte = _mm_set1_epi32(0xff);
+  const __m128i count = _mm_cvtsi32_si128(gshift);
+  const __m128i threshold = _mm_set1_epi8(SIGNAL_THRESHOLD);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i over = zero;
+  for (; x + 16 <= n; x += 16){
+    const guint32 *p = in + x * SIGNAL_SUBSAMPLE;
+    __m128i a = _mm_and_si128(_mm_srl_epi32(signal_load4(p), count), lowbyte);
+    __m128i b = _mm_and_si128(_mm_srl_epi32(signal_load4(p + 4 * SIGNAL_SUBSAMPLE),
+            count), lowbyte);
+    __m128i c = _mm_and_si128(_mm_srl_epi32(signal_load4(p + 8 * SIGNAL_SUBSAMPLE),
+            count), lowbyte);
+    __m128i d = _mm_and_si128(_mm_srl_epi32(signal_load4(p + 12 * SIGNAL_SUBSAMPLE),
+            count), lowbyte);
+    __m128i g = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128((__m128i *)(next + x), g);
+    if (prev){
+      /*|g - q| > threshold, unsigned, is (|g - q| -sat threshold) != 0 */
+      __m128i q = _mm_loadu_si128((const __m128i *)(prev + x));
+      __m128i diff = _mm_or_si128(_mm_subs_epu8(g, q), _mm_subs_epu8(q, g));
+      over = _mm_or_si128(over, _mm_subs_epu8(diff, threshold));
+    }
+  }
+  changed = (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xffff);
+#endif
+  for (; x < n; x++){
+    int g = (in[x * SIGNAL_SUBSAMPLE] >> gshift) & 255;
+    next[x] = g;
+    if (prev && abs(g - prev[x]) > SIGNAL_THRESHOLD){
+      changed = TRUE;
+    }
+  }
+  return changed;
+}
+
+/*see whether there seems to be activity: compare the green channel with the
+  last frame's, a row at a time, stopping at the first changed row. The
+  frames go in alternate planes, so the rows past the stopping point are
+  stale and next time they are read but not compared. */
 gboolean INVISIBLE
 check_for_signal(GstSparrow *sparrow, sparrow_find_screen_t *finder, guint8 *in){
-  IplImage *green = extract_green_channel(sparrow, finder, in);
-  IplImage *working = finder->working;
-  guint i;
+  guint32 *in32 = (guint32 *)in;
+  guint32 gshift = sparrow->in.gshift;
+  guint32 w = finder->signal_width;
+  guint32 stride = sparrow->in.width * SIGNAL_SUBSAMPLE;
+  guint8 *next = finder->signal_planes[finder->signal_plane];
+  guint8 *prev = finder->signal_planes[! finder->signal_plane];
   gboolean answer = FALSE;
-  cvAbsDiff(green, finder->working, finder->signal);
-  for (i = 0; i < sparrow->in.pixcount; i++){
-    if (finder->signal->imageData[i] > SIGNAL_THRESHOLD){
+  guint32 y;
+  for (y = 0; y < finder->signal_height; y++){
+    const guint8 *p = (y < finder->signal_valid_rows) ? prev + y * w : NULL;
+    if (signal_row(in32 + y * stride, next + y * w, p, w, gshift)){
       answer = TRUE;
+      y++;
       break;
     }
   }
-  memcpy(working->imageData, green->imageData, sparrow->in.pixcount);
-  //char *tmp = working->imageData;
-  //working->imageData = green->imageData;
-  //green->imageData = tmp;
+  finder->signal_valid_rows = y;
+  finder->signal_plane = ! finder->signal_plane;
   GST_DEBUG("answering %d", answer);
   return answer;
 }
@@ -156,12 +190,7 @@ mode_find_screen(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
   sparrow->countdown--;
   GST_DEBUG("in find_screen with countdown %d\n", sparrow->countdown);
   sparrow_find_screen_t *finder = (sparrow_find_screen_t *)sparrow->helper_struct;
-  IplImage *green;
-  IplImage *working = finder->working;
-  IplImage *mask = finder->mask;
-  /* size is 1 byte per pixel, not 4! */
-  size_t size = sparrow->in.pixcount;
-  CvPoint middle, corner;
+  sparrow_bitmask_t *mask = &sparrow->screenmask;
   switch (sparrow->countdown){
   case 6:
   case 5:
@@ -170,30 +199,25 @@ mode_find_screen(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
     /*send white and wait for the picture to arrive back. */
     goto white;
   case 2:
-    /* time to look and see if the screen is there.
-       Look at the histogram of a single channel. */
-    green = extract_green_channel(sparrow, finder, in);
-    cvCanny(green, mask, 100, 170, 3);
-    cvDilate(mask, mask, NULL, 1);
-    MAYBE_DEBUG_IPL(mask);
+    /* time to look and see if the screen is there: find the edges in the
+       green channel. */
+    find_screen_edges(sparrow, &finder->edges, in);
+    bitmask_dilate(&finder->edges, &finder->region);
+    debug_bitmask(sparrow, finder, &finder->edges);
     goto black;
   case 1:
     /* floodfill where the screen is, removing outlying bright spots*/
-    middle = (CvPoint){sparrow->in.width / 2, sparrow->in.height / 2};
-    memset(working->imageData, 255, size);
-    floodfill_mono_superfast(mask, working, middle);
-    MAYBE_DEBUG_IPL(working);
+    bitmask_set_all(&finder->working);
+    bitmask_floodfill(&finder->working, &finder->edges,
+        sparrow->in.width / 2, sparrow->in.height / 2, &finder->region, &finder->fill);
+    debug_bitmask(sparrow, finder, &finder->working);
     goto black;
   case 0:
     /* floodfill the border, removing onscreen dirt.*/
-    corner = (CvPoint){0, 0};
-    memset(mask->imageData, 255, size);
-    floodfill_mono_superfast(working, mask, corner);
-#if STUPID_DEBUG_TRICK
-    cvErode(mask, mask, NULL, 9);
-#endif
-    cvDilate(mask, mask, NULL, 1);
-    MAYBE_DEBUG_IPL(mask);
+    bitmask_set_all(mask);
+    bitmask_floodfill(mask, &finder->working, 0, 0, &finder->region, &finder->fill);
+    bitmask_dilate(mask, &finder->region);
+    debug_bitmask(sparrow, finder, mask);
     goto finish;
   default:
     GST_DEBUG("checking for signal. sparrow countdown is %d", sparrow->countdown);
@@ -216,13 +240,14 @@ mode_find_screen(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
 INVISIBLE void
 finalise_find_screen(GstSparrow *sparrow){
   sparrow_find_screen_t *finder = (sparrow_find_screen_t *)sparrow->helper_struct;
-  GST_DEBUG("finalise_find_screen: green %p, working %p, mask %p, im %p finder %p\n",
-      finder->green, finder->working, finder->mask, finder->im, finder);
-  cvReleaseImage(&finder->signal);
-  cvReleaseImage(&finder->green);
-  cvReleaseImage(&finder->working);
-  cvReleaseImageHeader(&finder->mask);
-  cvReleaseImageHeader(&finder->im);
+  GST_DEBUG("finalise_find_screen: finder %p\n", finder);
+  free(finder->signal_planes[0]);
+  free(finder->signal_planes[1]);
+  bitmask_free(&finder->edges);
+  bitmask_free(&finder->working);
+  bitmask_free(&finder->region);
+  bitmask_free(&finder->fill);
+  free(finder->debug);
   free(finder);
 }
 
@@ -232,15 +257,18 @@ init_find_screen(GstSparrow *sparrow){
   sparrow->helper_struct = (void *)finder;
   sparrow->countdown = sparrow->lag + WAIT_TIME;
   finder->waiting = TRUE;
-  CvSize size = {sparrow->in.width, sparrow->in.height};
-  finder->green = cvCreateImage(size, IPL_DEPTH_8U, 1);
-  finder->working = cvCreateImage(size, IPL_DEPTH_8U, 1);
-  finder->signal = cvCreateImage(size, IPL_DEPTH_8U, 1);
-  finder->im = init_ipl_image(&sparrow->in, PIXSIZE);
-  finder->mask  = init_ipl_image(&sparrow->in, 1);
-
-  finder->mask->imageData = (char *)sparrow->screenmask;
-  GST_DEBUG("init_find_screen: green %p, working %p, mask %p, im %p finder %p\n",
-      finder->green, finder->working, finder->mask, finder->im, finder);
+  bitmask_init(&finder->edges, sparrow->in.width, sparrow->in.height);
+  bitmask_init(&finder->working, sparrow->in.width, sparrow->in.height);
+  bitmask_init(&finder->region, sparrow->in.width, sparrow->in.height);
+  bitmask_init(&finder->fill, sparrow->in.width, sparrow->in.height);
+  if (sparrow->debug){
+    finder->debug = malloc_or_die(sparrow->in.pixcount);
+  }
+  finder->signal_width = sparrow->in.width / SIGNAL_SUBSAMPLE;
+  finder->signal_height = sparrow->in.height / SIGNAL_SUBSAMPLE;
+  finder->signal_planes[0] = malloc_aligned_or_die(finder->signal_width *
+      finder->signal_height);
+  finder->signal_planes[1] = malloc_aligned_or_die(finder->signal_width *
+      finder->signal_height);
+  GST_DEBUG("init_find_screen: finder %p\n", finder);
 }
-
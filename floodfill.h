@@ -0,0 +1,228 @@
+#ifndef __SPARROW_FLOODFILL_H__
+#define __SPARROW_FLOODFILL_H__
+/* Mono flood fills on 8 bit images, used by test-find-edge.c to check and
+   time bitmask_floodfill (bitmask.h), which find_screen now uses.
+
+   Starting at a point, the fill clears the mask under every pixel that is
+   4-connected to it through pixels of the same colour whose mask is still set.
+   The start pixel is only cleared if it has such a neighbour -- the original
+   breadth first fill only clears pixels it steps into, and the scanline fill
+   keeps that.
+*/
+
+#include "sparrow.h"
+#include <string.h>
+
+/* The original breadth first fill, kept as the reference for the scanline
+   fill. It needs two point lists as big as the image.
+
+  im: the image to be analysed
+  mim: the mask image to be written
+  start: a point of the right colour.
+*/
+static inline void
+expand_one_mono(int x, int y, int c,
+    CvPoint *nexts, int *n_nexts, guint8 *im, guint8 *mask, int w, int h){
+  guint8 p = im[y * w + x];
+  guint8 *m = &mask[y * w + x];
+  if (*m && (p == c)){
+    *m = 0;
+    nexts[*n_nexts].x = x;
+    nexts[*n_nexts].y = y;
+    (*n_nexts)++;
+  }
+}
+
+static UNUSED IplImage*
+floodfill_mono_superfast(IplImage *im, IplImage *mim, CvPoint start)
+{
+  guint8 * data = (guint8 *)im->imageData;
+  guint8 * mdata = (guint8 *)mim->imageData;
+  int w = im->width;
+  int h = im->height;
+  int n_starts;
+  int n_nexts = 0;
+  CvPoint *starts;
+  CvPoint *nexts;
+
+  //malloc 2 lists of points. These *could* be as large as the image (but never should be)
+  void * mem = malloc_or_die(w * h * 2 * sizeof(CvPoint));
+  starts = mem;
+  nexts = starts + w * h;
+  n_starts = 1;
+  starts[0] = start;
+
+  while(n_starts){
+    n_nexts = 0;
+    int i;
+    for (i = 0; i < n_starts; i++){
+      int x = starts[i].x;
+      int y = starts[i].y;
+      int c = data[y * w + x];
+      if (x > 0){
+        expand_one_mono(x - 1, y, c, nexts, &n_nexts, data, mdata, w, h);
+      }
+      if (x < w - 1){
+        expand_one_mono(x + 1, y, c, nexts, &n_nexts, data, mdata, w, h);
+      }
+      if (y > 0){
+        expand_one_mono(x, y - 1, c, nexts, &n_nexts, data, mdata, w, h);
+      }
+      if (y < h - 1){
+        expand_one_mono(x, y + 1, c, nexts, &n_nexts, data, mdata, w, h);
+      }
+    }
+    CvPoint *tmp = starts;
+    starts = nexts;
+    nexts = tmp;
+    n_starts = n_nexts;
+  }
+  free(mem);
+  return im;
+}
+
+/* Scanline fill. Each stack entry is a run of already cleared pixels
+   [left, right] on row y - dy, whose neighbours on row y are still to be
+   looked at. A row is cleared run by run, pushing the runs found on the next
+   row in the same direction, and, where a run pokes out past its parent, the
+   bits of the row it came from that the parent didn't cover. The stack is
+   rarely more than a few dozen deep; it starts on the C stack and only goes
+   to the heap for pathological masks. */
+
+#define FLOODFILL_STACK 256
+
+typedef struct fill_span_s {
+  gint16 left;
+  gint16 right;
+  gint16 y;
+  gint16 dy;
+} fill_span_t;
+
+typedef struct fill_state_s {
+  const guint8 *data;
+  guint8 *mask;
+  int w;
+  int h;
+  guint8 colour;
+  fill_span_t *stack;
+  int n;
+  int size;
+  fill_span_t local[FLOODFILL_STACK];
+} fill_state_t;
+
+static inline void
+fill_push(fill_state_t *f, int y, int left, int right, int dy){
+  if (f->n == f->size){
+    fill_span_t *s = malloc_or_die(f->size * 2 * sizeof(fill_span_t));
+    memcpy(s, f->stack, f->n * sizeof(fill_span_t));
+    if (f->stack != f->local){
+      free(f->stack);
+    }
+    f->stack = s;
+    f->size *= 2;
+  }
+  f->stack[f->n] = (fill_span_t){left, right, y, dy};
+  f->n++;
+}
+
+static inline int
+fill_inside(fill_state_t *f, const guint8 *data, const guint8 *mask, int x){
+  return mask[x] && data[x] == f->colour;
+}
+
+/*fill from (x, y), which must be inside. Returns the number of pixels cleared. */
+static inline guint32
+fill_spans(fill_state_t *f, int x, int y){
+  guint32 count = 0;
+  fill_push(f, y, x, x, 1);
+  fill_push(f, y + 1, x, x, -1);
+  while (f->n){
+    f->n--;
+    fill_span_t s = f->stack[f->n];
+    int dy = s.dy;
+    int x1 = s.left;
+    int x2 = s.right;
+    int row = s.y + dy;
+    if (row < 0 || row >= f->h){
+      continue;
+    }
+    const guint8 *data = f->data + row * f->w;
+    guint8 *mask = f->mask + row * f->w;
+    int left = x1;
+    /*run left from x1 */
+    for (x = x1; x >= 0 && fill_inside(f, data, mask, x); x--){
+      mask[x] = 0;
+      count++;
+    }
+    /*if x1 itself is outside, skip to the first inside pixel under the parent */
+    gboolean skip = (x == x1);
+    if (! skip){
+      left = x + 1;
+      if (left < x1){
+        fill_push(f, row, left, x1 - 1, -dy);
+      }
+      x = x1 + 1;
+    }
+    do {
+      if (! skip){
+        for (; x < f->w && fill_inside(f, data, mask, x); x++){
+          mask[x] = 0;
+          count++;
+        }
+        fill_push(f, row, left, x - 1, dy);
+        if (x > x2 + 1){
+          fill_push(f, row, x2 + 1, x - 1, -dy);
+        }
+      }
+      skip = FALSE;
+      for (x++; x <= x2 && ! fill_inside(f, data, mask, x); x++);
+      left = x;
+    } while (x <= x2);
+  }
+  return count;
+}
+
+static UNUSED IplImage*
+floodfill_mono_spans(IplImage *im, IplImage *mim, CvPoint start)
+{
+  fill_state_t f;
+  f.data = (guint8 *)im->imageData;
+  f.mask = (guint8 *)mim->imageData;
+  f.w = im->width;
+  f.h = im->height;
+  f.stack = f.local;
+  f.n = 0;
+  f.size = FLOODFILL_STACK;
+  int x = start.x;
+  int y = start.y;
+  int i = y * f.w + x;
+  f.colour = f.data[i];
+  if (f.mask[i]){
+    guint8 m = f.mask[i];
+    if (fill_spans(&f, x, y) == 1){
+      /*no neighbours: the breadth first fill would never have stepped back here */
+      f.mask[i] = m;
+    }
+  }
+  else {
+    /*the start isn't in the mask, but its neighbours might be */
+    if (x > 0 && fill_inside(&f, f.data, f.mask, i - 1)){
+      fill_spans(&f, x - 1, y);
+    }
+    if (x < f.w - 1 && fill_inside(&f, f.data, f.mask, i + 1)){
+      fill_spans(&f, x + 1, y);
+    }
+    if (y > 0 && fill_inside(&f, f.data, f.mask, i - f.w)){
+      fill_spans(&f, x, y - 1);
+    }
+    if (y < f.h - 1 && fill_inside(&f, f.data, f.mask, i + f.w)){
+      fill_spans(&f, x, y + 1);
+    }
+  }
+  if (f.stack != f.local){
+    free(f.stack);
+  }
+  return im;
+}
+
+#endif
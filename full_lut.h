@@ -0,0 +1,232 @@
+#ifndef __SPARROW_FULL_LUT_H__
+#define __SPARROW_FULL_LUT_H__
+/* Turning the corner mesh into the full map lookup table, for
+   corners_to_full_lut (edges.c), also used by test-full-lut.c.
+
+   Each mesh square covers LINE_PERIOD x LINE_PERIOD output pixels, and the
+   camera position of each is interpolated from the square's corner and
+   deltas, then dithered down to a whole camera pixel.
+
+   lut_row_float is the original way: float coordinates, dithered by a double
+   per output pixel. lut_row_fixed does it in 16.16 fixed point, dithered by
+   a small repeating blue noise tile, so the dither is spread evenly rather
+   than in clumps, and takes 4k instead of 8 bytes a pixel. Each call does
+   one row of mesh squares, so rows can go to different threads.
+*/
+
+#include "sparrow.h"
+#include "gstsparrow.h"
+#include "edges.h"
+#include "bitmask.h"
+#include <math.h>
+
+#define DITHER_TILE_BITS 6
+#define DITHER_TILE_SIZE (1 << DITHER_TILE_BITS)
+#define DITHER_TILE_MASK (DITHER_TILE_SIZE - 1)
+#define DITHER_TILE_PIXELS (DITHER_TILE_SIZE * DITHER_TILE_SIZE)
+
+/*width of the gaussian the void-and-cluster method uses to find clumps and
+  gaps. 1.5 is Ulichney's suggestion. */
+#define DITHER_SIGMA 1.5
+
+static inline void
+dither_energy_add(float *energy, const float *kernel, int p, float sign){
+  int px = p & DITHER_TILE_MASK;
+  int py = p >> DITHER_TILE_BITS;
+  for (int y = 0; y < DITHER_TILE_SIZE; y++){
+    float *row = energy + (((py + y) & DITHER_TILE_MASK) << DITHER_TILE_BITS);
+    const float *k = kernel + (y << DITHER_TILE_BITS);
+    for (int x = 0; x < DITHER_TILE_SIZE; x++){
+      row[(px + x) & DITHER_TILE_MASK] += sign * k[x];
+    }
+  }
+}
+
+/*the set pixel with the most energy (tightest cluster) or the clear pixel
+  with the least (largest void) */
+static inline int
+dither_extreme(const float *energy, const guint8 *set, int want_set){
+  int best = -1;
+  for (int i = 0; i < DITHER_TILE_PIXELS; i++){
+    if (set[i] == want_set &&
+        (best < 0 || (want_set ? energy[i] > energy[best] : energy[i] < energy[best]))){
+      best = i;
+    }
+  }
+  return best;
+}
+
+/*Fill tile with a blue noise threshold pattern by Ulichney's void-and-cluster
+  method: each byte value turns up 16 times, and any threshold picks out
+  evenly spread pixels. The tile wraps around, so it can be repeated. This
+  takes a few tens of milliseconds, so do it at set up time. */
+static UNUSED void
+make_blue_noise_tile(GstSparrow *sparrow, guint8 *tile){
+  float *kernel = malloc_or_die(DITHER_TILE_PIXELS * sizeof(float));
+  float *energy = malloc_or_die(DITHER_TILE_PIXELS * sizeof(float));
+  float *proto_energy = malloc_or_die(DITHER_TILE_PIXELS * sizeof(float));
+  guint8 *set = malloc_or_die(DITHER_TILE_PIXELS);
+  guint8 *proto = malloc_or_die(DITHER_TILE_PIXELS);
+  guint16 *ranks = malloc_or_die(DITHER_TILE_PIXELS * sizeof(guint16));
+  int i;
+  for (int y = 0; y < DITHER_TILE_SIZE; y++){
+    for (int x = 0; x < DITHER_TILE_SIZE; x++){
+      int dx = MIN(x, DITHER_TILE_SIZE - x);
+      int dy = MIN(y, DITHER_TILE_SIZE - y);
+      kernel[(y << DITHER_TILE_BITS) + x] =
+        exp(-(dx * dx + dy * dy) / (2 * DITHER_SIGMA * DITHER_SIGMA));
+    }
+  }
+  /*a random initial pattern of a tenth of the pixels */
+  int n_ones = DITHER_TILE_PIXELS / 10;
+  memset(set, 0, DITHER_TILE_PIXELS);
+  memset(energy, 0, DITHER_TILE_PIXELS * sizeof(float));
+  for (i = 0; i < n_ones;){
+    int p = rng_uniform_int(sparrow, DITHER_TILE_PIXELS);
+    if (! set[p]){
+      set[p] = 1;
+      dither_energy_add(energy, kernel, p, 1);
+      i++;
+    }
+  }
+  /*move the tightest cluster into the largest void, until that doesn't
+    move anything. Float ties could make it cycle, so give up after a move
+    per pixel: the pattern is usable whenever it stops. */
+  for (i = 0; i < DITHER_TILE_PIXELS; i++){
+    int cluster = dither_extreme(energy, set, 1);
+    set[cluster] = 0;
+    dither_energy_add(energy, kernel, cluster, -1);
+    int void_ = dither_extreme(energy, set, 0);
+    set[void_] = 1;
+    dither_energy_add(energy, kernel, void_, 1);
+    if (void_ == cluster){
+      break;
+    }
+  }
+  memcpy(proto, set, DITHER_TILE_PIXELS);
+  memcpy(proto_energy, energy, DITHER_TILE_PIXELS * sizeof(float));
+  /*rank the initial pixels, tightest clusters last */
+  for (i = n_ones - 1; i >= 0; i--){
+    int cluster = dither_extreme(energy, set, 1);
+    set[cluster] = 0;
+    dither_energy_add(energy, kernel, cluster, -1);
+    ranks[cluster] = i;
+  }
+  /*then the rest, largest voids first */
+  memcpy(set, proto, DITHER_TILE_PIXELS);
+  memcpy(energy, proto_energy, DITHER_TILE_PIXELS * sizeof(float));
+  for (i = n_ones; i < DITHER_TILE_PIXELS; i++){
+    int void_ = dither_extreme(energy, set, 0);
+    set[void_] = 1;
+    dither_energy_add(energy, kernel, void_, 1);
+    ranks[void_] = i;
+  }
+  for (i = 0; i < DITHER_TILE_PIXELS; i++){
+    tile[i] = (ranks[i] * 256) / DITHER_TILE_PIXELS;
+  }
+  free(kernel);
+  free(energy);
+  free(proto_energy);
+  free(set);
+  free(proto);
+  free(ranks);
+}
+
+/*16.16 fixed point camera coordinates. A point in a mesh square is the
+  corner plus up to LINE_PERIOD steps each of two deltas (counting the step
+  past the last pixel), so wild corners and deltas are clamped separately,
+  well out of the frame, to keep that sum inside 15 bits of whole pixels. */
+#define FIXED_LUT_SHIFT 16
+#define FIXED_LUT_LIMIT (1 << 14)
+#define FIXED_LUT_DELTA_LIMIT (1 << 7)
+
+typedef char fixed_lut_sums_fit[(FIXED_LUT_LIMIT + 2 * LINE_PERIOD * FIXED_LUT_DELTA_LIMIT
+        < (1 << (31 - FIXED_LUT_SHIFT))) ? 1 : -1];
+
+static inline gint32
+coord_to_fixed(coord_t x, const int limit){
+#if USE_FLOAT_COORDS
+  x = CLAMP(x, -limit, limit);
+  return (gint32)(x * (1 << FIXED_LUT_SHIFT));
+#else
+  x = CLAMP(x, -limit << SPARROW_FIXED_POINT, limit << SPARROW_FIXED_POINT);
+  return x << (FIXED_LUT_SHIFT - SPARROW_FIXED_POINT);
+#endif
+}
+
+/*the dither byte is a fraction of a pixel in 1/256ths */
+static inline int
+fixed_to_int_clamp_dither(gint32 x, guint dither, const int max_plus_one){
+  if (x < 0)
+    return 0;
+  x = (x + (dither << (FIXED_LUT_SHIFT - 8))) >> FIXED_LUT_SHIFT;
+  if (x >= max_plus_one)
+    return max_plus_one - 1;
+  return x;
+}
+
+/*fill in the output rows under row mcy of the mesh, in fixed point */
+static inline void
+lut_row_fixed(GstSparrow *sparrow, const sparrow_corner_t *mesh, int mesh_w,
+    const guint8 *tile, guint32 *map_lut, int mcy){
+  const sparrow_corner_t *mesh_row = mesh + mcy * mesh_w;
+  int y = H_LINE_OFFSET + mcy * LINE_PERIOD;
+  int in_w = sparrow->in.width;
+  int in_h = sparrow->in.height;
+  for (int mmy = 0; mmy < LINE_PERIOD; mmy++, y++){
+    const guint8 *tile_row = tile + ((y & DITHER_TILE_MASK) << DITHER_TILE_BITS);
+    int x = V_LINE_OFFSET;
+    guint32 *lut = map_lut + y * sparrow->out.width + x;
+    for (int mcx = 0; mcx < mesh_w - 1; mcx++){
+      const sparrow_corner_t *sq = &mesh_row[mcx];
+      gint32 ix = coord_to_fixed(sq->x, FIXED_LUT_LIMIT) +
+          mmy * coord_to_fixed(sq->dxd, FIXED_LUT_DELTA_LIMIT);
+      gint32 iy = coord_to_fixed(sq->y, FIXED_LUT_LIMIT) +
+          mmy * coord_to_fixed(sq->dyd, FIXED_LUT_DELTA_LIMIT);
+      gint32 dxr = coord_to_fixed(sq->dxr, FIXED_LUT_DELTA_LIMIT);
+      gint32 dyr = coord_to_fixed(sq->dyr, FIXED_LUT_DELTA_LIMIT);
+      for (int mmx = 0; mmx < LINE_PERIOD; mmx++, x++, lut++){
+        guint d = tile_row[x & DITHER_TILE_MASK];
+        int ixx = fixed_to_int_clamp_dither(ix, d, in_w);
+        int iyy = fixed_to_int_clamp_dither(iy, d, in_h);
+        if (bitmask_test(&sparrow->screenmask, ixx, iyy)){
+          *lut = iyy * in_w + ixx;
+        }
+        ix += dxr;
+        iy += dyr;
+      }
+    }
+  }
+}
+
+#if USE_FLOAT_COORDS
+/*fill in the output rows under row mcy of the mesh, in floating point, with
+  a dither value for each output pixel */
+static inline void
+lut_row_float(GstSparrow *sparrow, const sparrow_corner_t *mesh, int mesh_w,
+    const double *dither, guint32 *map_lut, int mcy){
+  const sparrow_corner_t *mesh_row = mesh + mcy * mesh_w;
+  int y = H_LINE_OFFSET + mcy * LINE_PERIOD;
+  for (int mmy = 0; mmy < LINE_PERIOD; mmy++, y++){
+    const sparrow_corner_t *mesh_square = mesh_row;
+    int i = y * sparrow->out.width + V_LINE_OFFSET;
+    for (int mcx = 0; mcx < mesh_w - 1; mcx++){
+      coord_t iy = mesh_square->y + mmy * mesh_square->dyd;
+      coord_t ix = mesh_square->x + mmy * mesh_square->dxd;
+      for (int mmx = 0; mmx < LINE_PERIOD; mmx++, i++){
+        int ixx = coord_to_int_clamp_dither(dither, ix, sparrow->in.width, i);
+        int iyy = coord_to_int_clamp_dither(dither, iy, sparrow->in.height, i);
+        guint32 inpos = iyy * sparrow->in.width + ixx;
+        if (bitmask_test(&sparrow->screenmask, ixx, iyy)){
+          map_lut[i] = inpos;
+        }
+        ix += mesh_square->dxr;
+        iy += mesh_square->dyr;
+      }
+      mesh_square++;
+    }
+  }
+}
+#endif
+
+#endif
@@ -160,6 +160,39 @@ gst_sparrow_class_init (GstSparrowClass * g_class)
           "Calibrate the projectors one after another, rather than both at once",
           DEFAULT_PROP_SERIAL, G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint("threads", "Threads",
+          "Split frames between this many threads (0 for one per CPU) [" QUOTE(DEFAULT_PROP_THREADS) "]",
+          0, SPARROW_MAX_THREADS, DEFAULT_PROP_THREADS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CONTENT,
+      g_param_spec_string ("content", "Content",
+          "directory holding jpeg.index and jpeg.blob (or raw.blob) [" DEFAULT_PROP_CONTENT "]",
+          DEFAULT_PROP_CONTENT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_CODE,
+      g_param_spec_uint("code", "Code",
+          "flash the calibration squares with this code (1 to " QUOTE(SPARROW_N_CODES)
+          "), so several projectors can find their lag at once; 0 for random [" QUOTE(DEFAULT_PROP_CODE) "]",
+          0, SPARROW_N_CODES, DEFAULT_PROP_CODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_GRAY_CODE,
+      g_param_spec_boolean("gray-code", "Gray code calibration",
+          "Find the edges with Gray coded stripes, rather than one line at a time",
+          DEFAULT_PROP_GRAY_CODE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_ADAPTIVE_LINES,
+      g_param_spec_boolean("adaptive-lines", "Adaptive line timing",
+          "Move on to the next edge line as soon as the camera has seen the last one",
+          DEFAULT_PROP_ADAPTIVE_LINES, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_TRACK_LAG,
+      g_param_spec_boolean("track-lag", "Track lag during play",
+          "Keep estimating the camera lag while playing, and follow it if it changes (experimental)",
+          DEFAULT_PROP_TRACK_LAG, G_PARAM_READWRITE));
+
   trans_class->set_caps = GST_DEBUG_FUNCPTR (gst_sparrow_set_caps);
   trans_class->transform = GST_DEBUG_FUNCPTR (gst_sparrow_transform);
   GST_INFO("gst class init\n");
@@ -231,6 +264,30 @@ gst_sparrow_set_property (GObject * object, guint prop_id, const GValue * value,
       sparrow->serial = g_value_get_boolean(value);
       GST_DEBUG("serial is %d\n", sparrow->serial);
       break;
+    case PROP_THREADS:
+      sparrow->n_threads = g_value_get_uint(value);
+      GST_DEBUG("threads is %d\n", sparrow->n_threads);
+      break;
+    case PROP_CONTENT:
+      set_string_prop(value, &sparrow->content);
+      GST_DEBUG("content is %s\n", sparrow->content);
+      break;
+    case PROP_CODE:
+      sparrow->code = g_value_get_uint(value);
+      GST_DEBUG("code is %d\n", sparrow->code);
+      break;
+    case PROP_GRAY_CODE:
+      sparrow->gray_code = g_value_get_boolean(value);
+      GST_DEBUG("gray_code is %d\n", sparrow->gray_code);
+      break;
+    case PROP_ADAPTIVE_LINES:
+      sparrow->adaptive_lines = g_value_get_boolean(value);
+      GST_DEBUG("adaptive_lines is %d\n", sparrow->adaptive_lines);
+      break;
+    case PROP_TRACK_LAG:
+      sparrow->track_lag = g_value_get_boolean(value);
+      GST_DEBUG("track_lag is %d\n", sparrow->track_lag);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -269,6 +326,24 @@ gst_sparrow_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_SERIAL:
       g_value_set_boolean(value, sparrow->serial);
       break;
+    case PROP_THREADS:
+      g_value_set_uint(value, sparrow->n_threads);
+      break;
+    case PROP_CONTENT:
+      g_value_set_string(value, sparrow->content);
+      break;
+    case PROP_CODE:
+      g_value_set_uint(value, sparrow->code);
+      break;
+    case PROP_GRAY_CODE:
+      g_value_set_boolean(value, sparrow->gray_code);
+      break;
+    case PROP_ADAPTIVE_LINES:
+      g_value_set_boolean(value, sparrow->adaptive_lines);
+      break;
+    case PROP_TRACK_LAG:
+      g_value_set_boolean(value, sparrow->track_lag);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
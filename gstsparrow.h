@@ -126,6 +126,14 @@ typedef struct sparrow_format_s {
   guint32 colours[3];
 } sparrow_format;
 
+/*one bit per pixel (bitmask.h) */
+typedef struct sparrow_bitmask_s {
+  guint64 *bits;
+  guint32 width;
+  guint32 height;
+  guint32 row_words;
+} sparrow_bitmask_t;
+
 
 typedef enum sparrow_axis_s {
   SPARROW_HORIZONTAL,
@@ -147,11 +155,97 @@ typedef struct sparrow_frame_s {
   gint32 successors[8];
 } sparrow_frame_t;
 
+/*the raw content file is the same frames as the jpeg blob, pre-decoded.  A
+  header is followed (at SPARROW_RAW_HEADER_SIZE, so frames are page aligned)
+  by image_count frames of width * height pixels, in index order. The shifts
+  say where the colours are, as in sparrow_format; the file is only used if
+  they match the output caps. */
+#define SPARROW_RAW_MAGIC "SPRWRAW1"
+#define SPARROW_RAW_HEADER_SIZE 4096
+
+typedef struct sparrow_raw_header_s {
+  char magic[8];
+  guint32 width;
+  guint32 height;
+  guint32 rshift;
+  guint32 gshift;
+  guint32 bshift;
+  guint32 image_count;
+} sparrow_raw_header_t;
+
+/*jpeg.index starts with this header, followed at header_size by image_count
+  frames. checksum is the adler32 of the frames. Old indexes have no header.
+*/
+#define SPARROW_INDEX_MAGIC "SPRWIDX\n"
+#define SPARROW_INDEX_VERSION 1
+
+typedef struct sparrow_index_header_s {
+  char magic[8];
+  guint32 version;
+  guint32 header_size;
+  guint32 frame_size;
+  guint32 image_count;
+  guint32 width;
+  guint32 height;
+  guint32 blob_size;
+  guint32 checksum;
+} sparrow_index_header_t;
+
+/*calibration files (the save and reload properties) start with this
+  header. The sections follow at their offsets, each on a page boundary, so
+  the file can be mapped and the lut used where it lies. The mask is in
+  sparrow_bitmask_t words. Old files have no header (see read_edges_info in
+  edges.c). */
+#define SPARROW_CALIBRATION_MAGIC "SPRWCAL\n"
+#define SPARROW_CALIBRATION_VERSION 1
+#define SPARROW_CALIBRATION_ALIGN 4096
+
+typedef struct sparrow_calibration_header_s {
+  char magic[8];
+  guint32 version;
+  guint32 header_size;
+  guint32 in_width;
+  guint32 in_height;
+  guint32 out_width;
+  guint32 out_height;
+  guint32 lag;
+  gint32 n_vlines;
+  gint32 n_hlines;
+  guint32 map_offset;
+  guint32 clusters_offset;
+  guint32 mesh_offset;
+  guint32 mask_offset;
+  guint32 lut_offset;
+  guint32 file_size;
+} sparrow_calibration_header_t;
+
+/*what reload_calibration made of the reload file */
+typedef enum {
+  SPARROW_RELOAD_NONE = 0,  /*nothing: calibrate from scratch */
+  SPARROW_RELOAD_EDGES,     /*an old headerless file, for find_edges to read */
+  SPARROW_RELOAD_LUT        /*the lut and mask are loaded, and the lag set */
+} sparrow_reload_t;
+
 typedef struct sparrow_shared_s {
   guint8 *jpeg_blob;
   guint32 blob_size;
   sparrow_frame_t *index;
   guint32 image_count;
+  sparrow_index_header_t *index_header; /*NULL for old headerless indexes */
+  guint8 *index_map;
+  size_t index_map_size;
+  guint8 *raw_blob;  /*NULL unless a matching raw file was found */
+  size_t raw_size;
+  guint8 *raw_frames;
+  /*the jpeg blob is paged in by a background thread (load_images.c) */
+  GThread *loader;
+  GMutex *load_mutex;
+  GCond *load_cond;
+  size_t bytes_loaded;
+  gboolean images_ready;
+  gboolean stop_loading;
+  /*too big to keep in memory: play mode asks for frames as it approaches them */
+  gboolean use_prefetch;
 } sparrow_shared_t;
 
 
@@ -192,8 +286,18 @@ struct _GstSparrow
   guint32 frame_count;
 
   const char *reload;
+  sparrow_reload_t reloaded;
   const char *save;
+  const char *content;
+  guint32 code;
   gboolean serial;
+  gboolean gray_code;
+  gboolean adaptive_lines;
+  gboolean track_lag;
+  guint32 n_threads;
+
+  /* worker bands (threads.c) */
+  struct sparrow_bands_s *bands;
 
   /*debug timer */
   struct timeval timer_start;
@@ -202,9 +306,12 @@ struct _GstSparrow
 
   /*calibration results */
   guint32 lag;
-  guint8 *screenmask;
+  sparrow_bitmask_t screenmask;
   /*full sized LUT */
   guint32 *map_lut;
+  /*a reloaded calibration file, if map_lut points into it */
+  guint8 *calibration_map;
+  size_t calibration_size;
   /*for jpeg decompression*/
   struct jpeg_decompress_struct *cinfo;
   int jpeg_colourspace;
@@ -238,7 +345,13 @@ enum
   PROP_COLOUR,
   PROP_RELOAD,
   PROP_SAVE,
-  PROP_SERIAL
+  PROP_SERIAL,
+  PROP_THREADS,
+  PROP_CONTENT,
+  PROP_CODE,
+  PROP_GRAY_CODE,
+  PROP_ADAPTIVE_LINES,
+  PROP_TRACK_LAG
 };
 
 #define DEFAULT_PROP_CALIBRATE TRUE
@@ -249,6 +362,15 @@ enum
 #define DEFAULT_PROP_RELOAD ""
 #define DEFAULT_PROP_SAVE ""
 #define DEFAULT_PROP_SERIAL FALSE
+#define DEFAULT_PROP_THREADS 0
+#define DEFAULT_PROP_CONTENT "content"
+#define DEFAULT_PROP_CODE 0
+#define DEFAULT_PROP_GRAY_CODE FALSE
+#define DEFAULT_PROP_ADAPTIVE_LINES FALSE
+#define DEFAULT_PROP_TRACK_LAG FALSE
+
+/*number of distinct calibration codes (the Gold codes of length 63) */
+#define SPARROW_N_CODES 65
 
 #define QUOTE_(x) #x
 #define QUOTE(x) QUOTE_(x)
@@ -16,6 +16,7 @@ static guint option_serial = 0;
 static char **option_reload = NULL;
 static char **option_save = NULL;
 static char *option_avi = NULL;
+static char *option_content = NULL;
 
 
 #define MAX_SCREENS 2
@@ -40,6 +41,8 @@ static GOptionEntry entries[] =
     "save calibration data to FILE (one per screen)", "FILE" },
   { "avi", 'a', 0, G_OPTION_ARG_FILENAME, &option_avi,
     "save mjpeg video to FILE", "FILE" },
+  { "content", 'C', 0, G_OPTION_ARG_FILENAME, &option_content,
+    "play content from DIR (holding jpeg.index, jpeg.blob)", "DIR" },
   { NULL, 0, 0, 0, NULL, NULL, NULL }
 };
 
@@ -91,7 +94,8 @@ mjpeg_branch(GstPipeline *pipeline, GstElement *tee)
 
 static void
 post_tee_pipeline(GstPipeline *pipeline, GstElement *tee, GstElement *sink,
-    int rngseed, int colour, int timer, int debug, char *save, char *reload){
+    int rngseed, int colour, int timer, int debug, char *save, char *reload,
+    int code){
   GstElement *queue = gst_element_factory_make("queue", NULL);
   GstElement *sparrow = gst_element_factory_make("sparrow", NULL);
   GstElement *caps_posteriori = gst_element_factory_make("capsfilter", NULL);
@@ -107,6 +111,7 @@ post_tee_pipeline(GstPipeline *pipeline, GstElement *tee, GstElement *sink,
       "rngseed", rngseed,
       "colour", colour,
       "serial", option_serial,
+      "code", code,
       NULL);
   if (reload){
     g_object_set(G_OBJECT(sparrow),
@@ -118,6 +123,11 @@ post_tee_pipeline(GstPipeline *pipeline, GstElement *tee, GstElement *sink,
         "save", save,
         NULL);
   }
+  if (option_content){
+    g_object_set(G_OBJECT(sparrow),
+        "content", option_content,
+        NULL);
+  }
 
   gst_bin_add_many (GST_BIN(pipeline),
       queue,
@@ -23,7 +23,8 @@ make_multi_pipeline(GstElement **sinks, int count)
     GstElement *sink = gst_element_factory_make("ximagesink", NULL);
     sinks[i] = sink;
     //args are:
-    //(pipeline, tee, sink, int rngseed, int colour, timer flag, int debug flag)
+    //(pipeline, tee, sink, int rngseed, int colour, timer flag, int debug flag,
+    // save, reload, code)
     /* timer should only run on one of them. colour >= 3 is undefined */
     int debug = option_debug == i;
     int timer = option_timer == i;
@@ -37,7 +38,9 @@ make_multi_pipeline(GstElement **sinks, int count)
     if (option_save && option_save[i]){
       save = option_save[i];
     }
-    post_tee_pipeline(pipeline, tee, sink, i, i + 1, timer, debug, save, reload);
+    /* with more than one screen, each finds its lag with its own code */
+    int code = (count > 1) ? i + 1 : 0;
+    post_tee_pipeline(pipeline, tee, sink, i, i + 1, timer, debug, save, reload, code);
   }
   if (option_avi){
     /*add a branch saving the video to a file */
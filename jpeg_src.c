@@ -37,11 +37,15 @@ FOR EACH jpeg {
   FOR EACH line {
     read_one_line(sparrow, dest);
   }
+  // or all at once: read_lines(sparrow, dest, height);
   finish_reading_jpeg(sparrow);
 }
 
 finalise_jpeg_src(sparrow); // once only (optional really)
 
+The decompressor is created in init_jpeg_src and reused for each jpeg, so
+libjpeg doesn't set up and tear down its memory pools every frame.
+
 */
 
 #include <stdio.h>
@@ -103,10 +107,11 @@ term_source (j_decompress_ptr cinfo)
 {}
 
 /*
- Prepare for input from a memory buffer.
+ Prepare for input from a memory buffer. (Newer libjpegs declare their own
+ jpeg_mem_src(), hence the prefix.)
  */
 static void
-jpeg_mem_src (j_decompress_ptr cinfo, unsigned char* buffer, unsigned int bufsize)
+sparrow_jpeg_mem_src (j_decompress_ptr cinfo, unsigned char* buffer, unsigned int bufsize)
 {
   sparrow_src_mgr *src;
 
@@ -129,18 +134,21 @@ jpeg_mem_src (j_decompress_ptr cinfo, unsigned char* buffer, unsigned int bufsiz
 }
 
 #define ROWS_PER_CYCLE 1 /*I think this needs to be 1 in anycase*/
+/*rec_outbuf_height is at most 4 (with unusual upsampling) */
+#define MAX_ROWS_PER_READ 4
 
-/* the complete decompress function, not actually used in sparrow */
+/* the complete decompress function, not actually used in sparrow. cinfo
+   must already be created (as init_jpeg_src does), and is left ready for
+   the next jpeg. */
 INVISIBLE void
 decompress_buffer(struct jpeg_decompress_struct *cinfo, guint8* src, int size, guint8* dest,
     int *width, int *height)
 {
-  jpeg_create_decompress(cinfo);
-  jpeg_mem_src(cinfo, src, size);
+  sparrow_jpeg_mem_src(cinfo, src, size);
 
   jpeg_read_header(cinfo, TRUE);
-  jpeg_start_decompress(cinfo);
   cinfo->out_color_space = COLOURSPACE;
+  jpeg_start_decompress(cinfo);
 
   *width = cinfo->output_width;
   *height = cinfo->output_height;
@@ -154,30 +162,37 @@ decompress_buffer(struct jpeg_decompress_struct *cinfo, guint8* src, int size, g
     row += stride * read;
   }
   jpeg_finish_decompress(cinfo);
-  jpeg_destroy_decompress(cinfo);
 }
 
 
 
 
-INVISIBLE void
+/*returns FALSE, leaving the decompressor ready for the next jpeg, if this
+  one isn't the output size: its rows would overrun the destination. A
+  headerless index can't be checked for geometry when it is loaded, so this
+  is the only place it is caught. */
+INVISIBLE gboolean
 begin_reading_jpeg(GstSparrow *sparrow, guint8* src, int size){
   struct jpeg_decompress_struct *cinfo = sparrow->cinfo;
   GST_DEBUG("cinfo is %p, src %p, size %d\n", cinfo, src, size);
 
-  jpeg_create_decompress(cinfo);
-  jpeg_mem_src(cinfo, src, size);
+  /*the source manager lives in the permanent pool, so this just points it
+    at the new jpeg */
+  sparrow_jpeg_mem_src(cinfo, src, size);
 
   jpeg_read_header(cinfo, TRUE);
-  jpeg_start_decompress(cinfo);
+  /*the colour space only takes effect if set before jpeg_start_decompress */
   cinfo->out_color_space = sparrow->jpeg_colourspace;
+  jpeg_start_decompress(cinfo);
   if (cinfo->output_width != (guint)sparrow->out.width ||
       cinfo->output_height != (guint)sparrow->out.height){
-    GST_ERROR("jpeg sizes are wrong! %dx%d, should be %dx%d.\n"
-        "Not doing anything: this is probably goodbye.\n",
+    GST_ERROR("jpeg sizes are wrong! %dx%d, should be %dx%d. Not decoding it.\n",
         cinfo->output_width, cinfo->output_height,
         sparrow->out.width, sparrow->out.height);
+    jpeg_abort_decompress(cinfo);
+    return FALSE;
   }
+  return TRUE;
 }
 
 
@@ -193,10 +208,39 @@ read_one_line(GstSparrow *sparrow, guint8* dest){
   }
 }
 
+/*read up to n lines into consecutive rows of dest, as many at a time as
+  libjpeg will give (cinfo->rec_outbuf_height). Returns the number read. */
+INVISIBLE int
+read_lines(GstSparrow *sparrow, guint8* dest, int n){
+  struct jpeg_decompress_struct *cinfo = sparrow->cinfo;
+  JSAMPROW rows[MAX_ROWS_PER_READ];
+  int stride = sparrow->out.width * PIXSIZE;
+  int done = 0;
+  while (done < n && cinfo->output_scanline < cinfo->output_height){
+    int want = MIN(n - done, MIN(cinfo->rec_outbuf_height, MAX_ROWS_PER_READ));
+    for (int i = 0; i < want; i++){
+      rows[i] = dest + (done + i) * stride;
+    }
+    done += jpeg_read_scanlines(cinfo, rows, want);
+  }
+  if (done < n){
+    GST_WARNING("wanted %d lines of jpeg, only got %d (height is %d)",
+        n, done, cinfo->output_height);
+  }
+  return done;
+}
+
+/*leaves the decompressor ready for the next jpeg. jpeg_finish_decompress
+  complains if there are unread lines, so abort in that case. */
 INVISIBLE void
 finish_reading_jpeg(GstSparrow *sparrow){
-  jpeg_finish_decompress(sparrow->cinfo);
-  jpeg_destroy_decompress(sparrow->cinfo);
+  struct jpeg_decompress_struct *cinfo = sparrow->cinfo;
+  if (cinfo->output_scanline < cinfo->output_height){
+    jpeg_abort_decompress(cinfo);
+  }
+  else {
+    jpeg_finish_decompress(cinfo);
+  }
 }
 
 
@@ -205,6 +249,7 @@ init_jpeg_src(GstSparrow *sparrow){
   sparrow->cinfo = zalloc_or_die(sizeof(struct jpeg_decompress_struct));
   struct jpeg_error_mgr *jerr = zalloc_or_die(sizeof(struct jpeg_error_mgr));
   sparrow->cinfo->err = jpeg_std_error(jerr);
+  jpeg_create_decompress(sparrow->cinfo);
   /*rshift is little-endian, jpg enums big-endian */
   switch (sparrow->out.rshift){
   case 0:
@@ -5,7 +5,7 @@ import struct
 import os, sys, re
 
 from sparrow import FRAME_STRUCTURE, INDEX_FILE, TEXT_INDEX_FILE
-from sparrow import save_frames, save_frames_text, Frame, link_frames
+from sparrow import save_frames, save_frames_text, load_frames, link_frames
 
 #            f.write(struct.pack('II48s8I',
 #                                frame.glob_index,
@@ -15,23 +15,15 @@ from sparrow import save_frames, save_frames_text, Frame, link_frames
 #                                ))
 
 
-def load_frames(filename):
-    f = open(filename)
-    structlen = struct.calcsize(FRAME_STRUCTURE)
-    frames = []
-    for i in count():
-        s = f.read(structlen)
-        if not s:
-            break
-        frame = Frame(s)
-        frame.index = i
-        frames.append(frame)
+frames, geometry = load_frames(INDEX_FILE)
+if geometry is None:
+    # an old headerless index: the geometry has to come from the command line
+    if len(sys.argv) < 4:
+        print >> sys.stderr, "old style index: use %s width height blob_size" % sys.argv[0]
+        sys.exit(1)
+    geometry = [int(x) for x in sys.argv[1:4]]
 
-    return frames
+frames = link_frames(frames)
 
-
-
-frames = link_frames(load_frames(INDEX_FILE))
-
-save_frames(frames, INDEX_FILE + '-new')
+save_frames(frames, INDEX_FILE + '-new', *geometry)
 save_frames_text(frames, TEXT_INDEX_FILE + '-new')
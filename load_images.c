@@ -25,8 +25,13 @@
 
 #include <sys/mman.h>
 
-static const char *JPEG_BLOB_NAME = "/home/douglas/sparrow/content/jpeg.blob";
-static const char *JPEG_INDEX_NAME = "/home/douglas/sparrow/content/jpeg.index";
+/*file names within the content directory (the "content" property) */
+static const char *JPEG_BLOB_NAME = "jpeg.blob";
+static const char *JPEG_INDEX_NAME = "jpeg.index";
+static const char *RAW_BLOB_NAME = "raw.blob";
+
+#define LOAD_CHUNK (16 << 20)
+#define PAGE_BYTES 4096
 
 INVISIBLE sparrow_shared_t *
 sparrow_get_shared(void){
@@ -34,56 +39,429 @@ sparrow_get_shared(void){
   return &shared;
 }
 
+/*the returned path should be g_free()d */
+static char *
+content_path(GstSparrow *sparrow, const char *name){
+  const char *dir = (sparrow->content) ? sparrow->content : DEFAULT_PROP_CONTENT;
+  return g_build_filename(dir, name, NULL);
+}
+
+/*open and mmap a whole file, or return NULL (with *length 0) */
+static void *
+map_content_file(const char *name, size_t *length, int flags){
+  *length = 0;
+  int fd = open(name, O_RDONLY);
+  if (fd == -1){
+    GST_DEBUG("can't open %s", name);
+    return NULL;
+  }
+  off_t len = lseek(fd, 0, SEEK_END);
+  void *mem = (len > 0) ? mmap(NULL, len, PROT_READ, flags, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED){
+    GST_WARNING("could not mmap %s (%zu bytes)", name, (size_t)len);
+    return NULL;
+  }
+  *length = len;
+  return mem;
+}
+
+/*map the pre-decoded frames, if they are there, cover the index, and suit
+  this output. Other instances check their own output with raw_images_suit.
+  There is no MAP_POPULATE: the file is much bigger than the jpegs, and the
+  play decoder thread touches each frame before it is needed. */
+static gboolean
+load_raw_images(GstSparrow *sparrow){
+  sparrow_format *out = &sparrow->out;
+  char *name = content_path(sparrow, RAW_BLOB_NAME);
+  size_t length;
+  guint8 *mem = map_content_file(name, &length, MAP_PRIVATE);
+  gboolean ok = FALSE;
+  if (mem == NULL){
+    goto done;
+  }
+  sparrow_raw_header_t *header = (sparrow_raw_header_t *)mem;
+  size_t frame_size = (size_t)header->width * header->height * PIXSIZE;
+  if (length < SPARROW_RAW_HEADER_SIZE ||
+      memcmp(header->magic, SPARROW_RAW_MAGIC, sizeof(header->magic))){
+    GST_WARNING("%s is not a raw image file", name);
+  }
+  else if (header->width != (guint)out->width || header->height != (guint)out->height ||
+      header->rshift != (guint)out->rshift || header->gshift != (guint)out->gshift ||
+      header->bshift != (guint)out->bshift){
+    GST_WARNING("raw images are %ux%u, shifts r%u g%u b%u; output is %ux%u, r%u g%u b%u."
+        " Using jpegs instead", header->width, header->height,
+        header->rshift, header->gshift, header->bshift,
+        out->width, out->height, out->rshift, out->gshift, out->bshift);
+  }
+  else if (header->image_count < sparrow->shared->image_count){
+    GST_WARNING("%s has %u images, but the index has %u. Using jpegs instead",
+        name, header->image_count, sparrow->shared->image_count);
+  }
+  else if (length < SPARROW_RAW_HEADER_SIZE + frame_size * header->image_count){
+    GST_WARNING("%s is truncated: %zu bytes, %u images should need %zu",
+        name, length, header->image_count,
+        SPARROW_RAW_HEADER_SIZE + frame_size * header->image_count);
+  }
+  else {
+    ok = TRUE;
+  }
+  if (ok){
+    GST_INFO("using %u raw images from %s", header->image_count, name);
+    sparrow->shared->raw_blob = mem;
+    sparrow->shared->raw_size = length;
+    sparrow->shared->raw_frames = mem + SPARROW_RAW_HEADER_SIZE;
+  }
+  else {
+    munmap(mem, length);
+  }
+ done:
+  g_free(name);
+  return ok;
+}
+
+/*whether this instance can play the raw frames: they were loaded for
+  whichever instance got to load_images first, which may have had other
+  caps */
+INVISIBLE gboolean
+raw_images_suit(GstSparrow *sparrow){
+  sparrow_shared_t *shared = sparrow->shared;
+  if (shared->raw_blob == NULL){
+    return FALSE;
+  }
+  sparrow_raw_header_t *header = (sparrow_raw_header_t *)shared->raw_blob;
+  sparrow_format *out = &sparrow->out;
+  return (header->width == (guint)out->width && header->height == (guint)out->height &&
+      header->rshift == (guint)out->rshift && header->gshift == (guint)out->gshift &&
+      header->bshift == (guint)out->bshift);
+}
+
+/*every frame has to lie within the blob, or play would wander off the end */
+static gboolean
+check_index_against_blob(sparrow_shared_t *shared, size_t blob_size){
+  for (guint32 i = 0; i < shared->image_count; i++){
+    sparrow_frame_t *frame = &shared->index[i];
+    if ((size_t)frame->offset + frame->jpeg_size > blob_size){
+      GST_ERROR("frame %u (offset %d, size %u) is beyond the end of the jpeg blob (%zu)",
+          i, frame->offset, frame->jpeg_size, blob_size);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/*Page in the jpeg blob a chunk at a time, so set_caps doesn't wait for it.
+  Calibration doesn't use the images, so normally this is finished well
+  before play mode starts. */
+
+static gpointer
+populate_images(gpointer p){
+  sparrow_shared_t *shared = (sparrow_shared_t *)p;
+  size_t size = shared->blob_size;
+  int last_report = -1;
+  guint sum = 0;
+  for (size_t start = 0; start < size; start += LOAD_CHUNK){
+    size_t len = MIN(LOAD_CHUNK, size - start);
+    guint8 *chunk = shared->jpeg_blob + start;
+    madvise(chunk, len, MADV_WILLNEED);
+    /*reading a byte per page brings it in; sum keeps the reads from being
+      optimised away */
+    for (size_t i = 0; i < len; i += PAGE_BYTES){
+      sum += ((volatile guint8 *)chunk)[i];
+    }
+    g_mutex_lock(shared->load_mutex);
+    shared->bytes_loaded = start + len;
+    gboolean stop = shared->stop_loading;
+    g_mutex_unlock(shared->load_mutex);
+    int percent = (int)((start + len) * 10 / size) * 10;
+    if (percent != last_report){
+      GST_INFO("loaded %zu of %zu MB of images (%d%%)",
+          (start + len) >> 20, size >> 20, percent);
+      last_report = percent;
+    }
+    if (stop){
+      GST_DEBUG("stopped loading images at %zu bytes", start + len);
+      break;
+    }
+  }
+  g_mutex_lock(shared->load_mutex);
+  shared->images_ready = TRUE;
+  g_cond_broadcast(shared->load_cond);
+  g_mutex_unlock(shared->load_mutex);
+  return GUINT_TO_POINTER(sum);
+}
+
+/*is this mapping small enough to read in its entirety? */
+static gboolean
+fits_in_memory(size_t size){
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0){
+    return TRUE;
+  }
+  return size < (size_t)pages * page_size / 2;
+}
+
+/*ask the kernel to start reading frame i, if it isn't already in memory.
+  raw_frames is the player's, which is NULL if this instance uses the
+  jpegs. */
+INVISIBLE void
+prefetch_frame(GstSparrow *sparrow, const guint8 *raw_frames, guint32 i){
+  sparrow_shared_t *shared = sparrow->shared;
+  const guint8 *start;
+  size_t len;
+  if (raw_frames){
+    len = sparrow->out.size;
+    start = raw_frames + (size_t)i * len;
+  }
+  else {
+    sparrow_frame_t *frame = &shared->index[i];
+    start = shared->jpeg_blob + frame->offset;
+    len = frame->jpeg_size;
+  }
+  /*madvise wants page aligned addresses */
+  guint8 *page = (guint8 *)((uintptr_t)start & ~(uintptr_t)(PAGE_BYTES - 1));
+  madvise(page, len + (start - page), MADV_WILLNEED);
+}
+
+/*The jpegs are always mapped, even when there are raw frames, because an
+  instance whose caps don't suit the raw frames falls back to them. They are
+  only paged in ahead of time if nothing is using raw frames. */
 static gpointer
 load_images(gpointer p){
   GST_DEBUG("load_images with pointer %p", p);
   GstSparrow *sparrow = (GstSparrow *)p;
-  int fd = open(JPEG_BLOB_NAME, O_RDONLY);
-  off_t length = lseek(fd, 0, SEEK_END);
-  lseek(fd, 0, SEEK_SET);
-  GST_DEBUG("about to mmap");
-  void *mem = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  sparrow_shared_t *shared = sparrow->shared;
+  shared->load_mutex = g_mutex_new();
+  shared->load_cond = g_cond_new();
+  char *name = content_path(sparrow, JPEG_BLOB_NAME);
+  size_t length;
+  GST_DEBUG("about to mmap %s", name);
+  guint8 *mem = map_content_file(name, &length, MAP_PRIVATE);
   GST_DEBUG("mmap returned %p", mem);
-  madvise(mem, length, POSIX_MADV_WILLNEED);
-  GST_DEBUG("done madvise. sparrow->shared is %p", sparrow->shared);
-  sparrow->shared->jpeg_blob = mem;
-  sparrow->shared->blob_size = length;
+  if (mem){
+    if (shared->index_header && shared->index_header->blob_size != length){
+      GST_ERROR("%s is %zu bytes, but the index says it should be %u",
+          name, length, shared->index_header->blob_size);
+      munmap(mem, length);
+      mem = NULL;
+    }
+    else if (! check_index_against_blob(shared, length)){
+      munmap(mem, length);
+      mem = NULL;
+    }
+    else {
+      shared->jpeg_blob = mem;
+      shared->blob_size = length;
+    }
+  }
+  if (mem == NULL){
+    GST_ERROR("could not load jpegs from %s", name);
+  }
+  g_free(name);
 
-  return mem;
+  if (load_raw_images(sparrow)){
+    /*the play decoder thread touches raw frames as it needs them */
+    shared->images_ready = TRUE;
+    if (! fits_in_memory(shared->raw_size)){
+      madvise(shared->raw_blob, shared->raw_size, MADV_RANDOM);
+      shared->use_prefetch = TRUE;
+    }
+    if (mem && ! fits_in_memory(length)){
+      madvise(mem, length, MADV_RANDOM);
+      shared->use_prefetch = TRUE;
+    }
+  }
+  else if (mem == NULL){
+    shared->images_ready = TRUE;
+  }
+  else if (! fits_in_memory(length)){
+    /*Reading it all would only push earlier parts out again. Instead,
+      play mode prefetches along the successor graph, so ordinary readahead
+      would mostly fetch the wrong things. */
+    GST_INFO("jpeg blob (%zu MB) is too big to preload; prefetching as needed",
+        length >> 20);
+    madvise(mem, length, MADV_RANDOM);
+    shared->use_prefetch = TRUE;
+    shared->images_ready = TRUE;
+  }
+  else {
+    shared->loader = g_thread_create(populate_images, shared, TRUE, NULL);
+    if (shared->loader == NULL){
+      GST_WARNING("could not start loader thread; images will load on demand");
+      shared->images_ready = TRUE;
+    }
+  }
+  return (shared->raw_blob) ? shared->raw_blob : mem;
 }
 
 static gpointer
 unload_images(gpointer p){
   GstSparrow *sparrow = (GstSparrow *)p;
   sparrow_shared_t *shared = sparrow->shared;
-  munmap(shared->jpeg_blob, shared->blob_size);
+  if (shared->loader){
+    g_mutex_lock(shared->load_mutex);
+    shared->stop_loading = TRUE;
+    g_mutex_unlock(shared->load_mutex);
+    g_thread_join(shared->loader);
+    shared->loader = NULL;
+  }
+  if (shared->raw_blob){
+    munmap(shared->raw_blob, shared->raw_size);
+  }
+  if (shared->jpeg_blob){
+    munmap(shared->jpeg_blob, shared->blob_size);
+  }
   return NULL;
 }
 
+/*Validate the index header, and point shared->index at the frames. An index
+  without a header (the original format) is accepted, but can't be checked
+  for geometry. */
+static gboolean
+parse_index(sparrow_shared_t *shared, guint8 *mem, size_t length, const char *name){
+  sparrow_index_header_t *header = (sparrow_index_header_t *)mem;
+  if (length >= sizeof(sparrow_index_header_t) &&
+      ! memcmp(header->magic, SPARROW_INDEX_MAGIC, sizeof(header->magic))){
+    if (header->version != SPARROW_INDEX_VERSION){
+      GST_ERROR("%s is version %u; this sparrow only knows version %u",
+          name, header->version, SPARROW_INDEX_VERSION);
+      return FALSE;
+    }
+    if (header->frame_size != sizeof(sparrow_frame_t) ||
+        header->header_size < sizeof(sparrow_index_header_t)){
+      GST_ERROR("%s has header size %u, frame size %u; expected %zu, %zu",
+          name, header->header_size, header->frame_size,
+          sizeof(sparrow_index_header_t), sizeof(sparrow_frame_t));
+      return FALSE;
+    }
+    size_t frames_size = (size_t)header->image_count * sizeof(sparrow_frame_t);
+    if (header->header_size + frames_size > length){
+      GST_ERROR("%s is truncated: %zu bytes, should be %zu", name, length,
+          header->header_size + frames_size);
+      return FALSE;
+    }
+    guint32 checksum = sparrow_adler32(mem + header->header_size, frames_size);
+    if (checksum != header->checksum){
+      GST_ERROR("%s checksum is %08x, header says %08x", name, checksum,
+          header->checksum);
+      return FALSE;
+    }
+    shared->index_header = header;
+    shared->index = (sparrow_frame_t *)(mem + header->header_size);
+    shared->image_count = header->image_count;
+  }
+  else {
+    if (length % sizeof(sparrow_frame_t)){
+      GST_ERROR("%s is neither a sparrow index nor an old style headerless one", name);
+      return FALSE;
+    }
+    GST_WARNING("%s has no header (old format?), so can't be checked", name);
+    shared->index_header = NULL;
+    shared->index = (sparrow_frame_t *)mem;
+    shared->image_count = length / sizeof(sparrow_frame_t);
+  }
+  for (guint32 i = 0; i < shared->image_count; i++){
+    for (int j = 0; j < 8; j++){
+      if ((guint32)shared->index[i].successors[j] >= shared->image_count){
+        GST_ERROR("frame %u has successor %d, but there are only %u frames",
+            i, shared->index[i].successors[j], shared->image_count);
+        return FALSE;
+      }
+    }
+  }
+  return TRUE;
+}
+
 static gpointer
 load_index(gpointer p){
   GstSparrow *sparrow = (GstSparrow *)p;
-  int fd = open(JPEG_INDEX_NAME, O_RDONLY);
-  off_t length = lseek(fd, 0, SEEK_END);
-  lseek(fd, 0, SEEK_SET);
-  void *mem = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  sparrow_shared_t *shared = sparrow->shared;
+  char *name = content_path(sparrow, JPEG_INDEX_NAME);
+  size_t length;
+  guint8 *mem = map_content_file(name, &length, MAP_PRIVATE | MAP_POPULATE);
   GST_DEBUG("mmap returned %p", mem);
-  madvise(mem, length, POSIX_MADV_WILLNEED);
-  sparrow->shared->index = mem;
-  sparrow->shared->image_count = length / sizeof(sparrow_frame_t);
-  GST_DEBUG("found %d frame info structures of size %d\n", sparrow->shared->image_count,
-      sizeof(sparrow_frame_t));
+  if (mem == NULL){
+    GST_ERROR("could not load index %s", name);
+  }
+  else if (! parse_index(shared, mem, length, name)){
+    munmap(mem, length);
+    mem = NULL;
+  }
+  else {
+    madvise(mem, length, MADV_WILLNEED);
+    shared->index_map = mem;
+    shared->index_map_size = length;
+    GST_DEBUG("found %d frame info structures of size %zu\n", shared->image_count,
+        sizeof(sparrow_frame_t));
+  }
+  g_free(name);
   return mem;
 }
 
 static gpointer
 unload_index(gpointer p){
   GstSparrow *sparrow = (GstSparrow *)p;
-  munmap(sparrow->shared->index,
-      sparrow->shared->image_count * sizeof(sparrow_frame_t));
+  sparrow_shared_t *shared = sparrow->shared;
+  if (shared->index_map){
+    munmap(shared->index_map, shared->index_map_size);
+  }
   return NULL;
 }
 
+/*The index (and images) are loaded once, for whichever instance gets there
+  first, but each instance has its own output size to check against. Returns
+  FALSE (with a warning) if play mode could not work. */
+INVISIBLE gboolean
+check_content(GstSparrow *sparrow){
+  sparrow_shared_t *shared = sparrow->shared;
+  if (shared->index == NULL || shared->image_count == 0){
+    GST_WARNING("no usable content index");
+    return FALSE;
+  }
+  sparrow_index_header_t *header = shared->index_header;
+  if (header && (header->width != (guint)sparrow->out.width ||
+          header->height != (guint)sparrow->out.height)){
+    GST_WARNING("content is %ux%u, but output is %dx%d", header->width, header->height,
+        sparrow->out.width, sparrow->out.height);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*the raw frames, if they suit this instance's caps, otherwise the jpegs */
+INVISIBLE gboolean
+check_images(GstSparrow *sparrow){
+  sparrow_shared_t *shared = sparrow->shared;
+  if (raw_images_suit(sparrow)){
+    return TRUE;
+  }
+  if (shared->raw_blob){
+    GST_WARNING("the raw frames don't suit this output (%dx%d, shifts r%d g%d b%d)."
+        " Using jpegs instead", sparrow->out.width, sparrow->out.height,
+        sparrow->out.rshift, sparrow->out.gshift, sparrow->out.bshift);
+  }
+  if (shared->jpeg_blob == NULL){
+    GST_WARNING("no usable content images");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*wait for the background loader, if it is still going. */
+INVISIBLE void
+wait_for_images(GstSparrow *sparrow){
+  sparrow_shared_t *shared = sparrow->shared;
+  g_mutex_lock(shared->load_mutex);
+  if (! shared->images_ready){
+    GST_INFO("waiting for images: %zu of %zu MB loaded",
+        shared->bytes_loaded >> 20, (size_t)shared->blob_size >> 20);
+    while (! shared->images_ready){
+      g_cond_wait(shared->load_cond, shared->load_mutex);
+    }
+  }
+  g_mutex_unlock(shared->load_mutex);
+}
 
 INVISIBLE void
 maybe_load_images(GstSparrow *sparrow)
@@ -113,4 +491,3 @@ maybe_unload_index(GstSparrow *sparrow){
   static GOnce once = G_ONCE_INIT;
   g_once(&once, unload_index, sparrow);
 }
-
@@ -22,6 +22,14 @@
 #include <string.h>
 #include <math.h>
 #include "play_core.h"
+#include "summaries.h"
+
+#if PLAY_USE_SIMD && (defined(__x86_64__) || defined(__i386__))
+#define PLAY_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define PLAY_HAVE_AVX2 0
+#endif
 
 #define one_subpixel one_subpixel_gamma_clamp_oldpix
 //#define one_subpixel one_subpixel_clamp
@@ -35,51 +43,163 @@ do_one_pixel(sparrow_play_t *player, guint8 *outpix, guint8 *inpix, guint8 *jpeg
   outpix[3] = one_subpixel(player, inpix[3], jpegpix[3], oldframe[3]);
 }
 
-static inline int
-select_jpeg_adaptive(GstSparrow *sparrow, sparrow_play_t *player){
-  /*
-  GST_DEBUG("in select_jpeg_adaptive, starting at %d", player->jpeg_index);
-  GstBuffer *oldbuf = player->old_frames[player->old_frames_tail];
-  if (! oldbuf){
-    GST_DEBUG("old buffer is not there! using random jump: %d to %d",
-        player->jpeg_index, player->jpeg_index);
-    return RANDINT(sparrow, 0, sparrow->shared->image_count);
-  }
-  guint8 *old_frame = (guint8 *)GST_BUFFER_DATA(oldbuf);
-
-  cvResize( const CvArr* src, CvArr* dst, CV_INTER_LINEAR)
-
-  int x, y;
-  guint32 summary[6 * 8 * PIXSIZE] = {0};
-  int xdiv = sparrow->out.width / 8;
-  int ydiv = sparrow->out.height / 6;
-  int y2 = 0;
-  int x2 = 0;
-  for (y2 = 0; y2 < 6; y2++){
-    for (y = y2 * ydiv; y < (y2 + 1) * ydiv; y += 4){
-      for (x2 = 0; x2 < 8; x2++){
-        for (x = x2 * xdiv; x < (x2 + 1) * xdiv; x++){
-          int i2 = y2 * 8 + x2;
-          int i = y * sparrow->out.width + x;
-
-          summary[i2 + ] += old_frame[];
-        }
-      }
+/*the reference compositor, one subpixel at a time */
+static void
+composite_span_scalar(sparrow_play_t *player, guint8 *out, guint32 *in32,
+    guint32 *lut, guint8 *jpeg, guint8 *old, int n){
+  guint32 *out32 = (guint32 *)out;
+  for (int i = 0; i < n; i++){
+    guint inpos = lut[i];
+    if (inpos){
+      do_one_pixel(player,
+          &out[i * PIXSIZE],
+          (guint8 *)&in32[inpos],
+          &jpeg[i * PIXSIZE],
+          &old[i * PIXSIZE]
+      );
+    }
+    else {
+      out32[i] = 0;
     }
+  }
+}
 
-    for (x = 0; x < sparrow->out.width; x++){
+#if PLAY_HAVE_AVX2
+/* 8 pixels at a time: the input pixels are gathered through the LUT, then each
+   byte lane goes through the same lut_f/lut_b dance as
+   one_subpixel_gamma_clamp_oldpix, using 32 bit copies of the tables. */
 
+/*one byte lane (at shift) of 8 pixels, ready to be or-ed into the result */
+static inline __m256i __attribute__((target("avx2")))
+avx2_subpixels(const int *lut_f, const int *lut_b, __m256i inpix, __m256i jpix,
+    __m256i opix, const int shift){
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i lowbyte = _mm256_set1_epi32(0xff);
+  __m256i i = _mm256_and_si256(_mm256_srli_epi32(inpix, shift), lowbyte);
+  __m256i j = _mm256_and_si256(_mm256_srli_epi32(jpix, shift), lowbyte);
+  __m256i o = _mm256_and_si256(_mm256_srli_epi32(opix, shift), lowbyte);
+  __m256i gi = _mm256_i32gather_epi32(lut_f, i, 4);
+  __m256i gj = _mm256_i32gather_epi32(lut_f, j, 4);
+  __m256i go = _mm256_i32gather_epi32(lut_f, o, 4);
+  __m256i error = _mm256_max_epi32(_mm256_sub_epi32(gi, go), zero);
+  __m256i diff = _mm256_sub_epi32(gj, error);
+  __m256i b = _mm256_i32gather_epi32(lut_b, diff, 4);
+  return _mm256_slli_epi32(b, shift);
+}
 
+static void __attribute__((target("avx2")))
+composite_span_avx2(sparrow_play_t *player, guint8 *out, guint32 *in32,
+    guint32 *lut, guint8 *jpeg, guint8 *old, int n){
+  const __m256i zero = _mm256_setzero_si256();
+  const int *lut_f = player->lut_f32;
+  /*diff can be negative, down to -(GAMMA_UNIT_LIMIT - 1) */
+  const int *lut_b = player->lut_b32 + GAMMA_TABLE_BASEMENT;
+  int i;
+  for (i = 0; i + 8 <= n; i += 8){
+    __m256i pos = _mm256_loadu_si256((__m256i *)(lut + i));
+    __m256i empty = _mm256_cmpeq_epi32(pos, zero);
+    __m256i inpix = _mm256_i32gather_epi32((const int *)in32, pos, 4);
+    __m256i jpix = _mm256_loadu_si256((__m256i *)(jpeg + i * PIXSIZE));
+    __m256i opix = _mm256_loadu_si256((__m256i *)(old + i * PIXSIZE));
+    __m256i result = zero;
+    for (int shift = 0; shift < 32; shift += 8){
+      result = _mm256_or_si256(result,
+          avx2_subpixels(lut_f, lut_b, inpix, jpix, opix, shift));
+    }
+    result = _mm256_andnot_si256(empty, result);
+    _mm256_storeu_si256((__m256i *)(out + i * PIXSIZE), result);
+  }
+  if (i < n){
+    composite_span_scalar(player, out + i * PIXSIZE, in32, lut + i,
+        jpeg + i * PIXSIZE, old + i * PIXSIZE, n - i);
+  }
+}
+#endif
 
+static void
+init_compositor(sparrow_play_t *player){
+  player->composite = composite_span_scalar;
+#if PLAY_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")){
+    player->composite = composite_span_avx2;
+    GST_INFO("using AVX2 compositor\n");
+    return;
+  }
+#endif
+  GST_INFO("using scalar compositor\n");
+}
 
-  GST_DEBUG("in select_jpeg_adaptive");
-  */
-  return RANDINT(sparrow, 0, sparrow->shared->image_count);
+/*Choose a frame that looks like the recent output: one of the nearest few
+  by summary. Runs in the decoder thread. */
+static int
+select_jpeg_adaptive(GstSparrow *sparrow, sparrow_play_t *player){
+  guint8 target[SUMMARY_SIZE];
+  guint32 best[ADAPTIVE_CANDIDATES];
+  guint32 count = sparrow->shared->image_count;
+  GST_DEBUG("in select_jpeg_adaptive, starting at %d", player->jpeg_index);
+  g_mutex_lock(player->ring_mutex);
+  gboolean have_summary = player->have_summary;
+  memcpy(target, player->out_summary, SUMMARY_SIZE);
+  g_mutex_unlock(player->ring_mutex);
+  if (! have_summary){
+    return RANDINT(sparrow, 0, count);
+  }
+  guint32 lo = (player->jpeg_index > ADAPTIVE_EXCLUDE) ?
+    player->jpeg_index - ADAPTIVE_EXCLUDE : 0;
+  int n = nearest_summaries(player->summaries, count, target,
+      lo, player->jpeg_index, best);
+  if (n == 0){
+    return RANDINT(sparrow, 0, count);
+  }
+  int next = best[RANDINT(sparrow, 0, n)];
+  GST_DEBUG("CHANGE_SHOT: adaptive: %d to %d", player->jpeg_index, next);
+  return next;
 }
 
+/*Mean luma of each of the 8x6 cells of the output, sampling every 4th pixel
+  of every 4th row (a summary doesn't need more). Runs in the streaming
+  thread. */
+static void
+summarise_output(GstSparrow *sparrow, sparrow_play_t *player, guint8 *out){
+  guint8 summary[SUMMARY_SIZE];
+  int width = sparrow->out.width;
+  int height = sparrow->out.height;
+  guint32 *pixels = (guint32 *)out;
+  int rs = sparrow->out.rshift;
+  int gs = sparrow->out.gshift;
+  int bs = sparrow->out.bshift;
+  for (int cy = 0; cy < SUMMARY_H; cy++){
+    int y0 = cy * height / SUMMARY_H;
+    int y1 = (cy + 1) * height / SUMMARY_H;
+    for (int cx = 0; cx < SUMMARY_W; cx++){
+      int x0 = cx * width / SUMMARY_W;
+      int x1 = (cx + 1) * width / SUMMARY_W;
+      guint sum = 0;
+      guint n = 0;
+      for (int y = y0; y < y1; y += 4){
+        guint32 *row = pixels + y * width;
+        for (int x = x0; x < x1; x += 4){
+          guint32 p = row[x];
+          /*ITU-R 601 luma, as jpeg greyscale uses*/
+          sum += (77 * ((p >> rs) & 255) + 150 * ((p >> gs) & 255) +
+              29 * ((p >> bs) & 255)) >> 8;
+          n++;
+        }
+      }
+      summary[cy * SUMMARY_W + cx] = (n) ? sum / n : 0;
+    }
+  }
+  g_mutex_lock(player->ring_mutex);
+  memcpy(player->out_summary, summary, SUMMARY_SIZE);
+  player->have_summary = TRUE;
+  g_mutex_unlock(player->ring_mutex);
+}
 
+/*choose the frame to follow player->jpeg_index. This runs in the decoder
+  thread, which is the only user of the RNG in play mode. */
 static void
-set_up_jpeg(GstSparrow *sparrow, sparrow_play_t *player){
+choose_next_jpeg(GstSparrow *sparrow, sparrow_play_t *player){
   /*XXX pick a jpeg, somehow*/
   /*first, chance of random jump anywhere. */
   if (rng_uniform(sparrow) < 1.0 / 500){
@@ -101,48 +221,201 @@ set_up_jpeg(GstSparrow *sparrow, sparrow_play_t *player){
     }
     player->jpeg_index = next;
   }
+}
+
+static gboolean
+recently_prefetched(sparrow_play_t *player, guint32 i){
+  for (int j = 0; j < PREFETCH_MEMORY; j++){
+    if (player->prefetched[j] == i){
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static inline gboolean
+has_successors(const sparrow_frame_t *frame){
+  for (int j = 0; j < 8; j++){
+    if (frame->successors[j]){
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
 
+/*Walk the successor graph from the frame just chosen, breadth first so the
+  nearest frames are asked for first. A frame with successors[0] set can
+  only continue its sequence (barring the rare random jump); otherwise any
+  of successors[1-7] could be next. */
+static void
+prefetch_successors(GstSparrow *sparrow, sparrow_play_t *player){
+  sparrow_frame_t *index = sparrow->shared->index;
+  guint32 queue[PREFETCH_MAX_FRAMES];
+  guint8 depth[PREFETCH_MAX_FRAMES];
+  int head = 0;
+  int tail = 1;
+  queue[0] = player->jpeg_index;
+  depth[0] = 0;
+  while (head < tail){
+    guint32 f = queue[head];
+    int d = depth[head];
+    head++;
+    /*depth 0 is being decoded right now */
+    if (d && ! recently_prefetched(player, f)){
+      prefetch_frame(sparrow, player->raw_frames, f);
+      player->prefetched[player->prefetched_head] = f;
+      player->prefetched_head = (player->prefetched_head + 1) % PREFETCH_MEMORY;
+    }
+    if (d == PREFETCH_DEPTH){
+      continue;
+    }
+    sparrow_frame_t *frame = &index[f];
+    if (! has_successors(frame)){
+      /*unlinked content: the only way on is a random or adaptive jump, and
+        following the zeros would just fetch frame 0 */
+      continue;
+    }
+    int first = (frame->successors[0]) ? 0 : 1;
+    int last = (frame->successors[0]) ? 1 : 8;
+    for (int j = first; j < last && tail < PREFETCH_MAX_FRAMES; j++){
+      guint32 next = frame->successors[j];
+      int k;
+      for (k = 0; k < tail && queue[k] != next; k++);
+      if (k == tail){
+        queue[tail] = next;
+        depth[tail] = d + 1;
+        tail++;
+      }
+    }
+  }
+}
+
+static void
+decode_jpeg(GstSparrow *sparrow, sparrow_play_t *player, guint8 *dest){
   sparrow_frame_t *frame = &sparrow->shared->index[player->jpeg_index];
   guint8 *src = sparrow->shared->jpeg_blob + frame->offset;
   guint size = frame->jpeg_size;
   GST_DEBUG("blob is %p, offset %d, src %p, size %d\n",
       sparrow->shared->jpeg_blob, frame->offset, src, size);
 
-  begin_reading_jpeg(sparrow, src, size);
+  if (! begin_reading_jpeg(sparrow, src, size)){
+    /*the wrong size: show black rather than overrun the slot */
+    memset(dest, 0, sparrow->out.size);
+    return;
+  }
+  read_lines(sparrow, dest, sparrow->out.height);
+  finish_reading_jpeg(sparrow);
+}
+
+/*with raw frames there is nothing to decode: the ring slot points straight
+  into the mmap. Reading a byte per page faults it in now, on this thread,
+  rather than in the middle of compositing. */
+static guint8 *
+fetch_raw(GstSparrow *sparrow, sparrow_play_t *player){
+  guint8 *frame = player->raw_frames + (size_t)player->jpeg_index * sparrow->out.size;
+  volatile guint8 *p = frame;
+  guint sum = 0;
+  for (guint i = 0; i < sparrow->out.size; i += 4096){
+    sum += p[i];
+  }
+  return frame;
+}
+
+/* The decoder thread keeps the ring of decoded frames full, following the
+   successor choices ahead of the frame being shown.  mode_play only ever
+   reads finished frames, so a slow jpeg is absorbed by the ring rather than
+   dropping a frame.
+*/
+static gpointer
+decode_ahead(gpointer p){
+  GstSparrow *sparrow = (GstSparrow *)p;
+  sparrow_play_t *player = sparrow->helper_struct;
+  GST_DEBUG("decoder thread starting\n");
+  while (1){
+    g_mutex_lock(player->ring_mutex);
+    while (player->ring_count == DECODE_AHEAD && ! player->stop_decoder){
+      g_cond_wait(player->ring_cond, player->ring_mutex);
+    }
+    if (player->stop_decoder){
+      g_mutex_unlock(player->ring_mutex);
+      break;
+    }
+    int slot = player->ring_head;
+    g_mutex_unlock(player->ring_mutex);
+
+    choose_next_jpeg(sparrow, player);
+    if (sparrow->shared->use_prefetch){
+      prefetch_successors(sparrow, player);
+    }
+    if (player->raw_frames){
+      player->ring[slot] = fetch_raw(sparrow, player);
+    }
+    else {
+      decode_jpeg(sparrow, player, player->ring[slot]);
+    }
+
+    g_mutex_lock(player->ring_mutex);
+    player->ring_head = (slot + 1) % DECODE_AHEAD;
+    player->ring_count++;
+    g_cond_broadcast(player->ring_cond);
+    g_mutex_unlock(player->ring_mutex);
+  }
+  GST_DEBUG("decoder thread stopping\n");
+  return NULL;
+}
+
+/*wait for the next decoded frame. It stays in the ring until release_jpeg()*/
+static guint8 *
+take_jpeg(sparrow_play_t *player){
+  g_mutex_lock(player->ring_mutex);
+  if (player->ring_count == 0){
+    GST_DEBUG("waiting for decoder\n");
+    while (player->ring_count == 0){
+      g_cond_wait(player->ring_cond, player->ring_mutex);
+    }
+  }
+  guint8 *frame = player->ring[player->ring_tail];
+  g_mutex_unlock(player->ring_mutex);
+  return frame;
+}
+
+static void
+release_jpeg(sparrow_play_t *player){
+  g_mutex_lock(player->ring_mutex);
+  player->ring_tail = (player->ring_tail + 1) % DECODE_AHEAD;
+  player->ring_count--;
+  g_cond_broadcast(player->ring_cond);
+  g_mutex_unlock(player->ring_mutex);
+}
+
+/*composite output rows [start, end) -- called from the worker bands */
+static void
+play_band(GstSparrow *sparrow, void *data, int start, int end){
+  sparrow_play_t *player = sparrow->helper_struct;
+  sparrow_play_frame_t *frame = (sparrow_play_frame_t *)data;
+  int width = sparrow->out.width;
+  guint stride = width * PIXSIZE;
+  player->composite(player,
+      frame->out + start * stride,
+      frame->in32,
+      sparrow->map_lut + start * width,
+      frame->jpeg + start * stride,
+      frame->old + start * stride,
+      (end - start) * width);
 }
 
 static void
 play_from_full_lut(GstSparrow *sparrow, guint8 *in, guint8 *out){
   sparrow_play_t *player = sparrow->helper_struct;
-  guint i;
-  int ox, oy;
-  guint32 *out32 = (guint32 *)out;
-  guint32 *in32 = (guint32 *)in;
   GstBuffer *oldbuf = player->old_frames[player->old_frames_tail];
-  guint8 *old_frame = (oldbuf) ? (guint8 *)GST_BUFFER_DATA(oldbuf) : out;
-
-  set_up_jpeg(sparrow, player);
-
-  guint8 *jpeg_row = player->image_row;
-  i = 0;
-  for (oy = 0; oy < sparrow->out.height; oy++){
-    read_one_line(sparrow, jpeg_row);
-    for (ox = 0; ox < sparrow->out.width; ox++, i++){
-      guint inpos = sparrow->map_lut[i];
-      if (inpos){
-        do_one_pixel(player,
-            &out[i * PIXSIZE],
-            (guint8 *)&in32[inpos],
-            &jpeg_row[ox * PIXSIZE],
-            &old_frame[i * PIXSIZE]
-        );
-      }
-      else {
-        out32[i] = 0;
-      }
-    }
-  }
-  finish_reading_jpeg(sparrow);
+  sparrow_play_frame_t frame;
+  frame.in32 = (guint32 *)in;
+  frame.out = out;
+  frame.old = (oldbuf) ? (guint8 *)GST_BUFFER_DATA(oldbuf) : out;
+  frame.jpeg = take_jpeg(player);
+
+  sparrow_run_bands(sparrow, play_band, &frame, sparrow->out.height);
+  release_jpeg(player);
 
   if (DEBUG_PLAY && sparrow->debug){
     debug_frame(sparrow, out, sparrow->out.width, sparrow->out.height, PIXSIZE);
@@ -152,6 +425,11 @@ play_from_full_lut(GstSparrow *sparrow, guint8 *in, guint8 *out){
 static void
 store_old_frame(GstSparrow *sparrow, GstBuffer *outbuf){
   sparrow_play_t *player = sparrow->helper_struct;
+  GstBuffer *stale = player->old_frames[player->old_frames_head];
+  if (stale){
+    /*only after the lag has shortened */
+    gst_buffer_unref(stale);
+  }
   player->old_frames[player->old_frames_head] = outbuf;
   gst_buffer_ref(outbuf);
   player->old_frames_head++;
@@ -164,11 +442,136 @@ drop_old_frame(GstSparrow *sparrow, GstBuffer *outbuf){
   GstBuffer *tail = player->old_frames[player->old_frames_tail];
   if (tail){
     gst_buffer_unref(tail);
+    player->old_frames[player->old_frames_tail] = NULL;
   }
   player->old_frames_tail++;
   player->old_frames_tail %= OLD_FRAMES;
 }
 
+/*The camera frame at t shows the output from `late` frames before, so that
+  is the old frame composited with it: between frames the store (head) runs
+  late ahead of the read (tail). Moving the head changes the lag: shorter
+  skips frames already stored (store_old_frame drops them); longer leaves
+  gaps, which play like the start of play mode. sparrow->lag is kept as
+  find_self measures it, one less. */
+static void
+set_play_lag(GstSparrow *sparrow, sparrow_play_t *player, int late){
+  late = CLAMP(late, 1, OLD_FRAMES - 1);
+  player->lag = late;
+  player->old_frames_head = (player->old_frames_tail + late) % OLD_FRAMES;
+  sparrow->lag = late - 1;
+}
+
+/*sample points: every LAG_TRACK_STEP pixels of output that the LUT maps to
+  the camera */
+static void
+init_lag_tracking(GstSparrow *sparrow, sparrow_play_t *player){
+  int width = sparrow->out.width;
+  int height = sparrow->out.height;
+  int n = 0;
+  int max = ((width + LAG_TRACK_STEP - 1) / LAG_TRACK_STEP) *
+    ((height + LAG_TRACK_STEP - 1) / LAG_TRACK_STEP);
+  player->track_out_pos = malloc_or_die(max * sizeof(guint32));
+  player->track_in_pos = malloc_or_die(max * sizeof(guint32));
+  for (int y = LAG_TRACK_STEP / 2; y < height; y += LAG_TRACK_STEP){
+    for (int x = LAG_TRACK_STEP / 2; x < width; x += LAG_TRACK_STEP){
+      guint32 i = y * width + x;
+      if (sparrow->map_lut[i]){
+        player->track_out_pos[n] = i;
+        player->track_in_pos[n] = sparrow->map_lut[i];
+        n++;
+      }
+    }
+  }
+  player->track_n = n;
+  for (int i = 0; i < LAG_TRACK_HISTORY; i++){
+    player->track_out[i] = zalloc_or_die(MAX(n, 1));
+  }
+  player->track_in = zalloc_or_die(MAX(n, 1));
+  GST_DEBUG("tracking lag at %d points\n", n);
+}
+
+static void
+finalise_lag_tracking(sparrow_play_t *player){
+  for (int i = 0; i < LAG_TRACK_HISTORY; i++){
+    free(player->track_out[i]);
+  }
+  free(player->track_in);
+  free(player->track_out_pos);
+  free(player->track_in_pos);
+}
+
+/*start with the calibrated lag: the camera is one frame later than
+  sparrow->lag */
+static void
+init_play_lag(GstSparrow *sparrow, sparrow_play_t *player){
+  if (sparrow->lag + 1 > OLD_FRAMES - 1){
+    GST_WARNING("the camera is %u frames late, but play can only allow for %d\n",
+        sparrow->lag + 1, OLD_FRAMES - 1);
+  }
+  set_play_lag(sparrow, player, sparrow->lag + 1);
+  GST_INFO("using old frame lag of %d\n", player->lag);
+  if (sparrow->track_lag){
+    init_lag_tracking(sparrow, player);
+  }
+}
+
+/*Correlate the camera's change since the last frame with the output's change
+  L frames earlier, for each lag L play can use. The camera is sampled where
+  the LUT says it sees each output point. Without the track-lag property
+  there are no sample points, and the lag stays as calibrated. */
+static void
+track_lag(GstSparrow *sparrow, sparrow_play_t *player, guint8 *in, guint8 *out){
+  int n = player->track_n;
+  if (n == 0){
+    return;
+  }
+  guint32 *in32 = (guint32 *)in;
+  guint32 *out32 = (guint32 *)out;
+  int igs = sparrow->in.gshift;
+  int ogs = sparrow->out.gshift;
+  guint t = player->frame_count;
+  guint8 *now = player->track_out[t % LAG_TRACK_HISTORY];
+  for (int i = 0; i < n; i++){
+    now[i] = (out32[player->track_out_pos[i]] >> ogs) & 255;
+  }
+  gint64 sums[OLD_FRAMES] = {0};
+  guint8 *cam_prev = player->track_in;
+  for (int i = 0; i < n; i++){
+    guint8 cam = (in32[player->track_in_pos[i]] >> igs) & 255;
+    int dc = cam - cam_prev[i];
+    cam_prev[i] = cam;
+    if (dc == 0){
+      continue;
+    }
+    for (int L = 1; L < OLD_FRAMES; L++){
+      guint8 *a = player->track_out[(t + LAG_TRACK_HISTORY - L) % LAG_TRACK_HISTORY];
+      guint8 *b = player->track_out[(t + LAG_TRACK_HISTORY - L - 1) % LAG_TRACK_HISTORY];
+      sums[L] += dc * (a[i] - b[i]);
+    }
+  }
+  if (t < LAG_TRACK_HISTORY){
+    /*the history isn't full yet */
+    return;
+  }
+  int best = 1;
+  for (int L = 1; L < OLD_FRAMES; L++){
+    player->track_score[L] = player->track_score[L] * LAG_TRACK_DECAY +
+      (double)sums[L] / n;
+    if (player->track_score[L] > player->track_score[best]){
+      best = L;
+    }
+  }
+  if (t % LAG_TRACK_INTERVAL == 0){
+    double current = player->track_score[player->lag];
+    if (best != player->lag && player->track_score[best] > 0 &&
+        player->track_score[best] > current * LAG_TRACK_MARGIN){
+      GST_INFO("camera now %d frames late, not %d (score %g vs %g)\n",
+          best, player->lag, player->track_score[best], current);
+      set_play_lag(sparrow, player, best);
+    }
+  }
+}
 
 INVISIBLE sparrow_state
 mode_play(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
@@ -176,7 +579,13 @@ mode_play(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf){
   guint8 *out = GST_BUFFER_DATA(outbuf);
   store_old_frame(sparrow, outbuf);
   play_from_full_lut(sparrow, in, out);
+  sparrow_play_t *player = sparrow->helper_struct;
+  if (player->frame_count % SUMMARY_INTERVAL == 0){
+    summarise_output(sparrow, player, out);
+  }
   drop_old_frame(sparrow, outbuf);
+  track_lag(sparrow, player, in, out);
+  player->frame_count++;
   return SPARROW_STATUS_QUO;
 }
 
@@ -212,20 +621,83 @@ init_gamma_lut(sparrow_play_t *player){
   for (int i = GAMMA_UNIT_LIMIT; i < GAMMA_TABLE_TOP; i++){
     player->lut_b[i] = 255;
   }
+  /*widened copies for the vector compositor. lut_b_basement is included, so
+    negative indices work the same way.*/
+  for (int i = 0; i < 256; i++){
+    player->lut_f32[i] = player->lut_f[i];
+  }
+  for (int i = 0; i < GAMMA_TABLE_BASEMENT; i++){
+    player->lut_b32[i] = player->lut_b_basement[i];
+  }
+  for (int i = 0; i < GAMMA_TABLE_TOP; i++){
+    player->lut_b32[GAMMA_TABLE_BASEMENT + i] = player->lut_b[i];
+  }
 }
 
 INVISIBLE void init_play(GstSparrow *sparrow){
   GST_DEBUG("starting play mode\n");
+  /*calibration can go without content, but play can't */
+  if (! (check_content(sparrow) && check_images(sparrow))){
+    GST_ERROR("no content to play (see the content property). Giving up.\n");
+    exit(1);
+  }
+  /*the images load in the background during calibration */
+  wait_for_images(sparrow);
   init_jpeg_src(sparrow);
   sparrow_play_t *player = zalloc_aligned_or_die(sizeof(sparrow_play_t));
-  player->image_row = zalloc_aligned_or_die(sparrow->out.width * PIXSIZE);
-  player->old_frames_head = MIN(sparrow->lag, OLD_FRAMES - 1) || 1;
-  GST_INFO("using old frame lag of %d\n", player->old_frames_head);
+  sparrow_shared_t *shared = sparrow->shared;
+  /*load_raw_images made sure there are enough raw frames for the index */
+  if (raw_images_suit(sparrow)){
+    player->raw_frames = shared->raw_frames;
+    GST_INFO("playing pre-decoded frames\n");
+  }
+  if (! player->raw_frames){
+    for (int i = 0; i < DECODE_AHEAD; i++){
+      player->ring[i] = zalloc_aligned_or_die(sparrow->out.size);
+    }
+  }
+  for (int i = 0; i < PREFETCH_MEMORY; i++){
+    player->prefetched[i] = (guint32)-1;
+  }
+  /*the summaries are spread through the index at 88 byte intervals; packing
+    them together makes the adaptive scan a single sweep of memory */
+  player->summaries = malloc_aligned_or_die(shared->image_count * SUMMARY_SIZE);
+  for (guint32 i = 0; i < shared->image_count; i++){
+    memcpy(player->summaries + i * SUMMARY_SIZE, shared->index[i].summary, SUMMARY_SIZE);
+  }
+  player->ring_mutex = g_mutex_new();
+  player->ring_cond = g_cond_new();
+  init_play_lag(sparrow, player);
   sparrow->helper_struct = player;
   init_gamma_lut(player);
+  init_compositor(player);
+  player->decoder = g_thread_create(decode_ahead, sparrow, TRUE, NULL);
   GST_DEBUG("finished init_play\n");
 }
 
 INVISIBLE void finalise_play(GstSparrow *sparrow){
   GST_DEBUG("leaving play mode\n");
+  sparrow_play_t *player = sparrow->helper_struct;
+  g_mutex_lock(player->ring_mutex);
+  player->stop_decoder = TRUE;
+  g_cond_broadcast(player->ring_cond);
+  g_mutex_unlock(player->ring_mutex);
+  g_thread_join(player->decoder);
+  for (int i = 0; i < OLD_FRAMES; i++){
+    if (player->old_frames[i]){
+      gst_buffer_unref(player->old_frames[i]);
+    }
+  }
+  if (! player->raw_frames){
+    for (int i = 0; i < DECODE_AHEAD; i++){
+      free(player->ring[i]);
+    }
+  }
+  free(player->summaries);
+  finalise_lag_tracking(player);
+  g_mutex_free(player->ring_mutex);
+  g_cond_free(player->ring_cond);
+  finalise_jpeg_src(sparrow);
+  free(player);
+  sparrow->helper_struct = NULL;
 }
@@ -1,10 +1,48 @@
+#ifndef __SPARROW_PLAY_CORE_H__
+#define __SPARROW_PLAY_CORE_H__
 #include "sparrow.h"
 #include "gstsparrow.h"
 #include <string.h>
 #include <math.h>
 
 #define DEBUG_PLAY 0
+/*use vector compositing where the CPU allows (set to 0 for the scalar
+  reference path) */
+#define PLAY_USE_SIMD 1
 #define OLD_FRAMES 4
+/*number of decoded frames the decoder thread can get ahead by */
+#define DECODE_AHEAD 3
+/*when the content is too big for memory, ask for frames this many steps
+  ahead on every possible path (but no more than PREFETCH_MAX_FRAMES) */
+#define PREFETCH_DEPTH 6
+#define PREFETCH_MAX_FRAMES 48
+#define PREFETCH_MEMORY 128
+
+/*adaptive shot selection compares an 8x6 greyscale summary of the output
+  with each frame's summary (as made by prepare_images.py) */
+#define SUMMARY_W 8
+#define SUMMARY_H 6
+#define SUMMARY_SIZE (SUMMARY_W * SUMMARY_H)
+/*the output is summarised every SUMMARY_INTERVAL frames */
+#define SUMMARY_INTERVAL 4
+/*pick randomly among the this many nearest frames */
+#define ADAPTIVE_CANDIDATES 8
+/*don't choose frames this close before the current one (probably the same
+  shot, which looks the most like the output) */
+#define ADAPTIVE_EXCLUDE 50
+
+/*The lag is tracked during play by correlating changes in the output with
+  changes in the camera, at output pixels LAG_TRACK_STEP apart (those the LUT
+  maps to the camera). Each candidate lag that play can use (1 to
+  OLD_FRAMES - 1 frames late) keeps a decaying score; every
+  LAG_TRACK_INTERVAL frames the best replaces the current lag if it beats it
+  by LAG_TRACK_MARGIN. Scoring a lag of L needs the output from L + 1 frames
+  back. */
+#define LAG_TRACK_STEP 16
+#define LAG_TRACK_HISTORY (OLD_FRAMES + 1)
+#define LAG_TRACK_INTERVAL 25
+#define LAG_TRACK_DECAY 0.98
+#define LAG_TRACK_MARGIN 1.5
 
 static const double GAMMA = 2.0;
 static const double INV_GAMMA = 1.0 / 2.0;
@@ -14,16 +52,68 @@ static const double INV_GAMMA = 1.0 / 2.0;
 #define GAMMA_TABLE_BASEMENT 1024
 #define GAMMA_FLOOR -64
 
-typedef struct sparrow_play_s{
+typedef struct sparrow_play_s sparrow_play_t;
+
+/*composite n output pixels: out, jpeg and old are PIXSIZE per pixel, lut
+  indexes in32 */
+typedef void (*sparrow_composite_func)(sparrow_play_t *player, guint8 *out, guint32 *in32,
+    guint32 *lut, guint8 *jpeg, guint8 *old, int n);
+
+struct sparrow_play_s{
   guint16 lut_f[256];
   guint8 lut_b_basement[GAMMA_TABLE_BASEMENT]; /*rather than if x < 0 return 0 */
   guint8 lut_b[GAMMA_TABLE_TOP];
-  guint8 *image_row;
+  /*32 bit copies of the above, for vector gathers */
+  gint32 lut_f32[256];
+  gint32 lut_b32[GAMMA_TABLE_BASEMENT + GAMMA_TABLE_TOP];
+  sparrow_composite_func composite;
+  /*ring of decoded frames, filled by the decoder thread */
+  guint8 *ring[DECODE_AHEAD];
+  /*pre-decoded frames (in the shared mmap), or NULL to decode jpegs. If set,
+    the ring points into it rather than to buffers of its own. */
+  guint8 *raw_frames;
+  int ring_head;
+  int ring_tail;
+  int ring_count;
+  GMutex *ring_mutex;
+  GCond *ring_cond;
+  GThread *decoder;
+  gboolean stop_decoder;
   guint jpeg_index;
+  /*frames recently prefetched, to avoid asking twice */
+  guint32 prefetched[PREFETCH_MEMORY];
+  int prefetched_head;
+  /*all the frame summaries, packed together for scanning */
+  guint8 *summaries;
+  /*summary of recent output, written under ring_mutex */
+  guint8 out_summary[SUMMARY_SIZE];
+  gboolean have_summary;
+  guint frame_count;
   GstBuffer *old_frames[OLD_FRAMES];
   int old_frames_head;
   int old_frames_tail;
-} sparrow_play_t;
+  /*how many frames late the camera is, which is how far back the old frame
+    is: one more than sparrow->lag (as find_self measures it) */
+  int lag;
+  /*live lag tracking: output and camera positions of the sample points, the
+    last LAG_TRACK_HISTORY outputs at them, the last camera frame, and the
+    score for each lag (0 is never a candidate) */
+  guint32 *track_out_pos;
+  guint32 *track_in_pos;
+  int track_n;
+  guint8 *track_out[LAG_TRACK_HISTORY];
+  guint8 *track_in;
+  double track_score[OLD_FRAMES];
+};
+
+
+/*pointers for the frame being composited, shared by the bands */
+typedef struct sparrow_play_frame_s {
+  guint32 *in32;
+  guint8 *out;
+  guint8 *old;
+  guint8 *jpeg;
+} sparrow_play_frame_t;
 
 
 #define SUBPIXEL(x) static inline guint8 one_subpixel_##x                   \
@@ -154,4 +244,4 @@ SUBPIXEL(mess){
   return diff;
 }
 
-
+#endif
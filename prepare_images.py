@@ -5,6 +5,7 @@ import subprocess
 import array
 import struct
 import Image
+from cStringIO import StringIO
 from itertools import count
 
 from sparrow import FRAME_STRUCTURE, INDEX_FILE, TEXT_INDEX_FILE, BLOB_NAME
@@ -50,12 +51,21 @@ def process_dir(dirname, blobname=BLOB_NAME):
 
     seq_id = None
     frame_counter = count()
+    size = None
     for fn in files:
         f = open(os.path.join(dirname, fn))
         jpeg = f.read()
         f.close()
         jpegblob.write(jpeg)
 
+        # the index records the geometry, so every frame has to match
+        im_size = Image.open(StringIO(jpeg)).size
+        if size is None:
+            size = im_size
+        elif im_size != size:
+            raise ValueError("%s is %sx%s, not %sx%s like the others" %
+                             ((fn,) + im_size + size))
+
         frame = Frame()
         frame.index = frame_counter.next()
         frame.glob_index = glob_index
@@ -75,12 +85,15 @@ def process_dir(dirname, blobname=BLOB_NAME):
         glob_index += len(jpeg)
 
 
-    save_frames(frames, INDEX_FILE + '-prelink')
+    jpegblob.close()
+    width, height = size
+
+    save_frames(frames, INDEX_FILE + '-prelink', width, height, glob_index)
     save_frames_text(frames, TEXT_INDEX_FILE + '-prelink')
 
     link_frames(frames)
 
-    save_frames(frames, INDEX_FILE)
+    save_frames(frames, INDEX_FILE, width, height, glob_index)
     save_frames_text(frames, TEXT_INDEX_FILE)
 
 
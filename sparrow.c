@@ -18,9 +18,11 @@
 
 #include "sparrow.h"
 #include "gstsparrow.h"
+#include "bitmask.h"
 
 #include <string.h>
 #include <math.h>
+#include <sys/mman.h>
 
 /* static functions (via `make cproto`) */
 static void change_state(GstSparrow *sparrow, sparrow_state state);
@@ -176,11 +178,17 @@ sparrow_init(GstSparrow *sparrow, GstCaps *incaps, GstCaps *outcaps){
   sparrow_format *in = &(sparrow->in);
 
   sparrow->shared = sparrow_get_shared();
-  maybe_load_images(sparrow);
+  /*the index says what the content should look like, so check it before
+    loading the (much bigger) images. Calibration doesn't need content, so
+    it is only fatal when play starts (init_play). */
   maybe_load_index(sparrow);
+  if (check_content(sparrow)){
+    maybe_load_images(sparrow);
+    check_images(sparrow);
+  }
 
   sparrow->dsfmt = zalloc_aligned_or_die(sizeof(dsfmt_t));
-  sparrow->screenmask = malloc_aligned_or_die(in->pixcount);
+  bitmask_init(&sparrow->screenmask, in->width, in->height);
 
   size_t lutsize = sizeof(guint32) * sparrow->out.pixcount;
   sparrow->map_lut = zalloc_aligned_or_die(lutsize);
@@ -189,6 +197,7 @@ sparrow_init(GstSparrow *sparrow, GstCaps *incaps, GstCaps *outcaps){
   sparrow->timer_stop.tv_sec = 0;
 
   rng_init(sparrow, sparrow->rng_seed);
+  init_threads(sparrow);
 
   if (sparrow->debug){
     init_debug(sparrow);
@@ -202,7 +211,7 @@ sparrow_init(GstSparrow *sparrow, GstCaps *incaps, GstCaps *outcaps){
   sparrow->timer_log = (sparrow->use_timer) ? fopen(TIMER_LOG_FILE, "w") : NULL;
 
   if(sparrow->reload){
-    change_state(sparrow, SPARROW_FIND_EDGES);
+    change_state(sparrow, reload_calibration(sparrow, sparrow->reload));
   }
   else {
     change_state(sparrow, SPARROW_NEXT_STATE);
@@ -213,16 +222,27 @@ sparrow_init(GstSparrow *sparrow, GstCaps *incaps, GstCaps *outcaps){
 void INVISIBLE
 sparrow_finalise(GstSparrow *sparrow)
 {
+  /*play mode has a decoder thread that needs stopping */
+  if (sparrow->state == SPARROW_PLAY){
+    finalise_play(sparrow);
+  }
   free(sparrow->dsfmt);
-  free(sparrow->screenmask);
+  bitmask_free(&sparrow->screenmask);
 #if ! USE_FULL_LUT
   free(sparrow->map.point_mem);
   free(sparrow->map.rows);
 #else
-  free(sparrow->map_lut);
+  if (sparrow->calibration_map){
+    munmap(sparrow->calibration_map, sparrow->calibration_size);
+  }
+  else {
+    free(sparrow->map_lut);
+  }
 #endif
 
 
+  finalise_threads(sparrow);
+
   if (sparrow->timer_log){
     fclose(sparrow->timer_log);
   }
@@ -31,6 +31,7 @@ INVISIBLE void finalise_find_self(GstSparrow *sparrow);
 INVISIBLE void init_find_edges(GstSparrow *sparrow);
 INVISIBLE sparrow_state mode_find_edges(GstSparrow *sparrow, GstBuffer *inbuf, GstBuffer *outbuf);
 INVISIBLE void finalise_find_edges(GstSparrow *sparrow);
+INVISIBLE sparrow_state reload_calibration(GstSparrow *sparrow, const char *filename);
 
 /* floodfill.c */
 INVISIBLE void init_find_screen(GstSparrow *sparrow);
@@ -55,20 +56,34 @@ INVISIBLE void pgm_dump(guint8 *data, guint32 width, guint32 height, const char
 /* jpeg_src.c */
 INVISIBLE void decompress_buffer(struct jpeg_decompress_struct *cinfo, guint8 *src,
     int size, guint8 *dest, int *width, int *height);
-INVISIBLE void begin_reading_jpeg(GstSparrow *sparrow, guint8* src, int size);
+INVISIBLE gboolean begin_reading_jpeg(GstSparrow *sparrow, guint8* src, int size);
 INVISIBLE void read_one_line(GstSparrow *sparrow, guint8* dest);
+INVISIBLE int read_lines(GstSparrow *sparrow, guint8* dest, int n);
 INVISIBLE void finish_reading_jpeg(GstSparrow *sparrow);
 INVISIBLE void init_jpeg_src(GstSparrow *sparrow);
 INVISIBLE void finalise_jpeg_src(GstSparrow *sparrow);
 
 
 
+/* threads.c */
+#define SPARROW_MAX_THREADS 32
+typedef void (*sparrow_band_func)(GstSparrow *sparrow, void *data, int start, int end);
+INVISIBLE int sparrow_cpu_count(void);
+INVISIBLE void sparrow_run_bands(GstSparrow *sparrow, sparrow_band_func func, void *data, int n);
+INVISIBLE void init_threads(GstSparrow *sparrow);
+INVISIBLE void finalise_threads(GstSparrow *sparrow);
+
 /*load_images.c */
 INVISIBLE sparrow_shared_t * sparrow_get_shared(void);
 INVISIBLE void maybe_load_images(GstSparrow *sparrow);
+INVISIBLE void wait_for_images(GstSparrow *sparrow);
+INVISIBLE void prefetch_frame(GstSparrow *sparrow, const guint8 *raw_frames, guint32 i);
 INVISIBLE void maybe_unload_images(GstSparrow *sparrow);
 INVISIBLE void maybe_load_index(GstSparrow *sparrow);
 INVISIBLE void maybe_unload_index(GstSparrow *sparrow);
+INVISIBLE gboolean check_content(GstSparrow *sparrow);
+INVISIBLE gboolean check_images(GstSparrow *sparrow);
+INVISIBLE gboolean raw_images_suit(GstSparrow *sparrow);
 
 
 #define SPARROW_CALIBRATE_ON  1
@@ -179,6 +194,23 @@ popcount64(guint64 x64)
   return (x + y) & 0x000000FF;
 }
 
+/*as in zlib, so python can use zlib.adler32() (for the content index) */
+static inline UNUSED guint32
+sparrow_adler32(const guint8 *data, size_t len){
+  guint32 a = 1, b = 0;
+  while (len){
+    size_t n = MIN(len, 5552); /*largest n that can't overflow b */
+    len -= n;
+    for (size_t i = 0; i < n; i++){
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
 static inline guint32
 hamming_distance64(guint64 a, guint64 b, guint64 mask){
   a &= mask;
@@ -211,6 +243,4 @@ init_ipl_image(sparrow_format *dim, int channels){
   return cvInitImageHeader(im, size, IPL_DEPTH_8U, channels, 0, 8);
 }
 
-#define SPARROW_IMAGE_DIR "/home/douglas/sparrow/content/jpg"
-
 #endif /* __SPARROW_SPARROW_H__ */
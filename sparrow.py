@@ -1,4 +1,5 @@
 import struct
+import zlib
 import numpy as np
 import heapq
 from itertools import count
@@ -9,16 +10,65 @@ TEXT_INDEX_FILE = 'content/jpeg.index.txt'
 FRAME_STRUCTURE = 'II48s8I'
 BLOB_NAME='content/jpeg.blob'
 
-
-def save_frames(frames, filename):
+# see sparrow_index_header_t in gstsparrow.h
+INDEX_MAGIC = 'SPRWIDX\n'
+INDEX_VERSION = 1
+INDEX_HEADER_STRUCTURE = '8s8I'
+
+
+def save_frames(frames, filename, width, height, blob_size):
+    records = ''.join(struct.pack(FRAME_STRUCTURE,
+                                  frame.glob_index,
+                                  frame.jpeg_len,
+                                  frame.summary,
+                                  *frame.successors
+                                  ) for frame in frames)
+    header = struct.pack(INDEX_HEADER_STRUCTURE,
+                         INDEX_MAGIC,
+                         INDEX_VERSION,
+                         struct.calcsize(INDEX_HEADER_STRUCTURE),
+                         struct.calcsize(FRAME_STRUCTURE),
+                         len(frames),
+                         width,
+                         height,
+                         blob_size,
+                         zlib.adler32(records) & 0xffffffff)
     f = open(filename, 'w')
-    for frame in frames:
-        f.write(struct.pack(FRAME_STRUCTURE,
-                            frame.glob_index,
-                            frame.jpeg_len,
-                            frame.summary,
-                            *frame.successors
-                            ))
+    f.write(header)
+    f.write(records)
+    f.close()
+
+
+def load_frames(filename):
+    """Returns (frames, (width, height, blob_size)).  Old headerless indexes
+    give None instead of the geometry."""
+    f = open(filename)
+    data = f.read()
+    f.close()
+    geometry = None
+    if data.startswith(INDEX_MAGIC):
+        (magic, version, header_size, frame_size, n, width, height, blob_size,
+         checksum) = struct.unpack(INDEX_HEADER_STRUCTURE,
+                                   data[:struct.calcsize(INDEX_HEADER_STRUCTURE)])
+        if version != INDEX_VERSION:
+            raise ValueError("%s is index version %d, not %d" %
+                             (filename, version, INDEX_VERSION))
+        data = data[header_size:header_size + n * frame_size]
+        if zlib.adler32(data) & 0xffffffff != checksum:
+            raise ValueError("%s has a bad checksum" % filename)
+        geometry = (width, height, blob_size)
+
+    structlen = struct.calcsize(FRAME_STRUCTURE)
+    frames = []
+    for i in count():
+        s = data[i * structlen: (i + 1) * structlen]
+        if not s:
+            break
+        frame = Frame(s)
+        frame.index = i
+        frames.append(frame)
+
+    return frames, geometry
 
 
 def save_frames_text(frames, filename):
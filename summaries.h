@@ -0,0 +1,92 @@
+#ifndef __SPARROW_SUMMARIES_H__
+#define __SPARROW_SUMMARIES_H__
+/* Scanning the frame summaries for adaptive shot changes, for
+   select_jpeg_adaptive (play.c), also used by test-summaries.c.
+
+   nearest_summaries_scalar is the plain loop. With SSE2, nearest_summaries
+   does the same scan with psadbw, and should always find the same frames.
+*/
+
+#include "sparrow.h"
+#include "play_core.h"
+
+#if defined(HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+/*SAD between two summaries */
+static inline guint
+summary_distance(const guint8 *a, const guint8 *b){
+  guint sum = 0;
+  for (int i = 0; i < SUMMARY_SIZE; i++){
+    sum += abs(a[i] - b[i]);
+  }
+  return sum;
+}
+
+/*keep the ADAPTIVE_CANDIDATES nearest, sorted, in best[] */
+static inline void
+add_candidate(guint *dist, guint32 *best, int *n, guint d, guint32 i){
+  int j = (*n < ADAPTIVE_CANDIDATES) ? (*n)++ : ADAPTIVE_CANDIDATES - 1;
+  for (; j > 0 && dist[j - 1] > d; j--){
+    dist[j] = dist[j - 1];
+    best[j] = best[j - 1];
+  }
+  dist[j] = d;
+  best[j] = i;
+}
+
+/*scan the packed summaries for those nearest to target, skipping the range
+  [exclude_lo, exclude_hi]. Returns the number found. */
+static UNUSED int
+nearest_summaries_scalar(const guint8 *summaries, guint32 count, const guint8 *target,
+    guint32 exclude_lo, guint32 exclude_hi, guint32 *best){
+  guint dist[ADAPTIVE_CANDIDATES];
+  int n = 0;
+  guint worst = (guint)-1;
+  for (guint32 i = 0; i < count; i++){
+    guint sad = summary_distance(summaries + i * SUMMARY_SIZE, target);
+    if (sad < worst && (i < exclude_lo || i > exclude_hi)){
+      add_candidate(dist, best, &n, sad, i);
+      if (n == ADAPTIVE_CANDIDATES){
+        worst = dist[n - 1];
+      }
+    }
+  }
+  return n;
+}
+
+#if defined(HAVE_SSE2)
+/*psadbw sums absolute differences of 8 bytes at a time, so 48 bytes take
+  3 loads and 3 psadbws. summaries is 16 byte aligned, as is every 48
+  byte record. */
+static UNUSED int
+nearest_summaries(const guint8 *summaries, guint32 count, const guint8 *target,
+    guint32 exclude_lo, guint32 exclude_hi, guint32 *best){
+  guint dist[ADAPTIVE_CANDIDATES];
+  int n = 0;
+  guint worst = (guint)-1;
+  __m128i t0 = _mm_loadu_si128((const __m128i *)target);
+  __m128i t1 = _mm_loadu_si128((const __m128i *)(target + 16));
+  __m128i t2 = _mm_loadu_si128((const __m128i *)(target + 32));
+  for (guint32 i = 0; i < count; i++){
+    const __m128i *s = (const __m128i *)(summaries + i * SUMMARY_SIZE);
+    __m128i d = _mm_add_epi64(_mm_add_epi64(
+            _mm_sad_epu8(_mm_load_si128(s), t0),
+            _mm_sad_epu8(_mm_load_si128(s + 1), t1)),
+        _mm_sad_epu8(_mm_load_si128(s + 2), t2));
+    guint sad = _mm_cvtsi128_si32(d) + _mm_cvtsi128_si32(_mm_srli_si128(d, 8));
+    if (sad < worst && (i < exclude_lo || i > exclude_hi)){
+      add_candidate(dist, best, &n, sad, i);
+      if (n == ADAPTIVE_CANDIDATES){
+        worst = dist[n - 1];
+      }
+    }
+  }
+  return n;
+}
+#else
+#define nearest_summaries nearest_summaries_scalar
+#endif
+
+#endif
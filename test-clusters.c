@@ -0,0 +1,130 @@
+/*make the clusters (edges.c) from a map with 1 to SPARROW_MAX_THREADS
+  worker bands, and check they all come out byte for byte as the old serial
+  pass made them. The map has far more voters per corner than a cluster
+  holds, with few signal values, so which ones are kept depends on the
+  order they are added in when signals tie. */
+#include "edges.c"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+/*camera pixels each way voting for each corner */
+#define CORNER_PIXELS 16
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+/*make_clusters as it was before it was split into bands */
+static void
+serial_clusters(GstSparrow *sparrow, sparrow_find_lines_t *fl){
+  sparrow_cluster_t *clusters = fl->clusters;
+  fl->map[0].signal[SPARROW_VERTICAL] = 0;
+  fl->map[0].signal[SPARROW_HORIZONTAL] = 0;
+  for (int y = 0; y < sparrow->in.height; y++){
+    for (int x = 0; x < sparrow->in.width; x++){
+      sparrow_intersect_t *p = &fl->map[y * sparrow->in.width + x];
+      guint vsig = p->signal[SPARROW_VERTICAL];
+      guint hsig = p->signal[SPARROW_HORIZONTAL];
+      if (! (vsig && hsig)){
+        continue;
+      }
+      int vline = p->lines[SPARROW_VERTICAL];
+      int hline = p->lines[SPARROW_HORIZONTAL];
+      if (vline == BAD_PIXEL || hline == BAD_PIXEL){
+        continue;
+      }
+      sparrow_cluster_t *cluster = &clusters[hline * fl->n_vlines + vline];
+      sparrow_voter_t *voters = cluster->voters;
+      guint signal = (vsig * hsig) / SIGNAL_QUANT;
+      if (cluster->n < CLUSTER_SIZE){
+        voters[cluster->n].x = INT_TO_COORD(x);
+        voters[cluster->n].y = INT_TO_COORD(y);
+        voters[cluster->n].signal = signal;
+        cluster->n++;
+      }
+      else {
+        guint ts = signal;
+        coord_t tx = INT_TO_COORD(x);
+        coord_t ty = INT_TO_COORD(y);
+        for (int j = 0; j < CLUSTER_SIZE; j++){
+          if (voters[j].signal < ts){
+            guint ts2 = voters[j].signal;
+            coord_t tx2 = voters[j].x;
+            coord_t ty2 = voters[j].y;
+            voters[j].signal = ts;
+            voters[j].x = tx;
+            voters[j].y = ty;
+            ts = ts2;
+            tx = tx2;
+            ty = ty2;
+          }
+        }
+      }
+    }
+  }
+}
+
+/*blocks of pixels voting for each corner, with a few signal levels, some
+  pixels in only one line, and some bad */
+static void
+fake_map(GstSparrow *sparrow, sparrow_find_lines_t *fl){
+  int w = sparrow->in.width;
+  for (int y = 0; y < sparrow->in.height; y++){
+    for (int x = 0; x < w; x++){
+      sparrow_intersect_t *p = &fl->map[y * w + x];
+      p->lines[SPARROW_HORIZONTAL] = (y / CORNER_PIXELS) % fl->n_hlines;
+      p->lines[SPARROW_VERTICAL] = (x / CORNER_PIXELS) % fl->n_vlines;
+      p->signal[SPARROW_HORIZONTAL] = rng_uniform_int(sparrow, 4);
+      p->signal[SPARROW_VERTICAL] = 1 + rng_uniform_int(sparrow, 3);
+      if (rng_uniform_int(sparrow, 20) == 0){
+        p->lines[rng_uniform_int(sparrow, 2)] = BAD_PIXEL;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  if (! g_thread_supported()){
+    g_thread_init(NULL);
+  }
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  init_find_edges(&sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow.helper_struct;
+  guint32 size = fl->n_hlines * fl->n_vlines * sizeof(sparrow_cluster_t);
+  fake_map(&sparrow, fl);
+
+  sparrow_cluster_t *ref = malloc_or_die(size);
+  memset(fl->clusters, 0, size);
+  serial_clusters(&sparrow, fl);
+  memcpy(ref, fl->clusters, size);
+  guint32 full = 0;
+  for (int i = 0; i < fl->n_hlines * fl->n_vlines; i++){
+    full += (ref[i].n == CLUSTER_SIZE);
+  }
+
+  int fails = 0;
+  const int threads[] = {1, 2, 3, 7, SPARROW_MAX_THREADS};
+  for (int i = 0; i < 5; i++){
+    sparrow.n_threads = threads[i];
+    init_threads(&sparrow);
+    memset(fl->clusters, 0, size);
+    make_clusters(&sparrow, fl);
+    int same = ! memcmp(ref, fl->clusters, size);
+    printf("%2d bands: clusters (%u of %d full) %s as one serial pass %s\n",
+        threads[i], full, fl->n_hlines * fl->n_vlines, same ? "the same" : "not the same",
+        same ? "ok" : "WRONG");
+    fails += ! same;
+    finalise_threads(&sparrow);
+  }
+  free(ref);
+  finalise_find_edges(&sparrow);
+  finalise_test_sparrow(&sparrow);
+  return fails != 0;
+}
@@ -0,0 +1,108 @@
+/*time the worklist mesh solver (complete_map.h) against full passes, on
+  the meshes a 1920x1080 projector gives with various line periods, and check
+  they come up with the same mesh. */
+#include "test_common.h"
+#include "edges.h"
+#include "complete_map.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+/*most corners the camera can see found, with a little noise, a few of them
+  badly wrong, and a hole where nothing was found */
+static void
+fake_mesh(GstSparrow *sparrow, sparrow_corner_t *mesh, int width, int height,
+    int period){
+  memset(mesh, 0, width * height * sizeof(sparrow_corner_t));
+  for (int y = 0; y < height; y++){
+    for (int x = 0; x < width; x++){
+      sparrow_corner_t *c = &mesh[y * width + x];
+      double u = period / 2 + x * period;
+      double v = period / 2 + y * period;
+      double cx, cy;
+      int hx = x - width / 3;
+      int hy = y - height / 2;
+      project(u, v, &cx, &cy);
+      if (hx * hx + hy * hy < (height / 6) * (height / 6) ||
+          rng_uniform_int(sparrow, 4) == 0 ||
+          cx < 0 || cx >= sparrow->in.width || cy < 0 || cy >= sparrow->in.height){
+        continue;
+      }
+      if (rng_uniform_int(sparrow, 50) == 0){
+        cx += period * 0.6;
+        cy -= period * 0.4;
+      }
+      c->x = cx + rng_uniform(sparrow) - 0.5;
+      c->y = cy + rng_uniform(sparrow) - 0.5;
+      c->status = CORNER_EXACT;
+    }
+  }
+}
+
+static int
+bench(GstSparrow *sparrow, int period){
+  struct timeval tv1, tv2;
+  int width = (sparrow->out.width + period - 1) / period;
+  int height = (sparrow->out.height + period - 1) / period;
+  int n = width * height;
+  sparrow_corner_t *orig = malloc_or_die(n * sizeof(sparrow_corner_t));
+  sparrow_corner_t *ref = malloc_or_die(n * sizeof(sparrow_corner_t));
+  sparrow_corner_t *mesh = malloc_or_die(n * sizeof(sparrow_corner_t));
+  fake_mesh(sparrow, orig, width, height, period);
+
+  /*both solvers pick random estimates in the same order */
+  memcpy(ref, orig, n * sizeof(sparrow_corner_t));
+  dsfmt_init_gen_rand(sparrow->dsfmt, 1);
+  gettimeofday(&tv1, NULL);
+  complete_map_passes(sparrow, ref, width, height, NULL);
+  gettimeofday(&tv2, NULL);
+  guint32 t_ref = elapsed(&tv1, &tv2);
+
+  memcpy(mesh, orig, n * sizeof(sparrow_corner_t));
+  dsfmt_init_gen_rand(sparrow->dsfmt, 1);
+  gettimeofday(&tv1, NULL);
+  complete_map_worklist(sparrow, mesh, width, height, NULL);
+  gettimeofday(&tv2, NULL);
+  guint32 t = elapsed(&tv1, &tv2);
+
+  int ok = ! memcmp(mesh, ref, n * sizeof(sparrow_corner_t));
+  int counts[4] = {0, 0, 0, 0};
+  double error = 0;
+  int n_seen = 0;
+  for (int y = 0; y < height; y++){
+    for (int x = 0; x < width; x++){
+      sparrow_corner_t *c = &mesh[y * width + x];
+      counts[c->status]++;
+      double cx, cy;
+      project(period / 2 + x * period, period / 2 + y * period, &cx, &cy);
+      if (c->status != CORNER_UNUSED &&
+          cx >= 0 && cx < sparrow->in.width && cy >= 0 && cy < sparrow->in.height){
+        error += (c->x - cx) * (c->x - cx) + (c->y - cy) * (c->y - cy);
+        n_seen++;
+      }
+    }
+  }
+  printf("period %2d, %3dx%-3d mesh: passes %7u microseconds, worklist %7u (%.1fx) %s\n"
+      "    unused %d, projected %d, exact %d, settled %d; in view, mean squared error %.3f\n",
+      period, width, height, t_ref, t, (double)t_ref / MAX(t, 1),
+      ok ? "ok" : "MISMATCH", counts[CORNER_UNUSED], counts[CORNER_PROJECTED],
+      counts[CORNER_EXACT], counts[CORNER_SETTLED],
+      error / MAX(n_seen, 1));
+  free(orig);
+  free(ref);
+  free(mesh);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  int fails = 0;
+  int periods[] = {32, 16, 8};
+  for (guint i = 0; i < sizeof(periods) / sizeof(periods[0]); i++){
+    fails += bench(&sparrow, periods[i]);
+  }
+  finalise_test_sparrow(&sparrow);
+  return fails != 0;
+}
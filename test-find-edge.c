@@ -7,79 +7,119 @@
 
 #include "cv.h"
 #include "highgui.h"
+#include "floodfill.h"
+#include "bitmask.h"
 
 #define debug(format, ...) fprintf (stderr, (format),## __VA_ARGS__); fflush(stderr)
 #define debug_lineno() debug("%-25s  line %4d \n", __func__, __LINE__ )
 
 
+/*floodfill.h's malloc_or_die can complain */
+GST_DEBUG_CATEGORY (sparrow_debug);
+
 #define IMG_IN_NAME "images/test-image.png"
 #define IMG_OUT_NAME "images/test-image-%s.png"
 
 
-static inline void
-expand_one_mono(int x, int y, int c,
-    CvPoint *nexts, int *n_nexts, guint8 *im, guint8 *mask, int w, int h){
-  guint8 p = im[y * w + x];
-  guint8 *m = &mask[y * w + x];
-  if (*m && (p == c)){
-    *m = 0;
-    nexts[*n_nexts].x = x;
-    nexts[*n_nexts].y = y;
-    (*n_nexts)++;
+/*find_screen's two fills: from the middle of an edge image, then from the
+  corner of the result. The byte fills and the bitmask fill are timed, and
+  have to agree. */
+static int
+bench_floodfill(IplImage *edges, const char *name)
+{
+  struct timeval tv1, tv2;
+  int w = edges->width;
+  int h = edges->height;
+  CvPoint middle = {w / 2, h / 2};
+  CvPoint corner = {0, 0};
+  IplImage *working[2];
+  IplImage *mask[2];
+  IplImage* (*fills[2])(IplImage *, IplImage *, CvPoint) = {
+    floodfill_mono_superfast, floodfill_mono_spans
+  };
+  guint32 t[2];
+  for (int k = 0; k < 2; k++){
+    working[k] = cvCreateImage(cvGetSize(edges), IPL_DEPTH_8U, 1);
+    mask[k] = cvCreateImage(cvGetSize(edges), IPL_DEPTH_8U, 1);
+    gettimeofday(&tv1, NULL);
+    memset(working[k]->imageData, 255, w * h);
+    fills[k](edges, working[k], middle);
+    memset(mask[k]->imageData, 255, w * h);
+    fills[k](working[k], mask[k], corner);
+    gettimeofday(&tv2, NULL);
+    t[k] = ((tv2.tv_sec - tv1.tv_sec) * 1000000 +
+        tv2.tv_usec - tv1.tv_usec);
   }
+
+  /*and the same with bitmasks */
+  sparrow_bitmask_t b_edges, b_working, b_mask, region, fill;
+  bitmask_init(&b_edges, w, h);
+  bitmask_init(&b_working, w, h);
+  bitmask_init(&b_mask, w, h);
+  bitmask_init(&region, w, h);
+  bitmask_init(&fill, w, h);
+  bitmask_from_bytes(&b_edges, (guint8 *)edges->imageData);
+  gettimeofday(&tv1, NULL);
+  bitmask_set_all(&b_working);
+  bitmask_floodfill(&b_working, &b_edges, middle.x, middle.y, &region, &fill);
+  bitmask_set_all(&b_mask);
+  bitmask_floodfill(&b_mask, &b_working, corner.x, corner.y, &region, &fill);
+  gettimeofday(&tv2, NULL);
+  guint32 t_bits = ((tv2.tv_sec - tv1.tv_sec) * 1000000 +
+      tv2.tv_usec - tv1.tv_usec);
+  guint8 *bytes = malloc_or_die(w * h);
+  bitmask_to_bytes(&b_mask, bytes);
+
+  int ok = (! memcmp(working[0]->imageData, working[1]->imageData, w * h) &&
+      ! memcmp(mask[0]->imageData, mask[1]->imageData, w * h));
+  int ok_bits = ! memcmp(mask[0]->imageData, bytes, w * h);
+  printf("%-12s %dx%d breadth first %6u microseconds, scanline %6u (%.1fx) %s,"
+      " bitmask %6u (%.1fx) %s\n",
+      name, w, h, t[0], t[1], (double)t[0] / MAX(t[1], 1), ok ? "ok" : "MISMATCH",
+      t_bits, (double)t[0] / MAX(t_bits, 1), ok_bits ? "ok" : "MISMATCH");
+  free(bytes);
+  bitmask_free(&b_edges);
+  bitmask_free(&b_working);
+  bitmask_free(&b_mask);
+  bitmask_free(&region);
+  bitmask_free(&fill);
+  for (int k = 0; k < 2; k++){
+    cvReleaseImage(&working[k]);
+    cvReleaseImage(&mask[k]);
+  }
+  return ! (ok && ok_bits);
 }
 
-static IplImage*
-floodfill_mono_superfast(IplImage *im, IplImage *mim, CvPoint start)
+/*a rough screen outline, with edge-like scribbles and specks inside and out,
+  or, with holes set, a sieve of single pixel holes to stress the scanline
+  fill's stack. */
+static IplImage *
+fake_edges(int w, int h, int holes)
 {
-  guint8 * data = (guint8 *)im->imageData;
-  guint8 * mdata = (guint8 *)mim->imageData;
-  int w = im->width;
-  int h = im->height;
-  int n_starts;
-  int n_nexts = 0;
-  CvPoint *starts;
-  CvPoint *nexts;
-
-  //malloc 2 lists of points. These *could* be as large as the image (but never should be)
-  void * mem = malloc(w * h * 2 * sizeof(CvPoint));
-  starts = mem;
-  nexts = starts + w * h;
-
-  n_starts = 1;
-  starts[0] = start;
-
-  while(n_starts){
-    n_nexts = 0;
-    int i;
-    for (i = 0; i < n_starts; i++){
-      int x = starts[i].x;
-      int y = starts[i].y;
-      int c = data[y * w + x];
-      if (x > 0){
-        expand_one_mono(x - 1, y, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (x < w - 1){
-        expand_one_mono(x + 1, y, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (y > 0){
-        expand_one_mono(x, y - 1, c, nexts, &n_nexts, data, mdata, w, h);
-      }
-      if (y < h - 1){
-        expand_one_mono(x, y + 1, c, nexts, &n_nexts, data, mdata, w, h);
+  IplImage *im = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 1);
+  guint8 *data = (guint8 *)im->imageData;
+  memset(data, 0, w * h);
+  if (holes){
+    for (int y = 0; y < h; y++){
+      for (int x = 0; x < w; x++){
+        data[y * w + x] = ((x & 1) && (y & 1) && (rand() & 1)) ? 255 : 0;
       }
     }
-    CvPoint *tmp = starts;
-    starts = nexts;
-    nexts = tmp;
-    n_starts = n_nexts;
+    return im;
+  }
+  cvRectangle(im, cvPoint(w / 8, h / 8), cvPoint(w * 7 / 8, h * 7 / 8),
+      cvScalarAll(255), 3, 8, 0);
+  for (int i = 0; i < 200; i++){
+    CvPoint a = {rand() % w, rand() % h};
+    CvPoint b = {a.x + rand() % 61 - 30, a.y + rand() % 61 - 30};
+    cvLine(im, a, b, cvScalarAll(255), 1 + rand() % 2, 8, 0);
+  }
+  for (int i = 0; i < w * h / 100; i++){
+    data[rand() % (w * h)] = 255;
   }
-  free(mem);
   return im;
 }
 
-
-
 static UNUSED IplImage*
 test_find_edges_hist(IplImage *im)
 {
@@ -135,7 +175,7 @@ test_find_edges_hist(IplImage *im)
   cvCmpS(green, best_t, mask, CV_CMP_GT);
   IplImage *mask2 = cvCreateImage(cvGetSize(im), IPL_DEPTH_8U, 1);
   memset(mask2->imageData, 255, w*h);
-  floodfill_mono_superfast(mask, mask2, middle);
+  floodfill_mono_spans(mask, mask2, middle);
   return mask2;
 }
 
@@ -145,11 +185,31 @@ int main(int argc, char **argv)
 {
   struct timeval tv1, tv2;
   guint32 t;
+  int fails = 0;
+
+  srand(12345);
+  for (int holes = 0; holes < 2; holes++){
+    IplImage *im = fake_edges(800, 600, holes);
+    fails += bench_floodfill(im, holes ? "sieve" : "scribbles");
+    cvReleaseImage(&im);
+  }
 
   IplImage *im_in = cvLoadImage(IMG_IN_NAME, CV_LOAD_IMAGE_UNCHANGED);
+  if (im_in == NULL){
+    printf("no %s, skipping the edge finding test\n", IMG_IN_NAME);
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
   //IplImage *im_out = cvCreateImage(CvSize size, int depth, int channels);
   //IplImage *im_out = cvCloneImage(im);
 
+  /*the edges find_screen would see */
+  IplImage *green = cvCreateImage(cvGetSize(im_in), IPL_DEPTH_8U, 1);
+  IplImage *edges = cvCreateImage(cvGetSize(im_in), IPL_DEPTH_8U, 1);
+  cvSplit(im_in, NULL, green, NULL, NULL);
+  cvCanny(green, edges, 100, 170, 3);
+  cvDilate(edges, edges, NULL, 1);
+  fails += bench_floodfill(edges, "test-image");
+
   gettimeofday(&tv1, NULL);
 
 
@@ -167,5 +227,5 @@ int main(int argc, char **argv)
   char *filename;
   if(asprintf(&filename, IMG_OUT_NAME, "final") == -1){};
   cvSaveImage(filename, im_out, 0);
-  return EXIT_SUCCESS;
+  return fails ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,210 @@
+/*time the find_lag kernels (find_lag.h) against the original scalar loop,
+  single threaded and spread over the worker bands, and check they agree.
+  Then do the same for recording frames into bit-planes, against the
+  original per-pixel shift. */
+#include "test_common.h"
+#include "calibrate.h"
+#include "find_lag.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+static const int cycles = 20;
+
+typedef struct lag_bench_s {
+  lag_search_func search;
+  const lag_times_t *records;
+  const guint64 *targets;
+  guint8 *lags;
+  guint8 *errors;
+} lag_bench_t;
+
+static void
+bench_band(GstSparrow *sparrow, void *data, int start, int end){
+  lag_bench_t *b = (lag_bench_t *)data;
+  b->search(b->records + start, end - start, b->targets,
+      b->lags + start, b->errors + start);
+}
+
+/*a pattern like cycle_pattern's, and pixels that mostly see it late and
+  noisily, or not at all */
+static void
+fake_records(GstSparrow *sparrow, lag_times_t *records, int n, guint64 *pattern){
+  guint64 p = 0;
+  for (int i = 0; i < 64; i++){
+    p = (p << 1) | (rng_uniform_int(sparrow, 4) == 0 ? (p & 1) ^ 1 : (p & 1));
+  }
+  *pattern = p;
+  for (int i = 0; i < n; i++){
+    int kind = rng_uniform_int(sparrow, 4);
+    guint64 r;
+    if (kind == 0){
+      r = 0;
+    }
+    else if (kind == 1){
+      r = ((guint64)dsfmt_genrand_uint32(sparrow->dsfmt) << 32) |
+        dsfmt_genrand_uint32(sparrow->dsfmt);
+    }
+    else {
+      r = p >> rng_uniform_int(sparrow, MAX_CALIBRATION_LAG);
+      r ^= 1ULL << rng_uniform_int(sparrow, 64);
+    }
+    records[i].record = r;
+  }
+}
+
+static guint32
+time_kernel(GstSparrow *sparrow, lag_bench_t *b, int n, gboolean banded){
+  struct timeval tv1, tv2;
+  gettimeofday(&tv1, NULL);
+  for (int i = 0; i < cycles; i++){
+    if (banded){
+      sparrow_run_bands(sparrow, bench_band, b, n);
+    }
+    else {
+      b->search(b->records, n, b->targets, b->lags, b->errors);
+    }
+  }
+  gettimeofday(&tv2, NULL);
+  return elapsed(&tv1, &tv2) / cycles;
+}
+
+static int
+bench(GstSparrow *sparrow, int width, int height){
+  int n = width * height;
+  int fails = 0;
+  lag_times_t *records = malloc_aligned_or_die(n * sizeof(lag_times_t));
+  guint8 *lags_ref = malloc_or_die(n);
+  guint8 *errors_ref = malloc_or_die(n);
+  guint8 *lags = malloc_or_die(n);
+  guint8 *errors = malloc_or_die(n);
+  guint64 pattern;
+  guint64 targets[MAX_CALIBRATION_LAG];
+  fake_records(sparrow, records, n, &pattern);
+  init_lag_targets(targets, pattern);
+
+  lag_bench_t b = {lag_search_scalar, records, targets, lags_ref, errors_ref};
+  guint32 t_ref = time_kernel(sparrow, &b, n, FALSE);
+  printf("%dx%d scalar (original):  %6u microseconds\n", width, height, t_ref);
+
+  struct {
+    const char *name;
+    lag_search_func search;
+    gboolean banded;
+  } kernels[] = {
+#if FIND_LAG_HAVE_X86
+    {"popcnt", lag_search_popcnt, FALSE},
+    {"avx2", lag_search_avx2, FALSE},
+#endif
+    {"best, banded", choose_lag_search(), TRUE},
+  };
+  for (guint k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++){
+#if FIND_LAG_HAVE_X86
+    if (kernels[k].search == lag_search_avx2 && ! __builtin_cpu_supports("avx2")){
+      continue;
+    }
+    if (kernels[k].search == lag_search_popcnt && ! __builtin_cpu_supports("popcnt")){
+      continue;
+    }
+#endif
+    memset(lags, 0xff, n);
+    memset(errors, 0xff, n);
+    lag_bench_t b2 = {kernels[k].search, records, targets, lags, errors};
+    guint32 t = time_kernel(sparrow, &b2, n, kernels[k].banded);
+    int ok = ! memcmp(lags, lags_ref, n) && ! memcmp(errors, errors_ref, n);
+    fails += ! ok;
+    printf("%dx%d %-19s %6u microseconds (%.1fx) %s\n", width, height,
+        kernels[k].name, t, (double)t_ref / MAX(t, 1), ok ? "ok" : "MISMATCH");
+  }
+  free(records);
+  free(lags_ref);
+  free(errors_ref);
+  free(lags);
+  free(errors);
+  return fails;
+}
+
+/*frames of noise, with the green channel sometimes over the threshold */
+static void
+fake_frame(GstSparrow *sparrow, guint32 *frame, int n){
+  for (int i = 0; i < n; i++){
+    frame[i] = dsfmt_genrand_uint32(sparrow->dsfmt);
+  }
+}
+
+static int
+bench_record(GstSparrow *sparrow, int width, int height){
+  int n = width * height;
+  guint32 words = (n + 63) / 64;
+  const guint32 shift = 8;
+  struct timeval tv1, tv2;
+  guint32 *frames[LAG_PLANES];
+  for (int f = 0; f < LAG_PLANES; f++){
+    frames[f] = malloc_aligned_or_die(n * PIXSIZE);
+    fake_frame(sparrow, frames[f], n);
+  }
+  lag_times_t *records = zalloc_aligned_or_die(n * sizeof(lag_times_t));
+  guint64 *planes = zalloc_aligned_or_die(LAG_PLANES * words * sizeof(guint64));
+
+  gettimeofday(&tv1, NULL);
+  for (int f = 0; f < LAG_PLANES; f++){
+    guint32 *frame = frames[f];
+    for (int i = 0; i < n; i++){
+      int signal = (((frame[i] >> shift) & 255) > CALIBRATE_SIGNAL_THRESHOLD);
+      records[i].record = (records[i].record << 1) | signal;
+    }
+  }
+  gettimeofday(&tv2, NULL);
+  guint32 t_ref = elapsed(&tv1, &tv2) / LAG_PLANES;
+  printf("%dx%d record per pixel:   %6u microseconds\n", width, height, t_ref);
+
+  gettimeofday(&tv1, NULL);
+  for (int f = 0; f < LAG_PLANES; f++){
+    threshold_plane(planes + f * words, frames[f], n, shift, CALIBRATE_SIGNAL_THRESHOLD);
+  }
+  gettimeofday(&tv2, NULL);
+  guint32 t = elapsed(&tv1, &tv2) / LAG_PLANES;
+
+  /*frame 63 is the latest, so plane 63 - t is t frames ago */
+  int fails = 0;
+  gettimeofday(&tv1, NULL);
+  for (guint32 w = 0; w < words && ! fails; w++){
+    guint64 rows[64];
+    for (int age = 0; age < LAG_PLANES; age++){
+      rows[age] = planes[(LAG_PLANES - 1 - age) * words + w];
+    }
+    transpose_lag_rows(rows);
+    for (int k = 0; k < 64 && w * 64 + k < (guint32)n; k++){
+      fails += (rows[k] != records[w * 64 + k].record);
+    }
+  }
+  gettimeofday(&tv2, NULL);
+  printf("%dx%d record bit-planes   %6u microseconds (%.1fx) %s, transpose %u\n",
+      width, height, t, (double)t_ref / MAX(t, 1), fails ? "MISMATCH" : "ok",
+      elapsed(&tv1, &tv2));
+
+  for (int f = 0; f < LAG_PLANES; f++){
+    free(frames[f]);
+  }
+  free(records);
+  free(planes);
+  return fails;
+}
+
+int main(int argc, char **argv)
+{
+  if (! g_thread_supported()){
+    g_thread_init(NULL);
+  }
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  init_threads(&sparrow);
+  int fails = bench(&sparrow, 800, 600);
+  fails += bench(&sparrow, 1280, 720);
+  fails += bench_record(&sparrow, 800, 600);
+  fails += bench_record(&sparrow, 1280, 720);
+  fails += bench_record(&sparrow, 801, 601);
+  finalise_threads(&sparrow);
+  finalise_test_sparrow(&sparrow);
+  return fails != 0;
+}
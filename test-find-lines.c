@@ -0,0 +1,438 @@
+/*look for the edge lines of a 1920x1080 projector in a 1280x720 camera, in
+  random order, with look_for_line (edges.c) scanning only the predicted box
+  where it can, and again with whole frame scans, and check the maps come
+  out the same. Both are timed. One of the last lines is bumped well away
+  from where its neighbours say it should be, leaving only a few pixels
+  there, so the box has to be given up on.
+
+  Then find the lines again, one at a time and in Gray code mode, with a
+  camera that sees how much of each of its pixels the projector lights, and
+  check the Gray code map and clusters agree with the line by line ones.
+  Lastly, find them in adaptive-lines mode, with the camera from one to
+  MAX_LATE frames late, changing as it goes, and sometimes seeing the last
+  frame and the next at once. Every line should be seen, and no line should end up
+  with another's pixels, so the map has to be the same as line by line. */
+#include "edges.c"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+/*the background noise find_edges would have measured */
+#define NOISE 40
+/*how far the bumped line lands from where it should, in camera pixels */
+#define BUMP 150
+
+/*each projector pixel is split this many ways each way to find out which
+  camera pixels it lights */
+#define SUBPIXELS 2
+/*the most the Gray code clusters can be off from the line by line ones, on
+  average and at worst, in camera pixels */
+#define GRAY_MEAN_ERROR 0.1
+#define GRAY_MAX_ERROR 1.5
+/*in adaptive-lines mode, the camera is from 1 to MAX_LATE frames late */
+#define MAX_LATE 4
+#define HISTORY 8
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+/*what the camera sees of the line: a couple of pixels wide, over noise
+  below the threshold. The same line always looks the same. */
+static void
+fake_camera(GstSparrow *sparrow, sparrow_line_t *line, guint32 *in, gboolean bumped){
+  guint32 seed = line->dir * 1000 + line->index + 1;
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  for (int i = 0; i < w * h; i++){
+    in[i] = (rand_r(&seed) % NOISE) << sparrow->in.gshift;
+  }
+  int length = (line->dir == SPARROW_HORIZONTAL) ? sparrow->out.width : sparrow->out.height;
+  for (int t = 0; t < length * 4; t++){
+    double u = (line->dir == SPARROW_HORIZONTAL) ? t * 0.25 : line->offset;
+    double v = (line->dir == SPARROW_HORIZONTAL) ? line->offset : t * 0.25;
+    double cx, cy;
+    project(u, v, &cx, &cy);
+    if (bumped && t % 4096){
+      cy += BUMP;
+    }
+    for (int dy = 0; dy < 2; dy++){
+      for (int dx = 0; dx < 2; dx++){
+        int x = (int)cx + dx;
+        int y = (int)cy + dy;
+        if (x >= 0 && y >= 0 && x < w && y < h){
+          in[y * w + x] = (150 + rand_r(&seed) % 50) << sparrow->in.gshift;
+        }
+      }
+    }
+  }
+}
+
+/*find all the lines, and return the map */
+static sparrow_intersect_t *
+find_lines(GstSparrow *sparrow, guint32 *in, gboolean use_roi, guint32 *t){
+  struct timeval tv1, tv2;
+  dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED);
+  init_find_edges(sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
+  memset(fl->threshold->imageData, NOISE, sparrow->in.size);
+  /*the last horizontal line drawn that is well inside the camera's view */
+  sparrow_line_t *bumped = NULL;
+  for (int i = fl->n_lines - 1; i >= 0 && ! bumped; i--){
+    sparrow_line_t *line = fl->shuffled_lines[i];
+    if (line->dir == SPARROW_HORIZONTAL && line->index > 4 &&
+        line->index < fl->n_hlines / 2){
+      bumped = line;
+    }
+  }
+  *t = 0;
+  for (int i = 0; i < fl->n_lines; i++){
+    sparrow_line_t *line = fl->shuffled_lines[i];
+    fake_camera(sparrow, line, in, line == bumped);
+    gettimeofday(&tv1, NULL);
+    if (use_roi){
+      look_for_line(sparrow, (guint8 *)in, fl, line);
+    }
+    else {
+      fl->input->imageData = (char *)in;
+      scan_for_line(sparrow, fl, line, cvRect(0, 0, sparrow->in.width, sparrow->in.height));
+    }
+    gettimeofday(&tv2, NULL);
+    *t += elapsed(&tv1, &tv2);
+  }
+  sparrow_intersect_t *map = malloc_or_die(sparrow->in.pixcount * sizeof(sparrow_intersect_t));
+  memcpy(map, fl->map, sparrow->in.pixcount * sizeof(sparrow_intersect_t));
+  finalise_find_edges(sparrow);
+  return map;
+}
+
+/*where the camera sees each part of each projector pixel (or -1 if it
+  doesn't), and how many parts each camera pixel sees */
+typedef struct camera_view_s {
+  gint32 *where;
+  guint32 *parts;
+} camera_view_t;
+
+static void
+init_camera_view(GstSparrow *sparrow, camera_view_t *view){
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  view->where = malloc_or_die(sparrow->out.pixcount * SUBPIXELS * SUBPIXELS * sizeof(gint32));
+  view->parts = zalloc_or_die(sparrow->in.pixcount * sizeof(guint32));
+  gint32 *where = view->where;
+  for (int v = 0; v < sparrow->out.height; v++){
+    for (int u = 0; u < sparrow->out.width; u++){
+      for (int k = 0; k < SUBPIXELS * SUBPIXELS; k++, where++){
+        double cx, cy;
+        project(u + (k % SUBPIXELS + 0.5) / SUBPIXELS,
+            v + (k / SUBPIXELS + 0.5) / SUBPIXELS, &cx, &cy);
+        int x = (int)floor(cx);
+        int y = (int)floor(cy);
+        *where = (x >= 0 && y >= 0 && x < w && y < h) ? y * w + x : -1;
+        if (*where >= 0){
+          view->parts[*where]++;
+        }
+      }
+    }
+  }
+}
+
+static void
+finalise_camera_view(camera_view_t *view){
+  free(view->where);
+  free(view->parts);
+}
+
+/*what the camera sees of the projector's output: each pixel gets the share
+  of green light falling on it, over noise below the threshold */
+static void
+see_output(GstSparrow *sparrow, camera_view_t *view, const guint32 *out,
+    guint32 *in, guint32 seed){
+  guint32 *light = zalloc_or_die(sparrow->in.pixcount * sizeof(guint32));
+  const gint32 *where = view->where;
+  for (guint32 i = 0; i < sparrow->out.pixcount; i++, where += SUBPIXELS * SUBPIXELS){
+    guint32 g = (out[i] >> sparrow->out.gshift) & 255;
+    if (g == 0){
+      continue;
+    }
+    for (int k = 0; k < SUBPIXELS * SUBPIXELS; k++){
+      if (where[k] >= 0){
+        light[where[k]] += g;
+      }
+    }
+  }
+  for (guint32 i = 0; i < sparrow->in.pixcount; i++){
+    guint32 g = rand_r(&seed) % NOISE;
+    if (view->parts[i]){
+      g += light[i] / view->parts[i];
+    }
+    in[i] = MIN(g, 255) << sparrow->in.gshift;
+  }
+  free(light);
+}
+
+typedef struct found_lines_s {
+  sparrow_intersect_t *map;
+  sparrow_cluster_t *clusters;
+  guint32 n_clusters;
+  guint32 n_seen;
+} found_lines_t;
+
+/*keep the map and clusters, as find_corners would start with them */
+static void
+keep_lines(GstSparrow *sparrow, sparrow_find_lines_t *fl, found_lines_t *found){
+  make_clusters(sparrow, fl);
+  found->n_clusters = fl->n_hlines * fl->n_vlines;
+  found->map = malloc_or_die(sparrow->in.pixcount * sizeof(sparrow_intersect_t));
+  memcpy(found->map, fl->map, sparrow->in.pixcount * sizeof(sparrow_intersect_t));
+  found->clusters = malloc_or_die(found->n_clusters * sizeof(sparrow_cluster_t));
+  memcpy(found->clusters, fl->clusters, found->n_clusters * sizeof(sparrow_cluster_t));
+  found->n_seen = 0;
+  for (int i = 0; i < fl->n_lines; i++){
+    found->n_seen += fl->h_lines[i].seen;
+  }
+  finalise_find_edges(sparrow);
+}
+
+static void
+free_lines(found_lines_t *found){
+  free(found->map);
+  free(found->clusters);
+}
+
+/*find the lines one at a time, as draw_lines does, with the camera seeing
+  each one as it is drawn */
+static void
+find_lines_one_by_one(GstSparrow *sparrow, camera_view_t *view, found_lines_t *found){
+  dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED);
+  init_find_edges(sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
+  memset(fl->threshold->imageData, NOISE, sparrow->in.size);
+  guint32 *out = malloc_aligned_or_die(sparrow->out.size);
+  guint32 *in = malloc_aligned_or_die(sparrow->in.size);
+  for (int i = 0; i < fl->n_lines; i++){
+    sparrow_line_t *line = fl->shuffled_lines[i];
+    memset(out, 0, sparrow->out.size);
+    draw_line(sparrow, line, (guint8 *)out);
+    see_output(sparrow, view, out, in, i + 1);
+    look_for_line(sparrow, (guint8 *)in, fl, line);
+  }
+  free(out);
+  free(in);
+  keep_lines(sparrow, fl, found);
+}
+
+/*run find_edges in Gray code mode from where it starts drawing patterns, with
+  the camera seeing each frame the next time round, as it would with no lag */
+static void
+find_lines_gray(GstSparrow *sparrow, camera_view_t *view, found_lines_t *found){
+  dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED);
+  sparrow->gray_code = TRUE;
+  init_find_edges(sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
+  jump_state(sparrow, fl, EDGES_FIND_LINES);
+  guint32 *out = zalloc_aligned_or_die(sparrow->out.size);
+  guint32 *in = zalloc_aligned_or_die(sparrow->in.size);
+  /*the patterns stay up for several frames, so the camera only needs to
+    look again when the one drawn changes */
+  int drawn = -1;
+  int seen = -1;
+  for (int f = 1; fl->state == EDGES_FIND_LINES; f++){
+    if (drawn != seen){
+      see_output(sparrow, view, out, in, f);
+      seen = drawn;
+    }
+    drawn = fl->gray_pattern;
+    draw_gray_codes(sparrow, fl, (guint8 *)in, (guint8 *)out);
+  }
+  free(out);
+  free(in);
+  keep_lines(sparrow, fl, found);
+  sparrow->gray_code = FALSE;
+}
+
+static gboolean
+cluster_centre(sparrow_cluster_t *c, double *x, double *y){
+  double sx = 0, sy = 0, ss = 0;
+  for (int i = 0; i < c->n; i++){
+    sx += C2F(c->voters[i].x) * c->voters[i].signal;
+    sy += C2F(c->voters[i].y) * c->voters[i].signal;
+    ss += c->voters[i].signal;
+  }
+  if (ss == 0){
+    return FALSE;
+  }
+  *x = sx / ss;
+  *y = sy / ss;
+  return TRUE;
+}
+
+/*pixels both ways put in a line should be put in the same one, and the
+  clusters should be centred in the same places */
+static int
+compare_gray(GstSparrow *sparrow, camera_view_t *view, found_lines_t *ref){
+  found_lines_t gray;
+  find_lines_gray(sparrow, view, &gray);
+
+  guint32 both = 0;
+  guint32 differ = 0;
+  for (guint32 i = 0; i < sparrow->in.pixcount; i++){
+    for (int dir = 0; dir < 2; dir++){
+      sparrow_intersect_t *a = &ref->map[i];
+      sparrow_intersect_t *b = &gray.map[i];
+      if (a->signal[dir] && b->signal[dir] &&
+          a->lines[dir] != BAD_PIXEL && b->lines[dir] != BAD_PIXEL){
+        both++;
+        differ += (a->lines[dir] != b->lines[dir]);
+      }
+    }
+  }
+  guint32 n_ref = 0;
+  guint32 n_both = 0;
+  double dx = 0, dy = 0, worst = 0;
+  for (guint32 i = 0; i < ref->n_clusters; i++){
+    double ax, ay, bx, by;
+    if (! cluster_centre(&ref->clusters[i], &ax, &ay)){
+      continue;
+    }
+    n_ref++;
+    if (! cluster_centre(&gray.clusters[i], &bx, &by)){
+      continue;
+    }
+    n_both++;
+    dx += bx - ax;
+    dy += by - ay;
+    worst = MAX(worst, hypot(bx - ax, by - ay));
+  }
+  dx /= MAX(n_both, 1);
+  dy /= MAX(n_both, 1);
+  int ok = (both > sparrow->in.pixcount / 100 && differ * 100 <= both &&
+      n_both * 10 >= n_ref * 9 && fabs(dx) < GRAY_MEAN_ERROR &&
+      fabs(dy) < GRAY_MEAN_ERROR && worst < GRAY_MAX_ERROR);
+  printf("gray codes: %u of %u map pixels put in other lines; %u of %u clusters, "
+      "off by %.2f, %.2f on average, %.2f at worst %s\n", differ, both, n_both, n_ref,
+      dx, dy, worst, ok ? "ok" : "WRONG");
+  free_lines(&gray);
+  return ! ok;
+}
+
+/*half of each of two frames, as a camera exposure straddling them sees
+  (rounding up, so two frames the same blend to that frame) */
+static void
+blend_frames(GstSparrow *sparrow, const guint32 *a, const guint32 *b, guint32 *mixed){
+  for (guint32 i = 0; i < sparrow->out.pixcount; i++){
+    mixed[i] = (((a[i] >> 1) & 0x7f7f7f7f) + ((b[i] >> 1) & 0x7f7f7f7f) +
+        ((a[i] | b[i]) & 0x01010101));
+  }
+}
+
+/*run find_edges in adaptive-lines mode from where it starts drawing lines,
+  with the camera's lag wandering between 1 and MAX_LATE frames (but never
+  going back to a frame it has already seen past) */
+static int
+find_lines_adaptive(GstSparrow *sparrow, camera_view_t *view, found_lines_t *found){
+  dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED);
+  sparrow->adaptive_lines = TRUE;
+  sparrow->lag = MAX_LATE - 1;
+  init_find_edges(sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
+  memset(fl->threshold->imageData, NOISE, sparrow->in.size);
+  jump_state(sparrow, fl, EDGES_FIND_LINES);
+  guint32 *history[HISTORY];
+  /*the noise goes with the line, so it is as line by line */
+  guint32 seeds[HISTORY];
+  for (int i = 0; i < HISTORY; i++){
+    history[i] = zalloc_aligned_or_die(sparrow->out.size);
+    seeds[i] = 0;
+  }
+  guint32 *mixed = malloc_aligned_or_die(sparrow->out.size);
+  guint32 *in = malloc_aligned_or_die(sparrow->in.size);
+  guint32 rng = TEST_RNG_SEED;
+  int shown = 0;
+  int f;
+  for (f = 1; fl->state == EDGES_FIND_LINES; f++){
+    int late = 1 + rand_r(&rng) % MAX_LATE;
+    int last = shown;
+    shown = MAX(shown, f - late);
+    const guint32 *seen = history[shown % HISTORY];
+    /*when it moves on, sometimes the exposure straddles the change */
+    if (shown != last && rand_r(&rng) % 2){
+      blend_frames(sparrow, history[last % HISTORY], seen, mixed);
+      seen = mixed;
+    }
+    see_output(sparrow, view, seen, in, seeds[shown % HISTORY]);
+    draw_lines_adaptive(sparrow, fl, (guint8 *)in, (guint8 *)history[f % HISTORY]);
+    seeds[f % HISTORY] = fl->current + 1;
+  }
+  for (int i = 0; i < HISTORY; i++){
+    free(history[i]);
+  }
+  free(mixed);
+  free(in);
+  keep_lines(sparrow, fl, found);
+  sparrow->adaptive_lines = FALSE;
+  sparrow->lag = 0;
+  return f - 1;
+}
+
+static int
+compare_adaptive(GstSparrow *sparrow, camera_view_t *view, found_lines_t *ref){
+  found_lines_t found;
+  int frames = find_lines_adaptive(sparrow, view, &found);
+  guint32 differ = 0;
+  for (guint32 i = 0; i < sparrow->in.pixcount; i++){
+    differ += (memcmp(&ref->map[i], &found.map[i], sizeof(sparrow_intersect_t)) != 0);
+  }
+  int ok = (found.n_seen == ref->n_seen && differ == 0);
+  guint32 n_lines = (sparrow->out.width + LINE_PERIOD - 1) / LINE_PERIOD +
+    (sparrow->out.height + LINE_PERIOD - 1) / LINE_PERIOD;
+  printf("adaptive lines: %u of %u lines seen (%u line by line) in %d frames, "
+      "rather than %u; %u map pixels differ %s\n", found.n_seen, n_lines, ref->n_seen,
+      frames, n_lines * (MAX_LATE - 1 + SAFETY_LAG), differ, ok ? "ok" : "WRONG");
+  free_lines(&found);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  if (! g_thread_supported()){
+    g_thread_init(NULL);
+  }
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  sparrow.colour = SPARROW_GREEN;
+  init_threads(&sparrow);
+  guint32 *in = malloc_aligned_or_die(sparrow.in.size);
+
+  guint32 t_full, t_roi;
+  sparrow_intersect_t *ref = find_lines(&sparrow, in, FALSE, &t_full);
+  sparrow_intersect_t *map = find_lines(&sparrow, in, TRUE, &t_roi);
+
+  guint32 differ = 0;
+  for (guint32 i = 0; i < sparrow.in.pixcount; i++){
+    differ += (memcmp(&ref[i], &map[i], sizeof(sparrow_intersect_t)) != 0);
+  }
+  printf("find lines: whole frames %u microseconds, predicted boxes %u (%.1fx); "
+      "%u map pixels differ %s\n", t_full, t_roi, (double)t_full / MAX(t_roi, 1),
+      differ, differ ? "MISMATCH" : "ok");
+  free(ref);
+  free(map);
+  free(in);
+
+  camera_view_t view;
+  found_lines_t one_by_one;
+  init_camera_view(&sparrow, &view);
+  find_lines_one_by_one(&sparrow, &view, &one_by_one);
+  int fails = (differ != 0);
+  fails += compare_gray(&sparrow, &view, &one_by_one);
+  fails += compare_adaptive(&sparrow, &view, &one_by_one);
+  free_lines(&one_by_one);
+  finalise_camera_view(&view);
+  finalise_threads(&sparrow);
+  finalise_test_sparrow(&sparrow);
+  return fails != 0;
+}
@@ -0,0 +1,216 @@
+/*find the screen (floodfill.c) in a simulated camera frame -- a bright
+  keystoned screen with dark specks of dirt on it, on a dark background with
+  a few bright spots off the screen -- and check the mask agrees with the one
+  the old find_screen made with cvCanny, cvDilate and the byte flood fills.
+  The edges are found differently, so along the screen's border the masks
+  can be a pixel out; away from it they have to be the same. */
+#include "floodfill.c"
+#include "cv.h"
+#include "floodfill.h"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+/*the corners of the screen, clockwise from the top left */
+static const double screen[4][2] = {
+  {200, 100}, {1100, 140}, {1060, 640}, {240, 600}
+};
+#define BACKGROUND 40
+#define SCREEN 200
+#define NOISE 8
+#define SPOTS 12
+#define SPOT_SIZE 8
+#define SPOT 230
+#define DIRT 20
+#define DIRT_SIZE 5
+#define SPECK 70
+/*pixels this near the screen's border may be in one mask but not the other */
+#define BORDER_SLACK 4
+/*but no more of them than this many for each pixel of the border's length */
+#define BORDER_MAX_DIFF 1.5
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+/*how far inside the screen's border a point is (negative outside) */
+static double
+screen_depth(double x, double y){
+  double inside = 1e9;
+  double outside = 0;
+  for (int i = 0; i < 4; i++){
+    const double *a = screen[i];
+    const double *b = screen[(i + 1) % 4];
+    double ex = b[0] - a[0];
+    double ey = b[1] - a[1];
+    double d = ((x - a[0]) * ey - (y - a[1]) * ex) / sqrt(ex * ex + ey * ey);
+    /*the corners go clockwise, with y down, so inside is negative */
+    inside = MIN(inside, -d);
+    outside = MAX(outside, d);
+  }
+  return (outside > 0) ? -outside : inside;
+}
+
+static double
+screen_perimeter(void){
+  double p = 0;
+  for (int i = 0; i < 4; i++){
+    const double *a = screen[i];
+    const double *b = screen[(i + 1) % 4];
+    p += hypot(b[0] - a[0], b[1] - a[1]);
+  }
+  return p;
+}
+
+/*paint a square of the given brightness wherever it lands on the screen
+  (on) or off it */
+static void
+fake_blobs(GstSparrow *sparrow, guint8 *grey, int n, int size, int value, gboolean on){
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  for (int k = 0; k < n;){
+    int x = rng_uniform_int(sparrow, w - size);
+    int y = rng_uniform_int(sparrow, h - size);
+    double depth = screen_depth(x + size / 2, y + size / 2);
+    if ((on && depth < size * 2) || (! on && depth > -size * 2) ||
+        (abs(x - w / 2) < size * 2 && abs(y - h / 2) < size * 2)){
+      continue;
+    }
+    for (int yy = y; yy < y + size; yy++){
+      memset(grey + yy * w + x, value, size);
+    }
+    k++;
+  }
+}
+
+/*the screen with antialiased edges, the blobs, and noise on it all, in grey
+  so it doesn't matter which channel is looked at */
+static void
+fake_camera(GstSparrow *sparrow, guint32 *in){
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  guint8 *grey = malloc_or_die(sparrow->in.pixcount);
+  for (int y = 0; y < h; y++){
+    for (int x = 0; x < w; x++){
+      int covered = 0;
+      for (int j = 0; j < 16; j++){
+        covered += screen_depth(x + (j & 3) * 0.25, y + (j >> 2) * 0.25) > 0;
+      }
+      grey[y * w + x] = BACKGROUND + (SCREEN - BACKGROUND) * covered / 16;
+    }
+  }
+  fake_blobs(sparrow, grey, SPOTS, SPOT_SIZE, SPOT, FALSE);
+  fake_blobs(sparrow, grey, DIRT, DIRT_SIZE, SPECK, TRUE);
+  for (guint32 i = 0; i < sparrow->in.pixcount; i++){
+    int g = grey[i] + rng_uniform_int(sparrow, 2 * NOISE + 1) - NOISE;
+    in[i] = CLAMP(g, 0, 255) * 0x010101;
+  }
+  free(grey);
+}
+
+/*find_screen as it was before the bitmasks: the returned image is 255 on
+  the screen */
+static IplImage *
+old_find_screen(GstSparrow *sparrow, guint8 *in){
+  guint32 gshift = sparrow->in.gshift;
+  int w = sparrow->in.width;
+  int h = sparrow->in.height;
+  CvSize size = {w, h};
+  CvPoint middle = {w / 2, h / 2};
+  CvPoint corner = {0, 0};
+  IplImage *im = cvCreateImage(size, IPL_DEPTH_8U, PIXSIZE);
+  IplImage *green = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  IplImage *working = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  IplImage *mask = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  memcpy(im->imageData, in, sparrow->in.size);
+  cvSplit(im,
+      (gshift == 24) ? green : NULL,
+      (gshift == 16) ? green : NULL,
+      (gshift ==  8) ? green : NULL,
+      (gshift ==  0) ? green : NULL);
+  cvCanny(green, mask, 100, 170, 3);
+  cvDilate(mask, mask, NULL, 1);
+  memset(working->imageData, 255, w * h);
+  floodfill_mono_spans(mask, working, middle);
+  memset(mask->imageData, 255, w * h);
+  floodfill_mono_spans(working, mask, corner);
+  cvDilate(mask, mask, NULL, 1);
+  cvReleaseImage(&im);
+  cvReleaseImage(&green);
+  cvReleaseImage(&working);
+  return mask;
+}
+
+/*run mode_find_screen from when it has seen the white frame to the end */
+static sparrow_state
+find_screen(GstSparrow *sparrow, guint8 *in){
+  GstBuffer *inbuf = gst_buffer_new();
+  GstBuffer *outbuf = gst_buffer_new();
+  GST_BUFFER_DATA(inbuf) = in;
+  GST_BUFFER_DATA(outbuf) = malloc_aligned_or_die(sparrow->out.size);
+  sparrow_state state = SPARROW_STATUS_QUO;
+  init_find_screen(sparrow);
+  for (sparrow->countdown = 3; sparrow->countdown && state == SPARROW_STATUS_QUO;){
+    state = mode_find_screen(sparrow, inbuf, outbuf);
+  }
+  finalise_find_screen(sparrow);
+  free(GST_BUFFER_DATA(outbuf));
+  GST_BUFFER_DATA(inbuf) = NULL;
+  GST_BUFFER_DATA(outbuf) = NULL;
+  gst_buffer_unref(inbuf);
+  gst_buffer_unref(outbuf);
+  return state;
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  int w = sparrow.in.width;
+  int h = sparrow.in.height;
+  bitmask_init(&sparrow.screenmask, w, h);
+  guint32 *in = malloc_aligned_or_die(sparrow.in.size);
+  fake_camera(&sparrow, in);
+
+  struct timeval tv1, tv2, tv3;
+  gettimeofday(&tv1, NULL);
+  IplImage *old = old_find_screen(&sparrow, (guint8 *)in);
+  gettimeofday(&tv2, NULL);
+  sparrow_state state = find_screen(&sparrow, (guint8 *)in);
+  gettimeofday(&tv3, NULL);
+
+  guint8 *ref = (guint8 *)old->imageData;
+  guint32 on_old = 0, on_new = 0, border_diff = 0, wrong = 0;
+  for (int y = 0; y < h; y++){
+    for (int x = 0; x < w; x++){
+      gboolean a = ref[y * w + x] != 0;
+      gboolean b = bitmask_test(&sparrow.screenmask, x, y);
+      on_old += a;
+      on_new += b;
+      if (fabs(screen_depth(x + 0.5, y + 0.5)) < BORDER_SLACK){
+        border_diff += (a != b);
+      }
+      else {
+        wrong += (a != b);
+      }
+    }
+  }
+  double perimeter = screen_perimeter();
+  int ok = (state == SPARROW_NEXT_STATE && wrong == 0 &&
+      border_diff <= perimeter * BORDER_MAX_DIFF);
+  printf("screen mask %u pixels, old one %u; %u differ near the border "
+      "(%0.2f per pixel of it), %u away from it %s\n", on_new, on_old,
+      border_diff, border_diff / perimeter, wrong, ok ? "ok" : "WRONG");
+  printf("old find_screen took %u microseconds, new %u\n", elapsed(&tv1, &tv2),
+      elapsed(&tv2, &tv3));
+
+  cvReleaseImage(&old);
+  free(in);
+  bitmask_free(&sparrow.screenmask);
+  finalise_test_sparrow(&sparrow);
+  return ! ok;
+}
@@ -0,0 +1,279 @@
+/*drive find_self (calibrate.c) with a simulated camera that sees the
+  projector's output some frames late, shifted across and down, with noisy
+  low bits, and check it finds the lag. A camera that sees the frame just
+  output has no lag, as far as sparrow is concerned. Then do the same with
+  two projectors flashing Gold codes (the code property) into one camera,
+  each with its own lag. Build with -DCALIBRATE_USE_ROI=0 to do it all over
+  the whole frame; the lags found should match.
+
+  With the ROI, also check it covers the pixels around each word that
+  changed, though the rows don't fill whole words, and that a camera that
+  sees only something else flickering at first (so the ROI is chosen
+  around that) still finds the lag once it sees the projector.
+
+  Then check find_lag's votes directly: a few pixels that see the pattern
+  cleanly have to outvote more that see it at another lag, with as many
+  frames wrong as can still vote. */
+#include "calibrate.c"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define WIDTH 800
+#define HEIGHT 600
+/*more than MAX_CALIBRATION_LAG, so any lag can be looked up */
+#define HISTORY 16
+#define MAX_FRAMES 600
+#define MAX_PROJECTORS 2
+/*in the blind case, the camera sees only this box flickering until then */
+#define DECOY_X 700
+#define DECOY_Y 500
+#define DECOY_SIZE 64
+#define BLIND_FRAMES 100
+/*the vote weighting check: the sides of the clean and poor patches, and
+  how often the poor ones see a frame wrong */
+#define CLEAN_SIZE 32
+#define POOR_SIZE 64
+#define POOR_PERIOD 12
+#define VOTE_FRAMES (LAG_PLANES + HISTORY)
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+typedef struct projector_s {
+  GstSparrow sparrow;
+  int lag;   /*frames late */
+  int dx;    /*where its output lands in the camera */
+  int dy;
+  int found;
+  int frames;
+  guint8 *history[HISTORY];
+} projector_t;
+
+/*The camera sees each projector's output from lag frames ago, shifted
+  right and down, with the light adding up where they overlap. If it is
+  blind, it sees only a flickering box for the first BLIND_FRAMES frames. */
+static void
+fake_camera(GstSparrow *sparrow, guint32 *in, projector_t *p, int n, int f,
+    gboolean blind){
+  gboolean flicker = blind && rng_uniform_int(sparrow, 2);
+  for (int y = 0; y < HEIGHT; y++){
+    for (int x = 0; x < WIDTH; x++){
+      guint32 light = rng_uniform_int(sparrow, 64);
+      if (flicker && x >= DECOY_X && x < DECOY_X + DECOY_SIZE &&
+          y >= DECOY_Y && y < DECOY_Y + DECOY_SIZE){
+        light += 0xff;
+      }
+      for (int k = 0; k < n && ! (blind && f < BLIND_FRAMES); k++){
+        guint32 *src = (guint32 *)p[k].history[(f - p[k].lag + HISTORY) % HISTORY];
+        int sx = x - p[k].dx;
+        int sy = y - p[k].dy;
+        if (sx >= 0 && sy >= 0 && src[sy * WIDTH + sx]){
+          light += 0xff;
+        }
+      }
+      in[y * WIDTH + x] = MIN(light, 0xff) << 8;
+    }
+  }
+}
+
+static int
+find_self(const char *what, const int *lags, const int *codes, int n, gboolean blind){
+  projector_t p[MAX_PROJECTORS];
+  for (int k = 0; k < n; k++){
+    GstSparrow *sparrow = &p[k].sparrow;
+    init_test_sparrow(sparrow);
+    /*so the projectors put their squares in different places */
+    dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED + k);
+    init_test_format(&sparrow->in, WIDTH, HEIGHT);
+    init_test_format(&sparrow->out, WIDTH, HEIGHT);
+    sparrow->code = codes[k];
+    init_threads(sparrow);
+    init_find_self(sparrow);
+    p[k].lag = lags[k];
+    p[k].dx = WIDTH / 4 - k * WIDTH / 8;
+    p[k].dy = HEIGHT / 8 + k * HEIGHT / 16;
+    p[k].found = 0;
+    p[k].frames = 0;
+    for (int i = 0; i < HISTORY; i++){
+      p[k].history[i] = zalloc_aligned_or_die(sparrow->out.size);
+    }
+  }
+  GstSparrow *camera = &p[0].sparrow;
+  GstBuffer *inbuf = gst_buffer_new();
+  GstBuffer *outbuf = gst_buffer_new();
+  GST_BUFFER_DATA(inbuf) = malloc_aligned_or_die(camera->in.size);
+  GST_BUFFER_SIZE(inbuf) = camera->in.size;
+  GST_BUFFER_SIZE(outbuf) = camera->out.size;
+
+  int left = n;
+  for (int f = 0; f < MAX_FRAMES && left; f++){
+    fake_camera(camera, (guint32 *)GST_BUFFER_DATA(inbuf), p, n, f, blind);
+    for (int k = 0; k < n; k++){
+      guint8 *out = p[k].history[f % HISTORY];
+      if (p[k].found){
+        /*on to the next stage, which starts dark */
+        memset(out, 0, camera->out.size);
+        continue;
+      }
+      GST_BUFFER_DATA(outbuf) = out;
+      p[k].found = (mode_find_self(&p[k].sparrow, inbuf, outbuf) == SPARROW_NEXT_STATE);
+      p[k].frames = f + 1;
+      left -= p[k].found;
+    }
+  }
+
+  int fails = 0;
+  for (int k = 0; k < n; k++){
+    GstSparrow *sparrow = &p[k].sparrow;
+    sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow->helper_struct;
+    int ok = p[k].found && sparrow->lag == (guint32)p[k].lag - 1;
+    char roi[40];
+    if (calibrate->roi_words){
+      snprintf(roi, sizeof(roi), "ROI %u of %u words", calibrate->roi_count,
+          calibrate->plane_words);
+    }
+    else {
+      snprintf(roi, sizeof(roi), "whole frame");
+    }
+    printf("%s, code %d, camera %d frames late: %s lag %u after %d frames, %s %s\n",
+        what, codes[k], p[k].lag, p[k].found ? "found" : "did not find",
+        sparrow->lag, p[k].frames, roi, ok ? "ok" : "WRONG");
+    fails += ! ok;
+  }
+
+  free(GST_BUFFER_DATA(inbuf));
+  GST_BUFFER_DATA(inbuf) = NULL;
+  GST_BUFFER_DATA(outbuf) = NULL;
+  gst_buffer_unref(inbuf);
+  gst_buffer_unref(outbuf);
+  for (int k = 0; k < n; k++){
+    for (int i = 0; i < HISTORY; i++){
+      free(p[k].history[i]);
+    }
+    finalise_find_self(&p[k].sparrow);
+    finalise_threads(&p[k].sparrow);
+    finalise_test_sparrow(&p[k].sparrow);
+  }
+  return fails;
+}
+
+/*mark one word as active, and check the pixels above and below each of its
+  pixels (and diagonally) are in the ROI */
+static int
+roi_neighbours(void){
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  init_test_format(&sparrow.in, WIDTH, HEIGHT);
+  init_test_format(&sparrow.out, WIDTH, HEIGHT);
+  init_find_self(&sparrow);
+  sparrow_calibrate_t *calibrate = (sparrow_calibrate_t *)sparrow.helper_struct;
+  int missing = 0;
+  int tries = 0;
+  for (guint32 w = 100; w < 200; w += 7, tries++){
+    if (calibrate->activity == NULL){
+      calibrate->activity = zalloc_or_die(calibrate->plane_words);
+    }
+    memset(calibrate->activity, 0, calibrate->plane_words);
+    calibrate->activity[w] = 255;
+    free(calibrate->roi_words);
+    calibrate->roi_words = NULL;
+    choose_roi(&sparrow);
+    for (int j = 0; j < 64; j++){
+      for (int dy = -1; dy <= 1; dy += 2){
+        for (int dx = -1; dx <= 1; dx++){
+          guint32 near = (w * 64 + j + dy * WIDTH + dx) / 64;
+          guint32 k;
+          for (k = 0; k < calibrate->roi_count && calibrate->roi_words[k] != near; k++);
+          missing += (k == calibrate->roi_count);
+        }
+      }
+    }
+  }
+  printf("ROI around %d words, %d pixels wide: %d pixels around them missed %s\n",
+      tries, WIDTH, missing, missing ? "WRONG" : "ok");
+  finalise_find_self(&sparrow);
+  finalise_test_sparrow(&sparrow);
+  return missing != 0;
+}
+
+/*light a square of the frame if it sees the pattern on */
+static void
+fake_patch(guint32 *in, int x0, int y0, int size, gboolean on){
+  for (int y = y0; y < y0 + size && on; y++){
+    for (int x = x0; x < x0 + size; x++){
+      in[y * WIDTH + x] = 0xff << 8;
+    }
+  }
+}
+
+/*record frames where CLEAN_SIZE squared pixels see the pattern lag frames
+  late, and POOR_SIZE squared see it poor_lag frames late with
+  CALIBRATE_MAX_VOTE_ERROR of the recorded frames wrong, then ask find_lag.
+  The poor pixels outnumber the clean ones, so this only finds the lag if
+  better matches carry more weight. */
+static int
+vote_weights(int lag, int poor_lag){
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  init_test_format(&sparrow.in, WIDTH, HEIGHT);
+  init_test_format(&sparrow.out, WIDTH, HEIGHT);
+  init_threads(&sparrow);
+  init_find_self(&sparrow);
+  guint32 *in = malloc_aligned_or_die(sparrow.in.size);
+  gboolean on[VOTE_FRAMES];
+  for (int f = 0; f < VOTE_FRAMES; f++){
+    int age = VOTE_FRAMES - 1 - f;
+    gboolean wrong = (age % POOR_PERIOD == POOR_PERIOD / 2 &&
+        age < POOR_PERIOD * CALIBRATE_MAX_VOTE_ERROR);
+    memset(in, 0, sparrow.in.size);
+    fake_patch(in, 100, 100, CLEAN_SIZE, f >= lag && on[f - lag]);
+    fake_patch(in, 400, 300, POOR_SIZE, (f >= poor_lag && on[f - poor_lag]) ^ wrong);
+    record_calibration(&sparrow, in);
+    if (f < VOTE_FRAMES - 1){
+      /*as in mode_find_self, the pattern moves on after the search */
+      on[f] = cycle_pattern(&sparrow);
+    }
+  }
+  int found = find_lag(&sparrow);
+  int ok = found && sparrow.lag == (guint32)lag - 1;
+  printf("%d clean pixels %d frames late, %d with %d errors %d frames late: "
+      "%s lag %u %s\n", CLEAN_SIZE * CLEAN_SIZE, lag, POOR_SIZE * POOR_SIZE,
+      CALIBRATE_MAX_VOTE_ERROR, poor_lag, found ? "found" : "did not find",
+      sparrow.lag, ok ? "ok" : "WRONG");
+  free(in);
+  finalise_find_self(&sparrow);
+  finalise_threads(&sparrow);
+  finalise_test_sparrow(&sparrow);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  if (! g_thread_supported()){
+    g_thread_init(NULL);
+  }
+  int fails = 0;
+  const int random[] = {0};
+  for (int lag = 1; lag <= MAX_CALIBRATION_LAG; lag += 3){
+    fails += find_self("one projector", &lag, random, 1, FALSE);
+  }
+  const int codes[] = {1, 2};
+  const int lags[][2] = {{3, 8}, {5, 5}, {11, 2}};
+  for (int i = 0; i < 3; i++){
+    fails += find_self("two projectors", lags[i], codes, 2, FALSE);
+  }
+  if (CALIBRATE_USE_ROI){
+    fails += roi_neighbours();
+    const int lag = 6;
+    fails += find_self("blind at first", &lag, random, 1, TRUE);
+  }
+  fails += vote_weights(4, 9);
+  fails += vote_weights(9, 2);
+  return fails != 0;
+}
@@ -0,0 +1,136 @@
+/*check the blue noise dither tile, and the fixed point lut (full_lut.h)
+  against the float one on a 1920x1080 projector, dithering both with the
+  same tile, and time them. */
+#include "test_common.h"
+#include "edges.h"
+#include "bitmask.h"
+#include "full_lut.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+/*the mesh complete_map and calculate_deltas would make */
+static void
+fake_mesh(sparrow_corner_t *mesh, int width, int height){
+  for (int y = 0; y < height; y++){
+    for (int x = 0; x < width; x++){
+      sparrow_corner_t *c = &mesh[y * width + x];
+      /*vertical lines are at x, horizontal ones at y */
+      double u = V_LINE_OFFSET + x * LINE_PERIOD;
+      double v = H_LINE_OFFSET + y * LINE_PERIOD;
+      double cx, cy, rx, ry, dx, dy;
+      project(u, v, &cx, &cy);
+      project(u + LINE_PERIOD, v, &rx, &ry);
+      project(u, v + LINE_PERIOD, &dx, &dy);
+      c->x = cx;
+      c->y = cy;
+      c->dxr = (rx - cx) / LINE_PERIOD;
+      c->dyr = (ry - cy) / LINE_PERIOD;
+      c->dxd = (dx - cx) / LINE_PERIOD;
+      c->dyd = (dy - cy) / LINE_PERIOD;
+      c->status = CORNER_SETTLED;
+    }
+  }
+}
+
+/*every byte value equally often, and the darkest eighth evenly spread: no
+  two of them side by side */
+static int
+check_tile(const guint8 *tile){
+  int counts[256] = {0};
+  int i;
+  for (i = 0; i < DITHER_TILE_PIXELS; i++){
+    counts[tile[i]]++;
+  }
+  int flat = 1;
+  for (i = 0; i < 256; i++){
+    flat &= (counts[i] == DITHER_TILE_PIXELS / 256);
+  }
+  int touching = 0;
+  for (int y = 0; y < DITHER_TILE_SIZE; y++){
+    for (int x = 0; x < DITHER_TILE_SIZE; x++){
+      int right = y * DITHER_TILE_SIZE + ((x + 1) & DITHER_TILE_MASK);
+      int down = ((y + 1) & DITHER_TILE_MASK) * DITHER_TILE_SIZE + x;
+      if (tile[y * DITHER_TILE_SIZE + x] < 32){
+        touching += (tile[right] < 32) + (tile[down] < 32);
+      }
+    }
+  }
+  printf("dither tile: %s histogram, %d neighbouring pairs in the darkest eighth\n",
+      flat ? "flat" : "UNEVEN", touching);
+  return ! flat || touching;
+}
+
+int main(int argc, char **argv)
+{
+  struct timeval tv1, tv2;
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  bitmask_init(&sparrow.screenmask, sparrow.in.width, sparrow.in.height);
+  bitmask_set_all(&sparrow.screenmask);
+  int fails = 0;
+
+  guint8 *tile = malloc_aligned_or_die(DITHER_TILE_PIXELS);
+  gettimeofday(&tv1, NULL);
+  make_blue_noise_tile(&sparrow, tile);
+  gettimeofday(&tv2, NULL);
+  printf("made the dither tile in %u microseconds\n", elapsed(&tv1, &tv2));
+  fails += check_tile(tile);
+
+  int mesh_w = (sparrow.out.width + LINE_PERIOD - 1) / LINE_PERIOD;
+  int mesh_h = (sparrow.out.height + LINE_PERIOD - 1) / LINE_PERIOD;
+  sparrow_corner_t *mesh = malloc_or_die(mesh_w * mesh_h * sizeof(sparrow_corner_t));
+  fake_mesh(mesh, mesh_w, mesh_h);
+
+  guint32 n = sparrow.out.pixcount;
+  double *dither = malloc_aligned_or_die(n * sizeof(double));
+  for (guint32 i = 0; i < n; i++){
+    int x = i % sparrow.out.width;
+    int y = i / sparrow.out.width;
+    dither[i] = tile[(y & DITHER_TILE_MASK) * DITHER_TILE_SIZE +
+        (x & DITHER_TILE_MASK)] / 256.0;
+  }
+  guint32 *ref = zalloc_aligned_or_die(n * sizeof(guint32));
+  guint32 *lut = zalloc_aligned_or_die(n * sizeof(guint32));
+
+  gettimeofday(&tv1, NULL);
+  for (int mcy = 0; mcy < mesh_h - 1; mcy++){
+    lut_row_float(&sparrow, mesh, mesh_w, dither, ref, mcy);
+  }
+  gettimeofday(&tv2, NULL);
+  guint32 t_float = elapsed(&tv1, &tv2);
+
+  gettimeofday(&tv1, NULL);
+  for (int mcy = 0; mcy < mesh_h - 1; mcy++){
+    lut_row_fixed(&sparrow, mesh, mesh_w, tile, lut, mcy);
+  }
+  gettimeofday(&tv2, NULL);
+  guint32 t_fixed = elapsed(&tv1, &tv2);
+
+  /*float and fixed point rounding can only disagree when a position is
+    within a rounding error of a pixel edge */
+  guint32 differ = 0;
+  int worst = 0;
+  for (guint32 i = 0; i < n; i++){
+    if (lut[i] != ref[i]){
+      int dx = abs((int)(lut[i] % sparrow.in.width) - (int)(ref[i] % sparrow.in.width));
+      int dy = abs((int)(lut[i] / sparrow.in.width) - (int)(ref[i] / sparrow.in.width));
+      worst = MAX(worst, MAX(dx, dy));
+      differ++;
+    }
+  }
+  int ok = (worst <= 1 && differ * 1000 < n);
+  printf("lut: float %u microseconds, fixed %u (%.1fx); %u pixels differ, "
+      "by at most %d %s\n", t_float, t_fixed, (double)t_float / MAX(t_fixed, 1),
+      differ, worst, ok ? "ok" : "MISMATCH");
+  fails += ! ok;
+
+  free(tile);
+  free(mesh);
+  free(dither);
+  free(ref);
+  free(lut);
+  bitmask_free(&sparrow.screenmask);
+  finalise_test_sparrow(&sparrow);
+  return fails != 0;
+}
@@ -0,0 +1,99 @@
+/*compare decoding a jpeg with a fresh decompressor each time
+  (decompress_buffer) against the reused one that play uses
+  (begin_reading_jpeg/read_lines/finish_reading_jpeg). */
+#include "test_common.h"
+#include <stdio.h>
+#include "jpeglib.h"
+
+static const int INSIZE = 1000000;
+static const char *FN_IN = "test.jpg";
+static const int cycles = 200;
+
+int main(int argc, char **argv)
+{
+  const char *fn = (argc > 1) ? argv[1] : FN_IN;
+  guint8* inbuffer = malloc_aligned_or_die(INSIZE);
+  FILE *in = fopen(fn, "r");
+  if (in == NULL){
+    printf("can't open %s\n", fn);
+    return 1;
+  }
+  int size = fread(inbuffer, 1, INSIZE, in);
+  fclose(in);
+
+  struct timeval tv1, tv2;
+  guint32 t;
+  int width, height;
+
+  /*the old way: create and destroy a decompressor for every frame */
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+
+  /*first one finds the size */
+  guint8* scratch = malloc_aligned_or_die(4096 * 4096 * 4);
+  jpeg_create_decompress(&cinfo);
+  decompress_buffer(&cinfo, inbuffer, size, scratch, &width, &height);
+  jpeg_destroy_decompress(&cinfo);
+  guint8* outbuffer = malloc_aligned_or_die(width * height * 4);
+  guint8* outbuffer2 = malloc_aligned_or_die(width * height * 4);
+  free(scratch);
+
+  gettimeofday(&tv1, NULL);
+  for (int i = 0; i < cycles; i++){
+    jpeg_create_decompress(&cinfo);
+    decompress_buffer(&cinfo, inbuffer, size, outbuffer, &width, &height);
+    jpeg_destroy_decompress(&cinfo);
+  }
+  gettimeofday(&tv2, NULL);
+  t = elapsed(&tv1, &tv2);
+  printf("%dx%d, create/destroy each frame: %u microseconds per frame\n",
+      width, height, t / cycles);
+
+  /*the new way, as in play.c */
+  GstSparrow sparrow;
+  memset(&sparrow, 0, sizeof(sparrow));
+  sparrow.out.width = width;
+  sparrow.out.height = height;
+  sparrow.out.rshift = 16; /*JCS_EXT_BGRX, as in decompress_buffer */
+  init_jpeg_src(&sparrow);
+
+  gettimeofday(&tv1, NULL);
+  for (int i = 0; i < cycles; i++){
+    begin_reading_jpeg(&sparrow, inbuffer, size);
+    read_lines(&sparrow, outbuffer2, height);
+    finish_reading_jpeg(&sparrow);
+  }
+  gettimeofday(&tv2, NULL);
+  t = elapsed(&tv1, &tv2);
+  printf("%dx%d, reused decompressor:     %u microseconds per frame\n",
+      width, height, t / cycles);
+
+  /*and one with an early finish, and one that isn't the output size (as a
+  headerless index can hold), which have to leave it in a usable state */
+  begin_reading_jpeg(&sparrow, inbuffer, size);
+  read_lines(&sparrow, outbuffer2, height / 2);
+  finish_reading_jpeg(&sparrow);
+  sparrow.out.width = width / 2;
+  gboolean refused = ! begin_reading_jpeg(&sparrow, inbuffer, size);
+  sparrow.out.width = width;
+  begin_reading_jpeg(&sparrow, inbuffer, size);
+  read_lines(&sparrow, outbuffer2, height);
+  finish_reading_jpeg(&sparrow);
+
+  if (! refused){
+    printf("a jpeg the wrong size was not refused!\n");
+    return 1;
+  }
+  if (memcmp(outbuffer, outbuffer2, width * height * 4)){
+    printf("outputs differ!\n");
+    return 1;
+  }
+  printf("wrong size refused, outputs match\n");
+
+  finalise_jpeg_src(&sparrow);
+  free(outbuffer);
+  free(outbuffer2);
+  free(inbuffer);
+  return 0;
+}
@@ -8,7 +8,7 @@
 
 //#include "jpeg_src.c"
 
-static const int INSIZE = 100000;
+static const int INSIZE = 1000000;
 static const int OUTSIZE = 800 * 600 * 4;
 static const char *FN_IN = "test.jpg";
 static const char *FN_OUT = "test.ppm";
@@ -20,13 +20,15 @@ int main(int argc, char **argv)
   guint8* outbuffer = malloc_aligned_or_die(OUTSIZE);
 
   FILE *in = fopen(FN_IN, "r");
-  int size = fread(inbuffer, INSIZE, 1, in);
+  int size = fread(inbuffer, 1, INSIZE, in);
+  fclose(in);
 
   struct timeval tv1, tv2;
   guint32 t;
   int width, height;
 
   GstSparrow sparrow;
+  memset(&sparrow, 0, sizeof(sparrow));
   init_jpeg_src(&sparrow);
 
   gettimeofday(&tv1, NULL);
@@ -0,0 +1,122 @@
+/*time how much of the image loading (load_images.c) set_caps waits for,
+  against the background page-in and a plain read of the blob, on a fake
+  content directory with the blob dropped from the page cache first.
+
+  usage: test [blob MB [content dir]] (default 200 MB, in a temporary
+  directory that is removed afterwards). The cache can only be dropped on
+  a real disk: on tmpfs all the numbers are warm ones.
+*/
+#include "test_common.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define FRAME_BYTES (100 << 10)
+
+static void
+drop_from_cache(const char *name){
+  int fd = open(name, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/*a blob of mb megabytes in FRAME_BYTES frames, and an index for it */
+static void
+make_content(const char *blob_name, const char *index_name, guint32 mb){
+  guint32 n = ((size_t)mb << 20) / FRAME_BYTES;
+  guint8 *buffer = malloc_or_die(FRAME_BYTES);
+  FILE *f = fopen(blob_name, "w");
+  for (guint32 i = 0; i < n; i++){
+    for (int j = 0; j < FRAME_BYTES; j++){
+      buffer[j] = i + j * 7;
+    }
+    fwrite(buffer, 1, FRAME_BYTES, f);
+  }
+  fclose(f);
+  free(buffer);
+
+  sparrow_frame_t *frames = zalloc_or_die(n * sizeof(sparrow_frame_t));
+  for (guint32 i = 0; i < n; i++){
+    frames[i].offset = i * FRAME_BYTES;
+    frames[i].jpeg_size = FRAME_BYTES;
+    for (int j = 0; j < 8; j++){
+      frames[i].successors[j] = (i + j + 1) % n;
+    }
+  }
+  sparrow_index_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SPARROW_INDEX_MAGIC, sizeof(header.magic));
+  header.version = SPARROW_INDEX_VERSION;
+  header.header_size = sizeof(header);
+  header.frame_size = sizeof(sparrow_frame_t);
+  header.image_count = n;
+  header.width = 800;
+  header.height = 600;
+  header.blob_size = n * FRAME_BYTES;
+  header.checksum = sparrow_adler32((guint8 *)frames, n * sizeof(sparrow_frame_t));
+  f = fopen(index_name, "w");
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(frames, sizeof(sparrow_frame_t), n, f);
+  fclose(f);
+  free(frames);
+}
+
+int main(int argc, char **argv)
+{
+  struct timeval tv1, tv2, tv3;
+  guint32 mb = (argc > 1) ? atoi(argv[1]) : 200;
+  char tmp[] = "/var/tmp/sparrow-test-XXXXXX";
+  const char *dir = (argc > 2) ? argv[2] : mkdtemp(tmp);
+  char *blob_name = g_build_filename(dir, "jpeg.blob", NULL);
+  char *index_name = g_build_filename(dir, "jpeg.index", NULL);
+  make_content(blob_name, index_name, mb);
+
+  /*a plain read of the whole blob, for comparison */
+  drop_from_cache(blob_name);
+  guint8 *buffer = malloc_or_die(1 << 20);
+  int fd = open(blob_name, O_RDONLY);
+  gettimeofday(&tv1, NULL);
+  while (read(fd, buffer, 1 << 20) > 0);
+  gettimeofday(&tv2, NULL);
+  close(fd);
+  free(buffer);
+  guint32 t_read = elapsed(&tv1, &tv2);
+
+  GstSparrow sparrow;
+  memset(&sparrow, 0, sizeof(sparrow));
+  sparrow.out.width = 800;
+  sparrow.out.height = 600;
+  sparrow.content = dir;
+  sparrow.shared = sparrow_get_shared();
+  drop_from_cache(blob_name);
+  /*what sparrow_init does */
+  gettimeofday(&tv1, NULL);
+  maybe_load_index(&sparrow);
+  int ok = check_content(&sparrow);
+  if (ok){
+    maybe_load_images(&sparrow);
+    ok = check_images(&sparrow);
+  }
+  gettimeofday(&tv2, NULL);
+  if (ok){
+    wait_for_images(&sparrow);
+  }
+  gettimeofday(&tv3, NULL);
+  printf("%u MB blob: plain read %u microseconds; set_caps waits %u, "
+      "background page-in done after %u %s\n", mb, t_read,
+      elapsed(&tv1, &tv2), elapsed(&tv1, &tv3), ok ? "ok" : "FAILED");
+
+  maybe_unload_images(&sparrow);
+  maybe_unload_index(&sparrow);
+  if (argc <= 2){
+    unlink(blob_name);
+    unlink(index_name);
+    rmdir(dir);
+  }
+  g_free(blob_name);
+  g_free(index_name);
+  return ! ok;
+}
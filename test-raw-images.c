@@ -0,0 +1,129 @@
+/*load a content directory with a raw blob (load_images.c) and check which
+  frames each instance would play: a raw blob with fewer frames than the
+  index is not used at all; a whole one is used by an instance whose caps
+  suit it, while another falls back to the jpegs, which have to be there. */
+#include "load_images.c"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define N_FRAMES 10
+#define FRAME_BYTES 1000
+#define WIDTH 64
+#define HEIGHT 48
+
+static char *
+write_file(const char *dir, const char *name, const void *data, size_t size){
+  char *path = g_build_filename(dir, name, NULL);
+  FILE *f = fopen(path, "w");
+  fwrite(data, 1, size, f);
+  fclose(f);
+  return path;
+}
+
+/*an index and jpeg blob of N_FRAMES, and a raw blob of n_raw frames */
+static void
+make_content(const char *dir, guint32 n_raw, gboolean with_jpegs){
+  guint8 *blob = zalloc_or_die(N_FRAMES * FRAME_BYTES);
+  sparrow_frame_t frames[N_FRAMES];
+  memset(frames, 0, sizeof(frames));
+  for (guint32 i = 0; i < N_FRAMES; i++){
+    frames[i].offset = i * FRAME_BYTES;
+    frames[i].jpeg_size = FRAME_BYTES;
+    frames[i].successors[0] = (i + 1) % N_FRAMES;
+  }
+  sparrow_index_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SPARROW_INDEX_MAGIC, sizeof(header.magic));
+  header.version = SPARROW_INDEX_VERSION;
+  header.header_size = sizeof(header);
+  header.frame_size = sizeof(sparrow_frame_t);
+  header.image_count = N_FRAMES;
+  header.width = WIDTH;
+  header.height = HEIGHT;
+  header.blob_size = N_FRAMES * FRAME_BYTES;
+  header.checksum = sparrow_adler32((guint8 *)frames, sizeof(frames));
+  guint8 *index = malloc_or_die(sizeof(header) + sizeof(frames));
+  memcpy(index, &header, sizeof(header));
+  memcpy(index + sizeof(header), frames, sizeof(frames));
+
+  size_t raw_size = SPARROW_RAW_HEADER_SIZE + n_raw * WIDTH * HEIGHT * PIXSIZE;
+  guint8 *raw = zalloc_or_die(raw_size);
+  sparrow_raw_header_t *rh = (sparrow_raw_header_t *)raw;
+  memcpy(rh->magic, SPARROW_RAW_MAGIC, sizeof(rh->magic));
+  rh->width = WIDTH;
+  rh->height = HEIGHT;
+  rh->rshift = 16;
+  rh->gshift = 8;
+  rh->bshift = 0;
+  rh->image_count = n_raw;
+
+  g_free(write_file(dir, JPEG_INDEX_NAME, index, sizeof(header) + sizeof(frames)));
+  g_free(write_file(dir, RAW_BLOB_NAME, raw, raw_size));
+  char *jpegs = write_file(dir, JPEG_BLOB_NAME, blob, N_FRAMES * FRAME_BYTES);
+  if (! with_jpegs){
+    unlink(jpegs);
+  }
+  g_free(jpegs);
+  free(blob);
+  free(index);
+  free(raw);
+}
+
+static void
+unload(GstSparrow *sparrow){
+  sparrow_shared_t *shared = sparrow->shared;
+  unload_images(sparrow);
+  unload_index(sparrow);
+  g_mutex_free(shared->load_mutex);
+  g_cond_free(shared->load_cond);
+  memset(shared, 0, sizeof(sparrow_shared_t));
+}
+
+/*load the content for an instance with xRGB caps, then see what it and an
+  instance with xBGR caps would play */
+static int
+check(const char *dir, const char *what, guint32 n_raw, gboolean with_jpegs,
+    gboolean rgb_raw, gboolean bgr_ok){
+  make_content(dir, n_raw, with_jpegs);
+  GstSparrow rgb, bgr;
+  memset(&rgb, 0, sizeof(rgb));
+  init_test_format(&rgb.out, WIDTH, HEIGHT);
+  rgb.content = dir;
+  rgb.shared = sparrow_get_shared();
+  bgr = rgb;
+  bgr.out.rshift = 0;
+  bgr.out.bshift = 16;
+  load_index(&rgb);
+  int ok = check_content(&rgb);
+  load_images(&rgb);
+  wait_for_images(&rgb);
+  ok = (ok && check_images(&rgb) && raw_images_suit(&rgb) == rgb_raw &&
+      check_images(&bgr) == bgr_ok && ! raw_images_suit(&bgr) &&
+      (rgb.shared->jpeg_blob != NULL) == with_jpegs);
+  printf("%s: %s raw frames, %s; other caps %s %s\n", what,
+      raw_images_suit(&rgb) ? "using" : "not using",
+      rgb.shared->jpeg_blob ? "jpegs mapped" : "no jpegs",
+      check_images(&bgr) ? "use the jpegs" : "can't play", ok ? "ok" : "WRONG");
+  unload(&rgb);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  char tmp[] = "/var/tmp/sparrow-test-XXXXXX";
+  const char *dir = mkdtemp(tmp);
+  int fails = 0;
+  fails += check(dir, "short raw blob", N_FRAMES - 1, TRUE, FALSE, TRUE);
+  fails += check(dir, "whole raw blob", N_FRAMES, TRUE, TRUE, TRUE);
+  fails += check(dir, "raw blob without jpegs", N_FRAMES, FALSE, TRUE, FALSE);
+  const char *names[] = {JPEG_INDEX_NAME, JPEG_BLOB_NAME, RAW_BLOB_NAME};
+  for (int i = 0; i < 3; i++){
+    char *path = g_build_filename(dir, names[i], NULL);
+    unlink(path);
+    g_free(path);
+  }
+  rmdir(dir);
+  return fails != 0;
+}
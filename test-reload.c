@@ -0,0 +1,247 @@
+/*save a calibration (edges.c) and reload it: into an element with the same
+  camera and projector, which should wait in find_edges with any others
+  still finding edges and then play with the saved lut; into one with
+  another projector, which should start from scratch; with too little
+  address space left to map the file, which should read it instead; with a
+  lut entry pointing past the camera frame, which should start from
+  scratch; and an old headerless file, which find_edges should read. */
+#include "edges.c"
+#include "test_common.h"
+#include <stdio.h>
+#include <sys/resource.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define SAVED "sparrow-test-calibration"
+#define OLD_STYLE "sparrow-test-old-calibration"
+#define DAMAGED "sparrow-test-damaged-calibration"
+#define LAG 5
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+/*what sparrow_init would have set up before reloading */
+static void
+init_element(GstSparrow *sparrow, int out_width, int out_height){
+  init_test_sparrow(sparrow);
+  init_test_format(&sparrow->out, out_width, out_height);
+  sparrow->colour = SPARROW_GREEN;
+  bitmask_init(&sparrow->screenmask, sparrow->in.width, sparrow->in.height);
+  sparrow->map_lut = zalloc_aligned_or_die(sparrow->out.pixcount * sizeof(guint32));
+  sparrow->reload = SAVED;
+}
+
+static void
+finalise_element(GstSparrow *sparrow){
+  if (sparrow->calibration_map){
+    munmap(sparrow->calibration_map, sparrow->calibration_size);
+  }
+  else {
+    free(sparrow->map_lut);
+  }
+  bitmask_free(&sparrow->screenmask);
+  finalise_test_sparrow(sparrow);
+}
+
+/*a calibration to reload, as find_edges would save it */
+static void
+save(GstSparrow *saved){
+  init_element(saved, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  saved->reload = NULL;
+  saved->lag = LAG;
+  for (guint32 i = 0; i < saved->out.pixcount; i++){
+    saved->map_lut[i] = (i * 7919) % saved->in.pixcount;
+  }
+  for (guint32 i = 0; i < 5000; i++){
+    bitmask_set(&saved->screenmask, rng_uniform_int(saved, saved->in.width),
+        rng_uniform_int(saved, saved->in.height));
+  }
+  init_find_edges(saved);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)saved->helper_struct;
+  save_calibration(saved, fl, SAVED);
+  finalise_find_edges(saved);
+  global_number_of_edge_finders = 0;
+}
+
+static int
+same_calibration(GstSparrow *a, GstSparrow *b){
+  return (a->lag == b->lag &&
+      ! memcmp(a->map_lut, b->map_lut, a->out.pixcount * sizeof(guint32)) &&
+      ! memcmp(a->screenmask.bits, b->screenmask.bits, sizeof(guint64) *
+          a->screenmask.row_words * a->screenmask.height));
+}
+
+/*run find_edges from wherever reload_calibration left it, with another
+  element still finding edges for the first few frames. Returns the
+  frames it took, or -1 if it didn't wait for the other one. */
+static int
+wait_for_others(GstSparrow *sparrow){
+  init_find_edges(sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow->helper_struct;
+  int f = -1;
+  if (fl->state == EDGES_WAIT_FOR_PLAY && global_number_of_edge_finders == 0){
+    GstBuffer *inbuf = gst_buffer_new();
+    GstBuffer *outbuf = gst_buffer_new();
+    GST_BUFFER_DATA(inbuf) = zalloc_aligned_or_die(sparrow->in.size);
+    GST_BUFFER_DATA(outbuf) = malloc_aligned_or_die(sparrow->out.size);
+    global_number_of_edge_finders = 1;
+    for (f = 1; mode_find_edges(sparrow, inbuf, outbuf) == SPARROW_STATUS_QUO; f++){
+      if (f == 10){
+        global_number_of_edge_finders = 0;
+      }
+    }
+    if (f <= 10){
+      f = -1;
+    }
+    free(GST_BUFFER_DATA(inbuf));
+    free(GST_BUFFER_DATA(outbuf));
+    GST_BUFFER_DATA(inbuf) = NULL;
+    GST_BUFFER_DATA(outbuf) = NULL;
+    gst_buffer_unref(inbuf);
+    gst_buffer_unref(outbuf);
+  }
+  /*saving a reloaded lut would write an empty map and mesh */
+  sparrow->save = SAVED ".not";
+  finalise_find_edges(sparrow);
+  if (access(sparrow->save, F_OK) == 0){
+    unlink(sparrow->save);
+    f = -1;
+  }
+  return f;
+}
+
+static int
+warm(GstSparrow *saved){
+  GstSparrow sparrow;
+  init_element(&sparrow, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  sparrow_state state = reload_calibration(&sparrow, SAVED);
+  int ok = (state == SPARROW_FIND_EDGES && sparrow.reloaded == SPARROW_RELOAD_LUT &&
+      sparrow.calibration_map && same_calibration(saved, &sparrow));
+  int frames = wait_for_others(&sparrow);
+  ok = ok && frames > 0 && same_calibration(saved, &sparrow);
+  printf("same camera and projector: mapped, waited %d frames for the others %s\n",
+      frames, ok ? "ok" : "WRONG");
+  finalise_element(&sparrow);
+  return ! ok;
+}
+
+/*find_edges would have asserted on reading the new file as an old one */
+static int
+mismatch(void){
+  GstSparrow sparrow;
+  init_element(&sparrow, 1024, 768);
+  sparrow_state state = reload_calibration(&sparrow, SAVED);
+  init_find_edges(&sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow.helper_struct;
+  int ok = (state == SPARROW_NEXT_STATE && sparrow.reloaded == SPARROW_RELOAD_NONE &&
+      fl->state == EDGES_FIND_NOISE && sparrow.lag == 0);
+  printf("another projector: recalibrating %s\n", ok ? "ok" : "WRONG");
+  finalise_find_edges(&sparrow);
+  global_number_of_edge_finders = 0;
+  finalise_element(&sparrow);
+  return ! ok;
+}
+
+/*less address space than the file needs, but enough to carry on */
+static int
+no_mmap(GstSparrow *saved){
+  GstSparrow sparrow;
+  init_element(&sparrow, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  struct rlimit old, tight;
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  int ok = (f && fscanf(f, "%ld", &pages) == 1);
+  if (f){
+    fclose(f);
+  }
+  getrlimit(RLIMIT_AS, &old);
+  tight = old;
+  tight.rlim_cur = pages * sysconf(_SC_PAGESIZE) + (1 << 20);
+  ok = ok && setrlimit(RLIMIT_AS, &tight) == 0;
+  sparrow_state state = reload_calibration(&sparrow, SAVED);
+  setrlimit(RLIMIT_AS, &old);
+  ok = (ok && state == SPARROW_FIND_EDGES && sparrow.reloaded == SPARROW_RELOAD_LUT &&
+      sparrow.calibration_map == NULL && same_calibration(saved, &sparrow));
+  int frames = wait_for_others(&sparrow);
+  ok = ok && frames > 0;
+  printf("no room to map the file: read it, waited %d frames %s\n", frames,
+      ok ? "ok" : "WRONG");
+  finalise_element(&sparrow);
+  return ! ok;
+}
+
+/*a copy of the saved file with one lut entry just past the camera frame */
+static int
+damaged(GstSparrow *saved){
+  GstSparrow sparrow;
+  init_element(&sparrow, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  sparrow.reload = DAMAGED;
+  sparrow_calibration_header_t h;
+  calibration_layout(saved, &h, (saved->out.width + LINE_PERIOD - 1) / LINE_PERIOD,
+      (saved->out.height + LINE_PERIOD - 1) / LINE_PERIOD);
+  guint8 *file = malloc_or_die(h.file_size);
+  FILE *f = fopen(SAVED, "r");
+  int ok = (fread(file, 1, h.file_size, f) == h.file_size);
+  fclose(f);
+  guint32 *lut = (guint32 *)(file + h.lut_offset);
+  lut[saved->out.pixcount / 2] = saved->in.pixcount;
+  f = fopen(DAMAGED, "w");
+  fwrite(file, 1, h.file_size, f);
+  fclose(f);
+  free(file);
+  sparrow_state state = reload_calibration(&sparrow, DAMAGED);
+  guint32 set = 0;
+  for (guint32 i = 0; i < sparrow.out.pixcount; i++){
+    set += (sparrow.map_lut[i] != 0);
+  }
+  ok = (ok && state == SPARROW_NEXT_STATE && sparrow.reloaded == SPARROW_RELOAD_NONE &&
+      sparrow.calibration_map == NULL && set == 0 && sparrow.lag == 0);
+  printf("lut pointing outside the camera: recalibrating %s\n", ok ? "ok" : "WRONG");
+  finalise_element(&sparrow);
+  unlink(DAMAGED);
+  return ! ok;
+}
+
+static int
+old_style(void){
+  GstSparrow sparrow;
+  init_element(&sparrow, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  sparrow.reload = OLD_STYLE;
+  sparrow_fl_condensed_t condensed = {
+    (sparrow.out.width + LINE_PERIOD - 1) / LINE_PERIOD,
+    (sparrow.out.height + LINE_PERIOD - 1) / LINE_PERIOD
+  };
+  FILE *f = fopen(OLD_STYLE, "w");
+  fwrite(&condensed, sizeof(condensed), 1, f);
+  fclose(f);
+  sparrow_state state = reload_calibration(&sparrow, OLD_STYLE);
+  init_find_edges(&sparrow);
+  sparrow_find_lines_t *fl = (sparrow_find_lines_t *)sparrow.helper_struct;
+  int ok = (state == SPARROW_FIND_EDGES && sparrow.reloaded == SPARROW_RELOAD_EDGES &&
+      fl->state == EDGES_FIND_CORNERS);
+  printf("old style file: read by find_edges %s\n", ok ? "ok" : "WRONG");
+  finalise_find_edges(&sparrow);
+  global_number_of_edge_finders = 0;
+  finalise_element(&sparrow);
+  unlink(OLD_STYLE);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  GstSparrow saved;
+  save(&saved);
+  int fails = 0;
+  fails += warm(&saved);
+  fails += mismatch();
+  fails += no_mmap(&saved);
+  fails += damaged(&saved);
+  fails += old_style();
+  finalise_element(&saved);
+  unlink(SAVED);
+  return fails != 0;
+}
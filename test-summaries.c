@@ -0,0 +1,66 @@
+/*check that the frame summary scan (summaries.h) finds the same frames as
+  the scalar loop, and time it over a large index of random summaries. */
+#include "test_common.h"
+#include "summaries.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define N_FRAMES 200000
+#define N_TARGETS 20
+
+int main(int argc, char **argv)
+{
+  struct timeval tv1, tv2;
+  guint32 t_scalar = 0;
+  guint32 t_scan = 0;
+  int fails = 0;
+  srand(TEST_RNG_SEED);
+  guint8 *summaries = malloc_aligned_or_die(N_FRAMES * SUMMARY_SIZE);
+  for (guint32 i = 0; i < N_FRAMES * SUMMARY_SIZE; i++){
+    summaries[i] = rand();
+  }
+  for (int k = 0; k < N_TARGETS; k++){
+    guint8 target[SUMMARY_SIZE];
+    guint32 best[ADAPTIVE_CANDIDATES];
+    guint32 ref[ADAPTIVE_CANDIDATES];
+    /*half the targets are near a frame, which should be found unless it is
+      in the excluded range */
+    guint32 near = rand() % N_FRAMES;
+    for (int i = 0; i < SUMMARY_SIZE; i++){
+      target[i] = (k & 1) ? summaries[near * SUMMARY_SIZE + i] ^ (rand() & 3) : rand();
+    }
+    guint32 lo = rand() % N_FRAMES;
+    guint32 hi = lo + ADAPTIVE_EXCLUDE;
+
+    gettimeofday(&tv1, NULL);
+    int n_ref = nearest_summaries_scalar(summaries, N_FRAMES, target, lo, hi, ref);
+    gettimeofday(&tv2, NULL);
+    t_scalar += elapsed(&tv1, &tv2);
+
+    gettimeofday(&tv1, NULL);
+    int n = nearest_summaries(summaries, N_FRAMES, target, lo, hi, best);
+    gettimeofday(&tv2, NULL);
+    t_scan += elapsed(&tv1, &tv2);
+
+    if (n != n_ref || memcmp(best, ref, n * sizeof(guint32))){
+      printf("target %d: scan and scalar loop disagree\n", k);
+      fails++;
+    }
+    for (int i = 0; i < n; i++){
+      if (best[i] >= lo && best[i] <= hi){
+        printf("target %d: found excluded frame %u\n", k, best[i]);
+        fails++;
+      }
+    }
+    if ((k & 1) && (near < lo || near > hi) && best[0] != near){
+      printf("target %d: missed frame %u, found %u\n", k, near, best[0]);
+      fails++;
+    }
+  }
+  printf("%d scans of %d summaries: scalar %u microseconds each, scan %u (%.1fx) %s\n",
+      N_TARGETS, N_FRAMES, t_scalar / N_TARGETS, t_scan / N_TARGETS,
+      (double)t_scalar / MAX(t_scan, 1), fails ? "MISMATCH" : "ok");
+  free(summaries);
+  return fails != 0;
+}
@@ -0,0 +1,149 @@
+/*play (play.c) with a simulated camera that sees the output some frames
+  late, and check which old frame is composited with each camera frame:
+  with the lag find_self would measure, it should be the one the camera
+  sees from the start; with a wrong lag and the track-lag property, it
+  should be once the tracking has settled. */
+#include "play.c"
+#include "test_common.h"
+#include <stdio.h>
+
+GST_DEBUG_CATEGORY (sparrow_debug);
+
+#define WIDTH 320
+#define HEIGHT 240
+#define BLOCK 16
+#define FRAMES 400
+/*the tracking should have settled by then */
+#define SETTLE 200
+
+/*sparrow.c's version writes the frame out as an image, which isn't wanted
+  here */
+INVISIBLE void
+debug_frame(GstSparrow *sparrow, guint8 *data, guint32 width, guint32 height, int pixsize){
+}
+
+/*content that changes a block at a time, as video mostly does */
+static void
+fake_output(GstSparrow *sparrow, guint32 *out, const guint32 *prev){
+  memcpy(out, prev, sparrow->out.size);
+  for (int by = 0; by < HEIGHT; by += BLOCK){
+    for (int bx = 0; bx < WIDTH; bx += BLOCK){
+      if (rng_uniform_int(sparrow, 3)){
+        continue;
+      }
+      guint32 v = rng_uniform_int(sparrow, 256) << sparrow->out.gshift;
+      for (int y = by; y < by + BLOCK; y++){
+        for (int x = bx; x < bx + BLOCK; x++){
+          out[y * WIDTH + x] = v;
+        }
+      }
+    }
+  }
+}
+
+/*a little noise on what the camera sees */
+static void
+fake_camera(GstSparrow *sparrow, guint32 *in, const guint32 *seen){
+  for (guint32 i = 0; i < sparrow->in.pixcount; i++){
+    int g = ((seen[i] >> sparrow->out.gshift) & 255) + rng_uniform_int(sparrow, 9) - 4;
+    in[i] = CLAMP(g, 0, 255) << sparrow->in.gshift;
+  }
+}
+
+/*play FRAMES frames; the old frame has to be the one the camera sees from
+  SETTLE frames on, and the lag has to end up as find_self would find it */
+static int
+play(int late, int calibrated_lag, gboolean track){
+  GstSparrow sparrow;
+  init_test_sparrow(&sparrow);
+  init_test_format(&sparrow.in, WIDTH, HEIGHT);
+  init_test_format(&sparrow.out, WIDTH, HEIGHT);
+  sparrow.map_lut = malloc_aligned_or_die(sparrow.out.pixcount * sizeof(guint32));
+  for (guint32 i = 0; i < sparrow.out.pixcount; i++){
+    sparrow.map_lut[i] = i;
+  }
+  sparrow.lag = calibrated_lag;
+  sparrow.track_lag = track;
+  /*the parts of init_play that don't involve content */
+  sparrow_play_t *player = zalloc_aligned_or_die(sizeof(sparrow_play_t));
+  sparrow.helper_struct = player;
+  init_play_lag(&sparrow, player);
+
+  GstBuffer *outbufs[FRAMES];
+  guint32 *in = malloc_aligned_or_die(sparrow.in.size);
+  int settled = -1;
+  for (int t = 0; t < FRAMES; t++){
+    outbufs[t] = gst_buffer_new();
+    guint32 *out = malloc_aligned_or_die(sparrow.out.size);
+    GST_BUFFER_DATA(outbufs[t]) = (guint8 *)out;
+    if (t){
+      fake_output(&sparrow, out, (guint32 *)GST_BUFFER_DATA(outbufs[t - 1]));
+    }
+    else {
+      memset(out, 0, sparrow.out.size);
+    }
+    const guint8 *seen = (t >= late) ? GST_BUFFER_DATA(outbufs[t - late]) : NULL;
+    if (seen){
+      fake_camera(&sparrow, in, (const guint32 *)seen);
+    }
+    else {
+      memset(in, 0, sparrow.in.size);
+    }
+    /*as mode_play does, but without compositing */
+    store_old_frame(&sparrow, outbufs[t]);
+    GstBuffer *oldbuf = player->old_frames[player->old_frames_tail];
+    gboolean right = (seen && oldbuf && GST_BUFFER_DATA(oldbuf) == seen);
+    if (! right){
+      settled = -1;
+    }
+    else if (settled < 0){
+      settled = t;
+    }
+    drop_old_frame(&sparrow, outbufs[t]);
+    track_lag(&sparrow, player, (guint8 *)in, (guint8 *)out);
+    player->frame_count++;
+  }
+  int ok = (settled >= 0 && settled <= SETTLE && player->lag == late &&
+      sparrow.lag == (guint32)late - 1);
+  printf("camera %d frames late, calibrated lag %d, %s: ", late, calibrated_lag,
+      track ? "tracking" : "not tracking");
+  if (settled >= 0){
+    printf("old frame right from frame %d, lag %u %s\n", settled, sparrow.lag,
+        ok ? "ok" : "WRONG");
+  }
+  else {
+    printf("old frame wrong at the end, lag %u %s\n", sparrow.lag, ok ? "ok" : "WRONG");
+  }
+
+  for (int i = 0; i < OLD_FRAMES; i++){
+    if (player->old_frames[i]){
+      gst_buffer_unref(player->old_frames[i]);
+    }
+  }
+  for (int t = 0; t < FRAMES; t++){
+    free(GST_BUFFER_DATA(outbufs[t]));
+    GST_BUFFER_DATA(outbufs[t]) = NULL;
+    gst_buffer_unref(outbufs[t]);
+  }
+  if (track){
+    finalise_lag_tracking(player);
+  }
+  free(player);
+  free(in);
+  free(sparrow.map_lut);
+  finalise_test_sparrow(&sparrow);
+  return ! ok;
+}
+
+int main(int argc, char **argv)
+{
+  gst_init(&argc, &argv);
+  int fails = 0;
+  for (int late = 1; late < OLD_FRAMES; late++){
+    fails += play(late, late - 1, FALSE);
+  }
+  for (int late = 1; late < OLD_FRAMES; late++){
+    fails += play(late, (late == 1) ? 2 : 0, TRUE);
+  }
+  return fails != 0;
+}
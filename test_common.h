@@ -0,0 +1,72 @@
+#ifndef __SPARROW_TEST_COMMON_H__
+#define __SPARROW_TEST_COMMON_H__
+/* Shared by the standalone tests (test-*.c): timing, a fake element with a
+   1920x1080 projector and a 1280x720 camera, and where that camera sees the
+   projector. */
+
+#include "gstsparrow.h"
+#include "sparrow.h"
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_RNG_SEED 12345
+#define TEST_OUT_WIDTH 1920
+#define TEST_OUT_HEIGHT 1080
+#define TEST_IN_WIDTH 1280
+#define TEST_IN_HEIGHT 720
+
+static UNUSED guint32
+elapsed(struct timeval *tv1, struct timeval *tv2){
+  return ((tv2->tv_sec - tv1->tv_sec) * 1000000 +
+      tv2->tv_usec - tv1->tv_usec);
+}
+
+/*where the camera sees projector point u, v: rotated a little, with a bit of
+  keystone, and hanging off the top and left of the camera's view */
+static UNUSED void
+project(double u, double v, double *x, double *y){
+  double d = 1.0 + 0.00005 * u;
+  *x = (-80 + 0.75 * u + 0.02 * v) / d;
+  *y = (-50 + 0.75 * v - 0.015 * u) / d;
+}
+
+/*a format as extract_caps (sparrow.c) would find it for xRGB video */
+static UNUSED void
+init_test_format(sparrow_format *im, int width, int height){
+  memset(im, 0, sizeof(sparrow_format));
+  im->width = width;
+  im->height = height;
+  im->rshift = 16;
+  im->gshift = 8;
+  im->bshift = 0;
+  im->rmask = 0xff << im->rshift;
+  im->gmask = 0xff << im->gshift;
+  im->bmask = 0xff << im->bshift;
+  im->rbyte = im->rshift / 8;
+  im->gbyte = im->gshift / 8;
+  im->bbyte = im->bshift / 8;
+  im->pixcount = im->width * im->height;
+  im->size = im->pixcount * PIXSIZE;
+  im->colours[SPARROW_WHITE] = im->rmask | im->gmask | im->bmask;
+  im->colours[SPARROW_GREEN] = im->gmask;
+  im->colours[SPARROW_MAGENTA] = im->rmask | im->bmask;
+}
+
+/*an element with nothing set up but the random number generator (always
+  seeded the same) and the projector and camera formats */
+static UNUSED void
+init_test_sparrow(GstSparrow *sparrow){
+  memset(sparrow, 0, sizeof(GstSparrow));
+  sparrow->dsfmt = malloc_aligned_or_die(sizeof(dsfmt_t));
+  dsfmt_init_gen_rand(sparrow->dsfmt, TEST_RNG_SEED);
+  init_test_format(&sparrow->out, TEST_OUT_WIDTH, TEST_OUT_HEIGHT);
+  init_test_format(&sparrow->in, TEST_IN_WIDTH, TEST_IN_HEIGHT);
+}
+
+static UNUSED void
+finalise_test_sparrow(GstSparrow *sparrow){
+  free(sparrow->dsfmt);
+  sparrow->dsfmt = NULL;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/* Copyright (C) <2010> Douglas Bagnall <douglas@halo.gen.nz>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A worker pool for splitting per-frame work into bands.
+
+   The pool is shared between all sparrow instances (like the images).  Each
+   instance has its own job struct, because each instance only runs one set
+   of bands at a time, on its own streaming thread.  The calling thread does
+   the first band itself, then waits for the others.
+
+   sparrow_run_bands(sparrow, func, data, n) calls func(sparrow, data, start,
+   end) for consecutive, non-overlapping [start, end) ranges covering 0 to n.
+*/
+
+#include "sparrow.h"
+#include "gstsparrow.h"
+
+#include <string.h>
+#include <unistd.h>
+
+struct sparrow_bands_s {
+  sparrow_band_func func;
+  void *data;
+  GstSparrow *sparrow;
+  gint remaining;
+  GMutex *mutex;
+  GCond *cond;
+  int n_bands;
+  int starts[SPARROW_MAX_THREADS + 1];
+};
+
+typedef struct sparrow_band_s {
+  struct sparrow_bands_s *bands;
+  int index;
+} sparrow_band_t;
+
+
+static void
+run_one_band(gpointer p, gpointer user_data){
+  sparrow_band_t *band = (sparrow_band_t *)p;
+  struct sparrow_bands_s *bands = band->bands;
+  bands->func(bands->sparrow, bands->data,
+      bands->starts[band->index], bands->starts[band->index + 1]);
+  g_mutex_lock(bands->mutex);
+  bands->remaining--;
+  if (bands->remaining == 0){
+    g_cond_signal(bands->cond);
+  }
+  g_mutex_unlock(bands->mutex);
+}
+
+static gpointer
+make_pool(gpointer p){
+  int n_cpus = sparrow_cpu_count();
+  GError *err = NULL;
+  GThreadPool *pool = g_thread_pool_new(run_one_band, NULL, MAX(n_cpus, 1), TRUE, &err);
+  if (! pool){
+    GST_WARNING("could not start thread pool: %s\n", err ? err->message : "?");
+  }
+  GST_INFO("started thread pool with %d threads\n", n_cpus);
+  return pool;
+}
+
+static GThreadPool *
+get_pool(void){
+  static GOnce pool_once = G_ONCE_INIT;
+  g_once(&pool_once, make_pool, NULL);
+  return (GThreadPool *)pool_once.retval;
+}
+
+INVISIBLE int
+sparrow_cpu_count(void){
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1){
+    n = 1;
+  }
+  return MIN(n, SPARROW_MAX_THREADS);
+}
+
+INVISIBLE void
+sparrow_run_bands(GstSparrow *sparrow, sparrow_band_func func, void *data, int n){
+  struct sparrow_bands_s *bands = sparrow->bands;
+  GThreadPool *pool = get_pool();
+  int n_bands = MIN(bands->n_bands, n);
+  if (n_bands <= 1 || pool == NULL){
+    func(sparrow, data, 0, n);
+    return;
+  }
+  sparrow_band_t band_args[SPARROW_MAX_THREADS];
+  int i;
+  for (i = 0; i <= n_bands; i++){
+    bands->starts[i] = (int)(((gint64)n * i) / n_bands);
+  }
+  bands->func = func;
+  bands->data = data;
+  bands->sparrow = sparrow;
+  bands->remaining = n_bands - 1;
+  for (i = 1; i < n_bands; i++){
+    band_args[i].bands = bands;
+    band_args[i].index = i;
+    g_thread_pool_push(pool, &band_args[i], NULL);
+  }
+  func(sparrow, data, bands->starts[0], bands->starts[1]);
+
+  g_mutex_lock(bands->mutex);
+  while (bands->remaining){
+    g_cond_wait(bands->cond, bands->mutex);
+  }
+  g_mutex_unlock(bands->mutex);
+}
+
+INVISIBLE void
+init_threads(GstSparrow *sparrow){
+  struct sparrow_bands_s *bands = zalloc_or_die(sizeof(struct sparrow_bands_s));
+  bands->mutex = g_mutex_new();
+  bands->cond = g_cond_new();
+  bands->n_bands = (sparrow->n_threads) ? (int)sparrow->n_threads : sparrow_cpu_count();
+  bands->n_bands = CLAMP(bands->n_bands, 1, SPARROW_MAX_THREADS);
+  GST_DEBUG("using %d bands\n", bands->n_bands);
+  sparrow->bands = bands;
+}
+
+INVISIBLE void
+finalise_threads(GstSparrow *sparrow){
+  struct sparrow_bands_s *bands = sparrow->bands;
+  if (bands){
+    g_mutex_free(bands->mutex);
+    g_cond_free(bands->cond);
+    free(bands);
+    sparrow->bands = NULL;
+  }
+}